@@ -1,30 +1,94 @@
 // SPDX-License-Identifier: GPL-2.0-only
 // Copyright 2024 Jaroslav Rohel, jaroslav.rohel@gmail.com
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <glob.h>
+#include <math.h>
+#include <netdb.h>
 #include <poll.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "fcsreader.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
+
 
 static const char CYFLOWREC_VERSION[] = "0.4.0";
 
+static const char ARG_EVENT_SOCKET[] = "--event-socket";
+static const char ARG_FCS_COLUMNAR[] = "--fcs-columnar";
+static const char ARG_FCS_PREVIEW[] = "--fcs-preview";
+static const char ARG_FCS_PREVIEW_DENSITY[] = "--fcs-preview-density";
+static const char ARG_FCS_STATS[] = "--fcs-stats";
+static const char ARG_FROM[] = "--from";
 static const char ARG_HELP[] = "--help";
+static const char ARG_HOOK_QUEUE_FILE[] = "--hook-queue-file";
+static const char ARG_HOOK_RETRIES[] = "--hook-retries";
+static const char ARG_HOOK_TIMEOUT[] = "--hook-timeout";
+static const char ARG_HOOK_WORKERS[] = "--hook-workers";
+static const char ARG_INDEX_FILE[] = "--index-file";
+static const char ARG_JOBS[] = "--jobs";
+static const char ARG_LISTEN[] = "--listen";
+static const char ARG_MATCH[] = "--match";
+static const char ARG_METADATA_DIR[] = "--metadata-dir";
+static const char ARG_METADATA_SEGMENT_AGE[] = "--metadata-segment-age";
+static const char ARG_INTERCHARACTER_TIMEOUT[] = "--intercharacter-timeout";
+static const char ARG_IO_BACKEND[] = "--io-backend";
+static const char ARG_ON_FILE_RECEIVED[] = "--on-file-received";
+static const char ARG_PAYLOAD_SPLICE[] = "--payload-splice";
+static const char ARG_PAYLOAD_TEE_SOCKET[] = "--payload-tee-socket";
 static const char ARG_PORT_DEV[] = "--port-dev";
+static const char ARG_PORT_GLOB[] = "--port-glob";
+static const char ARG_RECV_BUFFER_SIZE[] = "--recv-buffer-size";
+static const char ARG_REBUILD[] = "--rebuild";
+static const char ARG_RELAY_QUEUE_FILE[] = "--relay-queue-file";
+static const char ARG_RELAY_TO[] = "--relay-to";
+static const char ARG_RESYNC[] = "--resync";
+static const char ARG_SPOOL_DIR[] = "--spool-dir";
+static const char ARG_SPOOL_FLUSH_AGE[] = "--spool-flush-age";
+static const char ARG_SPOOL_FLUSH_SIZE[] = "--spool-flush-size";
+static const char ARG_SPOOL_SIZE[] = "--spool-size";
+static const char ARG_STORAGE_ARCHIVE_DIR[] = "--storage-archive-dir";
 static const char ARG_STORAGE_CREATE_DIRS[] = "--storage-create-dirs";
 static const char ARG_STORAGE_DIR[] = "--storage-dir";
 static const char ARG_STORAGE_FILE_EXISTS[] = "--storage-file-exists";
 static const char ARG_STORAGE_FILE_PATH[] = "--storage-file-path";
+static const char ARG_STORAGE_INDEX[] = "--storage-index";
+static const char ARG_STORAGE_MMAP[] = "--storage-mmap";
+static const char ARG_STORAGE_QUOTA[] = "--storage-quota";
+static const char ARG_STORAGE_QUOTA_WATERMARKS[] = "--storage-quota-watermarks";
+static const char ARG_STORAGE_SHARD_LEVELS[] = "--storage-shard-levels";
+static const char ARG_STORAGE_SYNC[] = "--storage-sync";
+static const char ARG_TO[] = "--to";
+static const char ARG_TRANSFER_TIMEOUT[] = "--transfer-timeout";
 
 
 enum log_priority { LOG_ERROR, LOG_WARNING, LOG_INFO, LOG_DEBUG };
@@ -33,11 +97,59 @@ static const char * const log_priority_strings[] = {"ERROR", "WARNING", "INFO",
 
 enum storage_file_exists_policy { FILE_REPLACE, FILE_DROP };
 
-static const char * port_dev = NULL;
+enum io_backend { IO_BACKEND_POLL, IO_BACKEND_IO_URING };
+
+enum fcs_preview_format { FCS_PREVIEW_NONE, FCS_PREVIEW_PGM, FCS_PREVIEW_PNG };
+
+enum fcs_columnar_type { FCS_COLUMNAR_NONE, FCS_COLUMNAR_FLOAT32, FCS_COLUMNAR_UINT16 };
+
+static const char ** port_devs = NULL;
+static size_t port_devs_len = 0;
+static const char * port_glob = NULL;
 static bool storage_create_dirs = false;
 static const char * storage_dir = NULL;
 static enum storage_file_exists_policy file_exists_policy = FILE_REPLACE;
 static const char * storage_file_path = NULL;
+static bool storage_mmap = false;
+static bool storage_sync = false;
+static bool storage_index = false;
+static const char * index_file_path = NULL;  // NULL = INDEX_DEFAULT_NAME in the indexed directory
+static size_t storage_quota = 0;  // 0 = unlimited
+static unsigned int storage_quota_low = 80;   // percent of the quota
+static unsigned int storage_quota_high = 90;  // percent of the quota
+static const char * storage_archive_dir = NULL;
+static const char * on_file_received = NULL;
+static unsigned int hook_workers = 2;
+static int64_t hook_timeout_ms = 60 * 1000;  // 0 = unlimited
+static unsigned int hook_retries = 3;
+static const char * hook_queue_file = NULL;
+static const char * event_socket = NULL;
+static const char * payload_tee_socket = NULL;
+static bool fcs_stats = false;
+static enum fcs_preview_format fcs_preview = FCS_PREVIEW_NONE;
+static char * fcs_preview_density_x = NULL;  // $PnN of the density plot x axis, NULL = first parameter
+static char * fcs_preview_density_y = NULL;
+static enum fcs_columnar_type fcs_columnar = FCS_COLUMNAR_NONE;
+static unsigned int storage_shard_levels = 0;  // 0 = flat storage directory
+static const unsigned int MAX_STORAGE_SHARD_LEVELS = 3;
+static const char FCS_STATS_SUFFIX[] = ".stats";
+// Suffixes of the sidecar files stored next to a received file
+static const char * const SIDECAR_SUFFIXES[] = {
+    ".stats", ".hist.pgm", ".hist.png", ".density.pgm", ".density.png", ".col"};
+// Default name of the metadata index file in the storage directory, see "cyflowrec index"
+static const char INDEX_DEFAULT_NAME[] = ".cyflowrec-index";
+static int64_t intercharacter_timeout_ms = 1000;
+static int64_t transfer_timeout_ms = 0;  // 0 = disabled
+static size_t recv_buffer_size = 4096;
+static bool resync = true;
+static bool payload_splice = false;
+static enum io_backend io_backend = IO_BACKEND_POLL;
+static const char * spool_dir = NULL;
+static size_t spool_size = 16 * 1024 * 1024;
+static size_t spool_flush_size = 1024 * 1024;
+static int64_t spool_flush_age_ms = 60 * 1000;
+static const size_t MIN_RECV_BUFFER_SIZE = 128;
+static const size_t MAX_RECV_BUFFER_SIZE = 1024 * 1024;
 
 static char received_file_name[64];  // name of the currently receiving file
 
@@ -240,7 +352,7 @@ static struct tokens parse_storage_file_path(const char * in, const char * rcv_f
     struct token * token_items = NULL;
     do {
         const char * var_ptr = strstr(start_ptr, "${");
-        const int len = var_ptr - start_ptr;
+        const size_t len = (var_ptr ? var_ptr : in_end_ptr) - start_ptr;
         if (len > 0) {
             token_items = realloc_assert(token_items, (token_items_len + 1) * sizeof(struct token));
             token_items[token_items_len].func = subst_append_text;
@@ -320,8 +432,47 @@ static bool mkdirs(const char * path) {
 }
 
 
+static uint32_t fnv1a_hash(const char * str) {
+    uint32_t hash = 2166136261u;
+    for (const char * ch = str; *ch != '\0'; ++ch) {
+        hash = (hash ^ (unsigned char)*ch) * 16777619u;
+    }
+    return hash;
+}
+
+
+// Returns the length of the sidecar suffix of the file name or 0 if it is not a sidecar file.
+static size_t sidecar_suffix_len(const char * name) {
+    const size_t name_len = strlen(name);
+    for (size_t i = 0; i < sizeof(SIDECAR_SUFFIXES) / sizeof(SIDECAR_SUFFIXES[0]); ++i) {
+        const size_t suffix_len = strlen(SIDECAR_SUFFIXES[i]);
+        if (name_len > suffix_len && strcmp(name + name_len - suffix_len, SIDECAR_SUFFIXES[i]) == 0) {
+            return suffix_len;
+        }
+    }
+    return 0;
+}
+
+
+// Returns the path of the file `name` in the storage directory `dir`. With `levels` > 0, the file is placed
+// in nested shard directories named by the bytes of the FNV-1a hash of the name, eg "<dir>/3f/a0/<name>".
+// Each level has up to 256 directories. A sidecar file is placed next to the file it belongs to.
+static char * shard_file_path(const char * dir, const char * name, unsigned int levels) {
+    char * const base_name = my_strdup(name);
+    base_name[strlen(name) - sidecar_suffix_len(name)] = '\0';
+    const uint32_t hash = fnv1a_hash(base_name);
+    free(base_name);
+    char shards[3 * 4 + 1] = "";
+    for (unsigned int i = 0; i < levels; ++i) {
+        sprintf(shards + 3 * i, "%02x/", (unsigned int)(hash >> (8 * i)) & 0xFF);
+    }
+    return sprintf_malloc("%s/%s%s", dir, shards, name);
+}
+
+
 // 9600 baud, 8 bits, 2 stop bits and no parity check
-static bool set_port(int fd) {
+// The set attributes are stored in `tty_out`.
+static bool set_port(int fd, struct termios * restrict tty_out) {
     struct termios tty;
 
     if (tcgetattr(fd, &tty) != 0) {
@@ -348,530 +499,7977 @@ static bool set_port(int fd) {
     // no canonical processing
     tty.c_oflag = 0;  // no remapping, no delays
 
-    tty.c_cc[VMIN] = 128;  // wait for 128 characters
-    tty.c_cc[VTIME] = 5;   // intercharacter timeout 5 deciseconds (0.5 second)
+    // The port is opened in non-blocking mode, VMIN is the number of characters needed to wake up poll().
+    // The receive loop changes it according to the transfer phase. Timeouts are handled by the receive loop,
+    // the termios intercharacter timer is not used.
+    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 0;
 
     if (tcsetattr(fd, TCSANOW, &tty) != 0) {
         log_fmtmsg(LOG_ERROR, "Cannot set port attributes: %s", strerror(errno));
         return false;
     }
 
+    *tty_out = tty;
     return true;
 }
 
 
-static ssize_t read_timeout(int fd, void * buf, size_t nbytes, int timeout) {
-    struct pollfd fds = {.fd = fd, .events = POLLIN, .revents = 0};
-    const int poll_ret = poll(&fds, 1, timeout);
-    if (poll_ret == -1) {
-        log_fmtmsg(LOG_ERROR, "poll: %s", strerror(errno));
-        return -1;
-    }
-    if ((fds.revents & POLLERR) != 0) {
-        log_msg(LOG_ERROR, "Cannot read serial device");
-        return -1;
-    }
-    if ((fds.revents & POLLIN) == 0) {
-        return 0;
-    }
-    return read(fd, buf, nbytes);
+// Returns the current time of the monotonic clock in milliseconds.
+static int64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 
-// Transfered data contain [KEY]<value> pairs folowed by file content. [FILENAME] and [FILESIZE] are mandatory.
-// Example: [FILENAME]<A0000001.FCS>[FILESIZE]<9732>FCS2.0...
-static void recv_loop(struct tokens tokens) {
-    int port_fd;
-    if ((port_fd = open(port_dev, O_RDWR | O_NOCTTY)) == -1) {
-        log_fmtmsg(LOG_ERROR, "Cannot open port \"%s\": %s", port_dev, strerror(errno));
-        return;
-    }
-    if (!set_port(port_fd)) {
-        close(port_fd);
-        return;
-    }
+static const int64_t NO_DEADLINE = INT64_MAX;
 
-    int file_fd = -1;
 
-    char * rcv_file_name = NULL;
-    size_t rcv_file_size = 0;
-    char * storage_file_path = NULL;
-    char buf[128];
-    size_t buf_data_len = 0;
+// Metadata index of a storage tree.
+// The index is a text file. The first line is INDEX_MAGIC, then there is a line for each FCS file sorted
+// by the path: tab separated fields <path relative to the tree> <size> <mtime> followed by pairs
+// <keyword> <value> of the TEXT segment. Per-parameter keywords are omitted except $PnN and $PnS.
+// Backslash, tab and line end in the fields are escaped as \\, \t and \n.
+// The inverted index "<index>.keys" has the line INDEX_MAGIC followed by a sorted line
+// <KEYWORD> <value> <path> for each keyword of each indexed file, so the files with a keyword value
+// are found by a binary search. The keywords are upper case there.
+// Files saved after the index was built are appended to the journal "<index>.log" (--storage-index,
+// the receiver uses the same --index-file as the commands) in the format of the index lines. A line
+// with only the path means that the file was removed from the storage. The index command moves
+// the journal to "<index>.log.old" before the tree is scanned and removes it when the new index
+// is written.
 
-    size_t requested_reading_len = 1;
-    int timeout_ms = -1;  // timeout in miliseconds, -1 = infinite
-    size_t total_rcv_file_bytes;
-    enum read_state {
-        READ_START,
-        READ_NEXT,
-        READ_KEY,
-        READ_FILE_NAME,
-        READ_FILE_SIZE,
-        READ_UNKNOWN_VALUE,
-        READ_FILE,
-        READ_DISCARD_UNTIL_TIMEOUT
-    } state = READ_START;
-    bool discard_message_logged;
-    while (true) {
-        const ssize_t read_len = read_timeout(port_fd, buf + buf_data_len, requested_reading_len, timeout_ms);
+static const char INDEX_MAGIC[] = "CYFLOWREC-INDEX 1";
+static const char INDEX_KEYS_SUFFIX[] = ".keys";
+static const char INDEX_LOG_SUFFIX[] = ".log";
+static const char INDEX_OLD_LOG_SUFFIX[] = ".log.old";
 
-        if (read_len == -1) {
-            break;
-        }
+struct index_entry {
+    const char * path;  // relative to the indexed directory
+    uint64_t size;
+    int64_t mtime;
+};
 
-        if (read_len == 0) {
-            if (state != READ_START && state != READ_DISCARD_UNTIL_TIMEOUT) {
-                log_msg(LOG_ERROR, "Timeout, data reception not completed");
-            }
-            if (file_fd != -1) {
-                close(file_fd);
-                file_fd = -1;
-            }
-            if (storage_file_path) {
-                free(storage_file_path);
-                storage_file_path = NULL;
-            }
-            if (rcv_file_name) {
-                free(rcv_file_name);
-                rcv_file_name = NULL;
-            }
-            rcv_file_size = 0;
-            buf_data_len = 0;
-            requested_reading_len = 1;
-            timeout_ms = -1;
-            if (state == READ_DISCARD_UNTIL_TIMEOUT) {
-                log_msg(LOG_INFO, "Discarding of received data stopped. Ready to receive the next file");
-            }
-            state = READ_START;
-            continue;
-        }
 
-        switch (state) {
-            case READ_START:
-                if (buf[0] != '[') {
-                    log_msg(LOG_ERROR, "Unexpected character received");
-                    continue;
-                }
-                discard_message_logged = false;
-                log_msg(LOG_INFO, "Start receiving");
-                timeout_ms = 1000;
-                state = READ_KEY;
-                break;
-            case READ_KEY:
-                if (buf[buf_data_len] == ']') {
-                    buf[buf_data_len] = '\0';
-                    if (strcmp(buf, "FILENAME") == 0) {
-                        if (rcv_file_name) {
-                            log_msg(LOG_WARNING, "Received FILENAME key again");
-                            free(rcv_file_name);
-                            rcv_file_name = NULL;
-                            rcv_file_size = 0;
-                        }
-                        state = READ_FILE_NAME;
-                    } else if (strcmp(buf, "FILESIZE") == 0) {
-                        if (!rcv_file_name) {
-                            log_msg(LOG_ERROR, "Received FILESIZE key before FILENAME");
-                            state = READ_DISCARD_UNTIL_TIMEOUT;
-                            buf_data_len = 0;
-                            requested_reading_len = sizeof(buf);
-                            break;
-                        }
-                        if (rcv_file_size > 0) {
-                            log_msg(LOG_ERROR, "Received FILESIZE key again");
-                            state = READ_DISCARD_UNTIL_TIMEOUT;
-                            buf_data_len = 0;
-                            requested_reading_len = sizeof(buf);
-                            break;
-                        }
-                        state = READ_FILE_SIZE;
-                    } else {
-                        log_fmtmsg(LOG_DEBUG, "Received unknown key: %s", buf);
-                        state = READ_UNKNOWN_VALUE;
-                    }
-                    buf_data_len = 0;
-                } else {
-                    if (++buf_data_len >= sizeof(buf)) {
-                        log_msg(LOG_ERROR, "Received key name is too long");
-                        state = READ_DISCARD_UNTIL_TIMEOUT;
-                        buf_data_len = 0;
-                        requested_reading_len = sizeof(buf);
-                    }
-                }
-                break;
-            case READ_FILE_NAME:
-                if (buf[buf_data_len] == '>') {
-                    buf[buf_data_len] = '\0';
-                    bool bad_filename = false;
-                    for (const char * ch = buf + 1; *ch != '\0'; ++ch) {
-                        if (*ch != '.' && !isdigit(*ch) && !isupper(*ch) && !islower(*ch)) {
-                            log_fmtmsg(LOG_ERROR, "Received FILENAME contains forbidden characters: %s", buf + 1);
-                            bad_filename = true;
-                            state = READ_DISCARD_UNTIL_TIMEOUT;
-                            requested_reading_len = sizeof(buf);
-                            break;
-                        }
-                    }
-                    if (!bad_filename) {
-                        log_fmtmsg(LOG_DEBUG, "Received FILENAME: %s", buf + 1);
-                        rcv_file_name = my_strdup(buf + 1);
-                        state = READ_NEXT;
-                    }
-                    buf_data_len = 0;
-                } else {
-                    if (buf_data_len > sizeof(received_file_name) || ++buf_data_len >= sizeof(buf)) {
-                        log_msg(LOG_ERROR, "Received FILENAME is too long");
-                        state = READ_DISCARD_UNTIL_TIMEOUT;
-                        buf_data_len = 0;
-                        requested_reading_len = sizeof(buf);
-                    }
-                }
-                break;
-            case READ_FILE_SIZE:
-                if (buf[buf_data_len] == '>') {
-                    buf[buf_data_len] = '\0';
-                    char * endptr;
-                    long file_size = strtol(buf + 1, &endptr, 10);
-                    if (file_size < 0 || endptr != buf + buf_data_len) {
-                        log_fmtmsg(LOG_ERROR, "Received invalid FILESIZE: %s", buf + 1);
-                        state = READ_DISCARD_UNTIL_TIMEOUT;
-                        buf_data_len = 0;
-                        requested_reading_len = sizeof(buf);
-                        break;
-                    }
-                    log_fmtmsg(LOG_DEBUG, "Received FILESIZE: %s", buf + 1);
-                    rcv_file_size = file_size;
-                    state = READ_NEXT;
-                    buf_data_len = 0;
-                } else {
-                    if (++buf_data_len >= sizeof(buf)) {
-                        log_msg(LOG_ERROR, "Received FILESIZE is too long");
-                        state = READ_DISCARD_UNTIL_TIMEOUT;
-                        buf_data_len = 0;
-                        requested_reading_len = sizeof(buf);
-                    }
-                }
+static void index_write_field(FILE * file, const char * str) {
+    for (const char * ch = str; *ch != '\0'; ++ch) {
+        switch (*ch) {
+            case '\\':
+                fputs("\\\\", file);
                 break;
-            case READ_UNKNOWN_VALUE:
-                if (buf[buf_data_len] == '>') {
-                    state = READ_NEXT;
-                }
-                break;
-            case READ_NEXT:
-                if (buf[0] == '[') {
-                    state = READ_KEY;
-                } else {
-                    if (rcv_file_size == 0) {
-                        log_msg(LOG_ERROR, "Missing FILESIZE");
-                        state = READ_DISCARD_UNTIL_TIMEOUT;
-                        buf_data_len = 0;
-                        requested_reading_len = sizeof(buf);
-                        break;
-                    }
-                    if (storage_dir) {
-                        storage_file_path = sprintf_malloc("%s/%s", storage_dir, rcv_file_name);
-                    } else {
-                        strncpy(received_file_name, rcv_file_name, sizeof(received_file_name) - 1);
-                        received_file_name[sizeof(received_file_name) - 1] = '\0';
-                        storage_file_path = create_file_path(tokens);
-                    }
-                    log_fmtmsg(
-                        LOG_INFO,
-                        "Incoming file \"%s\" with length %u will be stored in \"%s\"",
-                        rcv_file_name,
-                        (unsigned int)rcv_file_size,
-                        storage_file_path);
-                    if (storage_create_dirs) {
-                        mkdirs(storage_file_path);
-                    }
-                    file_fd =
-                        open(storage_file_path, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-                    if (file_fd == -1) {
-                        const int origin_errno = errno;
-                        if (origin_errno == EEXIST) {
-                            if (file_exists_policy == FILE_REPLACE) {
-                                log_fmtmsg(
-                                    LOG_WARNING,
-                                    "The file \"%s\" already exists in the storage and will be replaced by "
-                                    "the received file \"%s\"",
-                                    storage_file_path,
-                                    rcv_file_name);
-                                file_fd = open(
-                                    storage_file_path,
-                                    O_WRONLY | O_CREAT | O_TRUNC,
-                                    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-                            } else {
-                                log_fmtmsg(
-                                    LOG_WARNING,
-                                    "The file \"%s\" already exists in the storage, the received file \"%s\" "
-                                    "will be dropped",
-                                    storage_file_path,
-                                    rcv_file_name);
-                            }
-                        }
-                        if (file_fd == -1 && (origin_errno != EEXIST || file_exists_policy == FILE_REPLACE)) {
-                            log_fmtmsg(
-                                LOG_ERROR,
-                                "Cannot open/create file \"%s\", received file \"%s\" will no be stored: %s",
-                                storage_file_path,
-                                rcv_file_name,
-                                strerror(errno));
-                        }
-                    }
-                    state = READ_FILE;
-                    buf_data_len = 1;
-                    total_rcv_file_bytes = 0;
-                    const size_t bytes_to_end = rcv_file_size - 1;  // one byte is received in buf
-                    requested_reading_len = bytes_to_end > sizeof(buf) - 1 ? sizeof(buf) - 1 : bytes_to_end;
-                }
-                break;
-            case READ_FILE:
-                buf_data_len += read_len;
-                total_rcv_file_bytes += buf_data_len;
-
-                if (file_fd != -1) {
-                    size_t written = 0;
-                    do {
-                        const ssize_t write_ret = write(file_fd, buf + written, buf_data_len - written);
-                        if (write_ret == -1) {
-                            log_fmtmsg(
-                                LOG_ERROR,
-                                "Cannot write to file \"%s\", received file \"%s\" will be truncated: %s",
-                                storage_file_path,
-                                rcv_file_name,
-                                strerror(errno));
-                            close(file_fd);
-                            file_fd = -1;
-                            break;
-                        }
-                        written += write_ret;
-                    } while (written < buf_data_len);
-                }
-
-                buf_data_len = 0;
-                if (total_rcv_file_bytes >= rcv_file_size) {
-                    if (file_fd != -1) {
-                        close(file_fd);
-                        file_fd = -1;
-                        log_fmtmsg(
-                            LOG_INFO,
-                            "The file \"%s\" was received and saved as \"%s\"",
-                            rcv_file_name,
-                            storage_file_path);
-                    } else {
-                        log_fmtmsg(LOG_INFO, "The file \"%s\" was received but discarded or truncated", rcv_file_name);
-                    }
-                    free(storage_file_path);
-                    storage_file_path = NULL;
-                    free(rcv_file_name);
-                    rcv_file_name = NULL;
-                    rcv_file_size = 0;
-                    requested_reading_len = 1;
-                    timeout_ms = -1;
-                    state = READ_START;
-                    break;
-                }
-                const size_t bytes_to_end = rcv_file_size - total_rcv_file_bytes;
-                requested_reading_len = bytes_to_end > sizeof(buf) ? sizeof(buf) : bytes_to_end;
+            case '\t':
+                fputs("\\t", file);
                 break;
-            case READ_DISCARD_UNTIL_TIMEOUT:
-                if (!discard_message_logged) {
-                    log_msg(LOG_WARNING, "Start discarding received data until the no-data timeout expires");
-                    discard_message_logged = true;
-                }
+            case '\n':
+                fputs("\\n", file);
                 break;
+            default:
+                fputc(*ch, file);
         }
     }
+}
 
-    if (file_fd != -1) {
-        close(file_fd);
-    }
-    if (storage_file_path) {
-        free(storage_file_path);
+
+// Returns true if the keyword is stored in the index.
+static bool index_keyword_wanted(const char * key) {
+    if (key[0] != '$' || toupper((unsigned char)key[1]) != 'P' || !isdigit((unsigned char)key[2])) {
+        return true;
     }
-    if (rcv_file_name) {
-        free(rcv_file_name);
+    const char * suffix = key + 2;
+    while (isdigit((unsigned char)*suffix)) {
+        ++suffix;
     }
-    close(port_fd);
+    return (toupper((unsigned char)suffix[0]) == 'N' || toupper((unsigned char)suffix[0]) == 'S') &&
+           suffix[1] == '\0';
 }
 
 
-static void print_help() {
-    const int LEFT_COLUMN_WIDTH = 33;
-
-    printf("CyFlowRec %s, Copyright 2024 Jaroslav Rohel <jaroslav.rohel@gmail.com>\n", CYFLOWREC_VERSION);
-    printf(
-        "CyFlowRec comes with ABSOLUTELY NO WARRANTY. This is free software\n"
-        "and you are welcome to redistribute it under the terms of the GNU GPL v2.\n\n");
+// Parses the HEADER and TEXT segments of the file and writes its index line. Returns false if the file
+// is not an FCS file.
+static bool index_file(const char * dir_path, const struct index_entry * entry, FILE * out) {
+    char * const path = sprintf_malloc("%s/%s", dir_path, entry->path);
+    struct fcs_file * file;
+    const enum fcs_status status = fcs_open(path, &file);
+    if (status != FCS_OK) {
+        log_fmtmsg(LOG_DEBUG, "File \"%s\" is not indexed: %s", path, fcs_status_str(status));
+        free(path);
+        return false;
+    }
+    free(path);
+    index_write_field(out, entry->path);
+    fprintf(out, "\t%llu\t%lld", (unsigned long long)entry->size, (long long)entry->mtime);
+    for (size_t i = 0; i < fcs_keyword_count(file); ++i) {
+        const char * key;
+        const char * value;
+        fcs_keyword_at(file, i, &key, &value);
+        if (index_keyword_wanted(key)) {
+            fputc('\t', out);
+            index_write_field(out, key);
+            fputc('\t', out);
+            index_write_field(out, value);
+        }
+    }
+    fputc('\n', out);
+    fcs_close(file);
+    return true;
+}
 
-    printf(
-        "Usage: cyflowrec [%s] %s=<port> [%s=<policy>] %s=<path> [%s=<0/1>]\n"
-        "  or:  cyflowrec [%s] %s=<port> [%s=<policy>] %s=<path> [%s=<0/1>]\n\n",
-        ARG_HELP,
-        ARG_PORT_DEV,
-        ARG_STORAGE_FILE_EXISTS,
-        ARG_STORAGE_DIR,
-        ARG_STORAGE_CREATE_DIRS,
-        ARG_HELP,
-        ARG_PORT_DEV,
-        ARG_STORAGE_FILE_EXISTS,
-        ARG_STORAGE_FILE_PATH,
-        ARG_STORAGE_CREATE_DIRS);
 
-    printf("%s%*sprint this help\n", ARG_HELP, (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_HELP)), "");
-    printf(
-        "%s=<path>%*spath to the serial port device (eg /dev/ttyS0)\n",
-        ARG_PORT_DEV,
-        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_PORT_DEV) - 7),
-        "");
-    printf(
-        "%s=<0/1>%*sdisable/enable the creation of missing\n"
-        "%*sdirectories in the storage path\n"
-        "%*s(0 - disable, 1 - enable; disabled by default)\n",
-        ARG_STORAGE_CREATE_DIRS,
-        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_STORAGE_CREATE_DIRS) - 6),
-        "",
-        LEFT_COLUMN_WIDTH,
-        "",
-        LEFT_COLUMN_WIDTH,
-        "");
-    printf(
-        "%s=<path>%*spath to the storage directory\n",
-        ARG_STORAGE_DIR,
-        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_STORAGE_DIR) - 7),
-        "");
-    printf(
-        "%s=<policy>%*swhat to do if a file with the given name\n"
-        "%*salready exists in the storage\n"
-        "%*s(drop - drop the received file, replace -\n"
-        "%*sreplace the file in storage with\n"
-        "%*sthe received one; replace by default)\n",
-        ARG_STORAGE_FILE_EXISTS,
-        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_STORAGE_FILE_EXISTS) - 9),
-        "",
-        LEFT_COLUMN_WIDTH,
-        "",
-        LEFT_COLUMN_WIDTH,
-        "",
-        LEFT_COLUMN_WIDTH,
-        "",
-        LEFT_COLUMN_WIDTH,
-        "");
-    printf(
-        "%s=<path>%*spath to the storage file\n"
-        "%*svariable substitution is performed\n"
-        "%*svariable format ${<var_name>}\n"
-        "%*svariables: DATE_YEAR, DATE_MONTH, DATE_DAY,\n"
-        "%*s  TIME_HOUR, TIME_MIN, TIME_SEC, RCV_NAME\n",
-        ARG_STORAGE_FILE_PATH,
-        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_STORAGE_FILE_PATH) - 7),
-        "",
-        LEFT_COLUMN_WIDTH,
-        "",
-        LEFT_COLUMN_WIDTH,
-        "",
-        LEFT_COLUMN_WIDTH,
-        "",
-        LEFT_COLUMN_WIDTH,
-        "");
+// Returns the path of the index of the directory, --index-file or INDEX_DEFAULT_NAME in the directory.
+static char * index_path_get(const char * dir_path) {
+    return index_file_path ? my_strdup(index_file_path) : sprintf_malloc("%s/%s", dir_path, INDEX_DEFAULT_NAME);
 }
 
 
-// If the argument `arg_name` is found at position `idx` its value is stored into `value`
-// and the function returns true. If an error occurs, the function returns false.
-// If `idx` points after the arguments, or there is another argument at that position,
-// the function does nothing and returns true.
-static bool arg_parse_value(int argc, char * argv[], int * idx, const char * arg_name, const char ** value) {
-    if (*idx >= argc) {
-        return true;
+// Appends the line to the journal of the storage index.
+static void storage_index_append(const char * line, size_t len) {
+    char * const index_path = index_path_get(storage_dir);
+    char * const log_path = sprintf_malloc("%s%s", index_path, INDEX_LOG_SUFFIX);
+    free(index_path);
+    const int fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1 || write(fd, line, len) != (ssize_t)len) {
+        log_fmtmsg(LOG_ERROR, "Cannot write to index journal \"%s\": %s", log_path, strerror(errno));
     }
-    const char * const arg = argv[*idx];
-    const size_t arg_len = strlen(arg_name);
-    if (strncmp(arg, arg_name, arg_len) == 0) {
-        switch (arg[arg_len]) {
-            case '\0':
-                if (++*idx == argc) {
-                    fprintf(stderr, "Missing value for argument %s\n", arg);
-                    return false;
-                }
-                *value = arg;
-                break;
-            case '=':
-                *value = arg + arg_len + 1;
-                break;
-            default:
-                return true;
-        }
-    } else {
-        return true;
+    if (fd != -1) {
+        close(fd);
     }
-    ++*idx;
-    return true;
+    free(log_path);
 }
 
 
-int main(int argc, char * argv[]) {
-    bool args_error = false;
-    const char * create_dirs = NULL;
-    const char * file_exists = NULL;
-
-    for (int i = 1; i < argc;) {
-        const int parsed_idx = i;
-        if (!arg_parse_value(argc, argv, &i, ARG_PORT_DEV, &port_dev)) {
-            return 1;
-        }
-        if (!arg_parse_value(argc, argv, &i, ARG_STORAGE_DIR, &storage_dir)) {
-            return 1;
-        }
-        if (!arg_parse_value(argc, argv, &i, ARG_STORAGE_CREATE_DIRS, &create_dirs)) {
-            return 1;
-        }
-        if (!arg_parse_value(argc, argv, &i, ARG_STORAGE_FILE_EXISTS, &file_exists)) {
-            return 1;
-        }
-        if (!arg_parse_value(argc, argv, &i, ARG_STORAGE_FILE_PATH, &storage_file_path)) {
-            return 1;
-        }
-        if (i < argc && strcmp(argv[i], ARG_HELP) == 0) {
-            print_help();
-            return 0;
-        }
-        if (i == parsed_idx) {
-            fprintf(stderr, "Unknown argument %s\n", argv[i]);
-            args_error = true;
-            break;
-        }
+// Returns the path relative to the storage directory or NULL if the file is not in the storage directory.
+static const char * storage_index_rel_path(const char * path) {
+    const size_t dir_len = storage_dir ? strlen(storage_dir) : 0;
+    if (dir_len > 0 && strncmp(path, storage_dir, dir_len) == 0 && path[dir_len] == '/') {
+        return path + dir_len + 1;
     }
+    return NULL;
+}
 
-    if (!storage_dir && !storage_file_path) {
-        fprintf(stderr, "One of the arguments %s and %s is needed\n", ARG_STORAGE_DIR, ARG_STORAGE_FILE_PATH);
-        args_error = true;
+
+// Adds the saved file to the journal of the storage index (--storage-index).
+static void storage_index_file_saved(const char * path) {
+    struct index_entry entry;
+    struct stat st;
+    if (!storage_index || !(entry.path = storage_index_rel_path(path)) || stat(path, &st) == -1) {
+        return;
     }
-    if (storage_dir && storage_file_path) {
-        fprintf(stderr, "Only one of the arguments %s and %s can be used\n", ARG_STORAGE_DIR, ARG_STORAGE_FILE_PATH);
-        args_error = true;
+    entry.size = st.st_size;
+    entry.mtime = st.st_mtime;
+    char * line = NULL;
+    size_t line_len = 0;
+    FILE * const out = open_memstream(&line, &line_len);
+    if (!out) {
+        log_fmtmsg(LOG_ERROR, "Cannot index file \"%s\": %s", path, strerror(errno));
+        return;
     }
-    if (!port_dev) {
-        fprintf(stderr, "Missing %s=<port> argument\n", ARG_PORT_DEV);
-        args_error = true;
+    const bool indexed = index_file(storage_dir, &entry, out);
+    fclose(out);
+    if (indexed) {
+        storage_index_append(line, line_len);
     }
+    free(line);
+}
 
-    if (create_dirs) {
-        if (strcmp(create_dirs, "1") == 0) {
-            storage_create_dirs = true;
-        } else if (strcmp(create_dirs, "0") != 0) {
-            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_STORAGE_CREATE_DIRS, create_dirs);
-            args_error = true;
-        }
-    }
 
-    if (file_exists) {
-        if (strcmp(file_exists, "drop") == 0) {
-            file_exists_policy = FILE_DROP;
-        } else if (strcmp(file_exists, "replace") != 0) {
-            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_STORAGE_FILE_EXISTS, file_exists);
-            args_error = true;
-        }
+// Records the removal of the file from the storage in the journal of the storage index.
+static void storage_index_file_removed(const char * path) {
+    const char * const rel_path = storage_index ? storage_index_rel_path(path) : NULL;
+    if (!rel_path) {
+        return;
+    }
+    char * line = NULL;
+    size_t line_len = 0;
+    FILE * const out = open_memstream(&line, &line_len);
+    if (!out) {
+        log_fmtmsg(LOG_ERROR, "Cannot record removal of file \"%s\" in the index: %s", path, strerror(errno));
+        return;
+    }
+    index_write_field(out, rel_path);
+    fputc('\n', out);
+    fclose(out);
+    storage_index_append(line, line_len);
+    free(line);
+}
+
+
+// Spool of the received files (--spool-dir).
+// The received files are stored in the spool directory (eg on tmpfs) and migrated to the storage
+// in batches by a child process. A spooled file consists of "<name>.data" with the file content and
+// "<name>.dst" with the storage file path. When the file is received completely, its size, name and source
+// are appended to "<name>.dst" as next lines. A migrated file has "<name>.dst" renamed to "<name>.done",
+// from which the receive loop learns that the file is in the storage and runs its hook and relay.
+// Files found in the spool directory on start are migrated immediately, so files spooled before a restart
+// are not lost.
+
+struct spool_file {
+    char * name;
+    size_t size;   // announced size of the file, the spool space reserved by the file
+    int64_t time;  // monotonic time when the file was spooled
+};
+
+struct spool_list {
+    struct spool_file * files;
+    size_t len;
+};
+
+// Interval of checking the migration process
+static const int64_t SPOOL_WAIT_CHECK_MS = 200;
+// Maximum length of "<name>.done"
+static const size_t SPOOL_DONE_MAX_LEN = 8192;
+static const size_t SPOOL_COPY_BUFFER_SIZE = 1024 * 1024;
+
+static struct spool_list spool_files;      // spooled files waiting for migration
+static struct spool_list spool_migrating;  // files being migrated by the child process
+static size_t spool_used;                  // size of all spooled files including the receiving ones
+static pid_t spool_pid = -1;               // migration process or -1
+static int64_t spool_retry_time = 0;       // no migration before this time after a failed one
+static unsigned int spool_counter = 0;
+
+static void storage_file_stored(const char * path, const char * rcv_name, size_t size, const char * source);
+static void quota_file_migrated(const char * path);
+
+
+static void spool_list_add(struct spool_list * list, char * name, size_t size, int64_t time) {
+    list->files = realloc_assert(list->files, (list->len + 1) * sizeof(*list->files));
+    list->files[list->len].name = name;
+    list->files[list->len].size = size;
+    list->files[list->len].time = time;
+    ++list->len;
+}
+
+
+static char * spool_path(const char * name, const char * suffix) {
+    return sprintf_malloc("%s/%s.%s", spool_dir, name, suffix);
+}
+
+
+// Removes the sidecar files of the spooled file.
+static void spool_remove_sidecars(const char * data_path) {
+    for (size_t i = 0; i < sizeof(SIDECAR_SUFFIXES) / sizeof(SIDECAR_SUFFIXES[0]); ++i) {
+        char * const path = sprintf_malloc("%s%s", data_path, SIDECAR_SUFFIXES[i]);
+        unlink(path);
+        free(path);
+    }
+}
+
+
+// Loads the files remaining in the spool directory. They are migrated by the next spool_service().
+static bool spool_init(void) {
+    DIR * const dir = opendir(spool_dir);
+    if (!dir) {
+        log_fmtmsg(LOG_ERROR, "Cannot open spool directory \"%s\": %s", spool_dir, strerror(errno));
+        return false;
+    }
+    const int64_t time = monotonic_ms() - spool_flush_age_ms;
+    struct dirent * entry;
+    while ((entry = readdir(dir))) {
+        const size_t len = strlen(entry->d_name);
+        if (len > 5 && strcmp(entry->d_name + len - 5, ".done") == 0) {
+            // migrated before the restart, the file is finished by the first spool_service()
+            char * const name = my_strdup(entry->d_name);
+            name[len - 5] = '\0';
+            spool_list_add(&spool_migrating, name, 0, time);
+            continue;
+        }
+        if (len <= 4 || strcmp(entry->d_name + len - 4, ".dst") != 0) {
+            continue;
+        }
+        char * const name = my_strdup(entry->d_name);
+        name[len - 4] = '\0';
+        char * const data_path = spool_path(name, "data");
+        struct stat st;
+        if (stat(data_path, &st) == 0) {
+            log_fmtmsg(LOG_INFO, "Found spooled file \"%s\"", data_path);
+            spool_list_add(&spool_files, name, st.st_size, time);
+            spool_used += st.st_size;
+        } else {
+            char * const dst_path = spool_path(name, "dst");
+            unlink(dst_path);
+            free(dst_path);
+            free(name);
+        }
+        free(data_path);
+    }
+    closedir(dir);
+    return true;
+}
+
+
+// Reserves spool space for a file with `size` bytes and creates the file with its storage path.
+// Returns the name of the spooled file or NULL if the file is not spooled.
+static char * spool_create(const char * storage_path, size_t size) {
+    if (size > spool_size || spool_used > spool_size - size) {
+        log_msg(LOG_DEBUG, "The spool is full, the file is stored directly");
+        return NULL;
+    }
+    // The counter starts again after a restart, the names of the recovered spooled files are skipped.
+    char * name;
+    char * dst_path;
+    int fd;
+    while (true) {
+        name = sprintf_malloc("%lld-%u", (long long)time(NULL), spool_counter++);
+        dst_path = spool_path(name, "dst");
+        char * const data_path = spool_path(name, "data");
+        char * const done_path = spool_path(name, "done");
+        const bool used = access(data_path, F_OK) == 0 || access(done_path, F_OK) == 0;
+        free(data_path);
+        free(done_path);
+        fd = used ? -1 : open(dst_path, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+        if (fd != -1 || (!used && errno != EEXIST)) {
+            break;
+        }
+        free(dst_path);
+        free(name);
+    }
+    const size_t len = strlen(storage_path);
+    if (fd == -1 || write(fd, storage_path, len) != (ssize_t)len) {
+        log_fmtmsg(
+            LOG_ERROR,
+            "Cannot create spool file \"%s\", the file is stored directly: %s",
+            dst_path,
+            strerror(errno));
+        if (fd != -1) {
+            close(fd);
+            unlink(dst_path);
+        }
+        free(dst_path);
+        free(name);
+        return NULL;
+    }
+    close(fd);
+    free(dst_path);
+    spool_used += size;
+    return name;
+}
+
+
+// Removes a spooled file which was not stored.
+static void spool_cancel(char * name, size_t size) {
+    char * const data_path = spool_path(name, "data");
+    char * const dst_path = spool_path(name, "dst");
+    unlink(data_path);
+    spool_remove_sidecars(data_path);
+    unlink(dst_path);
+    free(data_path);
+    free(dst_path);
+    free(name);
+    spool_used -= size;
+}
+
+
+// Records in "<name>.dst" that the spooled file was received completely.
+static void spool_file_received(const char * name, const char * rcv_name, size_t size, const char * source) {
+    char * const dst_path = spool_path(name, "dst");
+    FILE * const file = fopen(dst_path, "a");
+    if (!file || fprintf(file, "\n%llu\n%s\n%s", (unsigned long long)size, rcv_name, source) < 0 ||
+        fclose(file) != 0) {
+        log_fmtmsg(LOG_ERROR, "Cannot write to spool file \"%s\": %s", dst_path, strerror(errno));
+    }
+    free(dst_path);
+}
+
+
+// Queues the closed spooled file for migration. Takes the ownership of `name`.
+static void spool_file_closed(char * name, size_t size) {
+    spool_list_add(&spool_files, name, size, monotonic_ms());
+}
+
+
+// Copies the spooled file to its storage path and removes it from the spool.
+// Copies the content of `src_fd` to `fd`. Returns false on error.
+static bool spool_copy(int src_fd, const char * src_path, int fd, const char * path, char * buf) {
+    while (true) {
+        const ssize_t read_ret = read(src_fd, buf, SPOOL_COPY_BUFFER_SIZE);
+        if (read_ret == -1) {
+            log_fmtmsg(LOG_ERROR, "Cannot read spool file \"%s\": %s", src_path, strerror(errno));
+            return false;
+        }
+        if (read_ret == 0) {
+            break;
+        }
+        for (ssize_t written = 0; written < read_ret;) {
+            const ssize_t write_ret = write(fd, buf + written, read_ret - written);
+            if (write_ret == -1) {
+                log_fmtmsg(LOG_ERROR, "Cannot write to file \"%s\": %s", path, strerror(errno));
+                return false;
+            }
+            written += write_ret;
+        }
+    }
+    if (storage_sync && fsync(fd) == -1) {
+        log_fmtmsg(LOG_ERROR, "Cannot sync file \"%s\": %s", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+
+// Copies the sidecar files of the spooled file next to the storage file. A sidecar file which cannot be
+// copied is lost, the file itself is stored.
+static void spool_migrate_sidecars(const char * data_path, const char * storage_path, char * buf) {
+    for (size_t i = 0; i < sizeof(SIDECAR_SUFFIXES) / sizeof(SIDECAR_SUFFIXES[0]); ++i) {
+        char * const src_path = sprintf_malloc("%s%s", data_path, SIDECAR_SUFFIXES[i]);
+        const int src_fd = open(src_path, O_RDONLY);
+        if (src_fd == -1) {
+            free(src_path);
+            continue;
+        }
+        char * const path = sprintf_malloc("%s%s", storage_path, SIDECAR_SUFFIXES[i]);
+        const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (fd == -1) {
+            log_fmtmsg(LOG_ERROR, "Cannot open/create file \"%s\": %s", path, strerror(errno));
+        } else if (!spool_copy(src_fd, src_path, fd, path, buf) || close(fd) == -1) {
+            if (fd != -1) {
+                close(fd);
+            }
+            unlink(path);
+        }
+        close(src_fd);
+        free(path);
+        free(src_path);
+    }
+}
+
+
+static bool spool_migrate_file(const char * name, char * buf) {
+    char * const data_path = spool_path(name, "data");
+    char * const dst_path = spool_path(name, "dst");
+    char * storage_path = NULL;
+    int data_fd = -1;
+    int fd = -1;
+    bool ok = false;
+
+    const int dst_fd = open(dst_path, O_RDONLY);
+    if (dst_fd == -1) {
+        log_fmtmsg(LOG_ERROR, "Cannot open spool file \"%s\": %s", dst_path, strerror(errno));
+        goto out;
+    }
+    const ssize_t path_len = read(dst_fd, buf, SPOOL_COPY_BUFFER_SIZE - 1);
+    close(dst_fd);
+    if (path_len <= 0) {
+        log_fmtmsg(LOG_ERROR, "Cannot read spool file \"%s\"", dst_path);
+        goto out;
+    }
+    buf[path_len] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    storage_path = my_strdup(buf);
+
+    if ((data_fd = open(data_path, O_RDONLY)) == -1) {
+        log_fmtmsg(LOG_ERROR, "Cannot open spool file \"%s\": %s", data_path, strerror(errno));
+        goto out;
+    }
+    if (storage_create_dirs || storage_shard_levels > 0) {
+        mkdirs(storage_path);
+    }
+    const int flags = O_WRONLY | O_CREAT | (file_exists_policy == FILE_DROP ? O_EXCL : O_TRUNC);
+    if ((fd = open(storage_path, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1) {
+        if (errno == EEXIST) {
+            log_fmtmsg(
+                LOG_WARNING,
+                "The file \"%s\" already exists in the storage, the spooled file \"%s\" will be dropped",
+                storage_path,
+                data_path);
+            unlink(dst_path);
+            ok = true;
+        } else {
+            log_fmtmsg(LOG_ERROR, "Cannot open/create file \"%s\": %s", storage_path, strerror(errno));
+        }
+        goto out;
+    }
+    if (!spool_copy(data_fd, data_path, fd, storage_path, buf)) {
+        goto out;
+    }
+    if (close(fd) == -1) {
+        fd = -1;
+        log_fmtmsg(LOG_ERROR, "Cannot write to file \"%s\": %s", storage_path, strerror(errno));
+        goto out;
+    }
+    fd = -1;
+    spool_migrate_sidecars(data_path, storage_path, buf);
+    char * const done_path = spool_path(name, "done");
+    if (rename(dst_path, done_path) == -1) {
+        log_fmtmsg(LOG_ERROR, "Cannot rename spool file \"%s\": %s", dst_path, strerror(errno));
+        free(done_path);
+        goto out;
+    }
+    free(done_path);
+    log_fmtmsg(LOG_INFO, "The spooled file \"%s\" was saved as \"%s\"", data_path, storage_path);
+    storage_index_file_saved(storage_path);
+    ok = true;
+
+out:
+    if (fd != -1) {
+        close(fd);
+    }
+    if (data_fd != -1) {
+        close(data_fd);
+    }
+    if (ok) {
+        unlink(data_path);
+        spool_remove_sidecars(data_path);
+    }
+    free(storage_path);
+    free(data_path);
+    free(dst_path);
+    return ok;
+}
+
+
+static void spool_migrate(const struct spool_list * list) {
+    char * const buf = realloc_assert(NULL, SPOOL_COPY_BUFFER_SIZE);
+    for (size_t i = 0; i < list->len; ++i) {
+        spool_migrate_file(list->files[i].name, buf);
+    }
+    free(buf);
+}
+
+
+// Finishes the migrated file described by "<name>.done". A completely received file is passed
+// to storage_file_stored().
+static void spool_file_migrated(const char * name) {
+    char * const done_path = spool_path(name, "done");
+    FILE * const file = fopen(done_path, "r");
+    if (!file) {
+        free(done_path);
+        return;
+    }
+    char * const buf = realloc_assert(NULL, SPOOL_DONE_MAX_LEN);
+    const size_t len = fread(buf, 1, SPOOL_DONE_MAX_LEN - 1, file);
+    fclose(file);
+    buf[len] = '\0';
+    char * const size_line = strchr(buf, '\n');
+    char * const name_line = size_line ? strchr(size_line + 1, '\n') : NULL;
+    char * const source_line = name_line ? strchr(name_line + 1, '\n') : NULL;
+    if (source_line) {
+        *size_line = *name_line = *source_line = '\0';
+        if (storage_quota > 0) {
+            quota_file_migrated(buf);
+        }
+        storage_file_stored(buf, name_line + 1, strtoull(size_line + 1, NULL, 10), source_line + 1);
+    }
+    unlink(done_path);
+    free(buf);
+    free(done_path);
+}
+
+
+// Finishes the migration. The files which were not migrated are queued again and retried
+// after the flush age.
+static void spool_migration_done(void) {
+    for (size_t i = 0; i < spool_migrating.len; ++i) {
+        struct spool_file * const file = &spool_migrating.files[i];
+        char * const dst_path = spool_path(file->name, "dst");
+        if (access(dst_path, F_OK) == 0) {
+            spool_list_add(&spool_files, file->name, file->size, file->time);
+            spool_retry_time = monotonic_ms() + spool_flush_age_ms;
+        } else {
+            spool_file_migrated(file->name);
+            spool_used -= file->size;
+            free(file->name);
+        }
+        free(dst_path);
+    }
+    spool_migrating.len = 0;
+}
+
+
+// Starts the migration of the spooled files if the spooled size or the age of the oldest file
+// reaches its threshold, and checks the running migration. Returns the time of the next check.
+static int64_t spool_service(int64_t now) {
+    if (!spool_dir) {
+        return NO_DEADLINE;
+    }
+    if (spool_pid != -1) {
+        int status;
+        const pid_t ret = waitpid(spool_pid, &status, WNOHANG);
+        if (ret == 0) {
+            return now + SPOOL_WAIT_CHECK_MS;
+        }
+        spool_pid = -1;
+        spool_migration_done();
+    } else if (spool_migrating.len > 0) {
+        spool_migration_done();  // files migrated before a restart
+    }
+    if (spool_files.len == 0) {
+        return NO_DEADLINE;
+    }
+    if (now < spool_retry_time) {
+        return spool_retry_time;
+    }
+
+    size_t size = 0;
+    int64_t oldest = NO_DEADLINE;
+    for (size_t i = 0; i < spool_files.len; ++i) {
+        size += spool_files.files[i].size;
+        if (spool_files.files[i].time < oldest) {
+            oldest = spool_files.files[i].time;
+        }
+    }
+    if (size < spool_flush_size && now - oldest < spool_flush_age_ms) {
+        return oldest + spool_flush_age_ms;
+    }
+
+    log_fmtmsg(LOG_DEBUG, "Migrating %u spooled files", (unsigned int)spool_files.len);
+    const struct spool_list tmp = spool_migrating;
+    spool_migrating = spool_files;
+    spool_files = tmp;
+    fflush(stdout);
+    spool_pid = fork();
+    if (spool_pid == 0) {
+        spool_migrate(&spool_migrating);
+        fflush(stdout);
+        _exit(0);
+    }
+    if (spool_pid == -1) {
+        log_fmtmsg(LOG_WARNING, "Cannot create migration process, files are migrated directly: %s", strerror(errno));
+        spool_migrate(&spool_migrating);
+        spool_migration_done();
+        return NO_DEADLINE;
+    }
+    return now + SPOOL_WAIT_CHECK_MS;
+}
+
+
+// Storage quota (--storage-quota).
+// The files in the storage are tracked in a list ordered by the modification time. The list is created
+// by one scan of the storage on start and then updated by the received and evicted files. When the usage
+// exceeds the high watermark, the oldest files are evicted (removed or moved to the archive directory)
+// until the usage drops below the low watermark.
+// The sidecar files (statistics, previews, columnar copy) are charged to the file they belong to and they
+// are evicted together with it. A sidecar file without its file is tracked alone.
+
+struct quota_file {
+    char * path;
+    size_t size;  // including the sidecar files
+    time_t mtime;
+    bool receiving;  // the file is being received, it must not be evicted
+};
+
+// Number of files evicted at once by quota_service()
+static const size_t QUOTA_EVICT_BATCH = 32;
+// Delay of the next eviction attempt after a file could not be evicted
+static const int64_t QUOTA_RETRY_MS = 10 * 1000;
+
+static char * quota_root = NULL;  // storage directory which usage is tracked
+static struct quota_file * quota_files = NULL;
+static size_t quota_files_len = 0;
+static size_t quota_first = 0;  // index of the oldest file in quota_files
+static size_t quota_used = 0;
+static bool quota_evicting = false;
+static int64_t quota_retry_time = 0;  // no eviction by quota_service() before this time
+static struct stat quota_archive_stat;
+static const char * quota_index_name = INDEX_DEFAULT_NAME;  // name prefix of the index files, not tracked
+
+
+static void quota_list_add(char * path, size_t size, time_t mtime, bool receiving) {
+    quota_files = realloc_assert(quota_files, (quota_files_len + 1) * sizeof(*quota_files));
+    quota_files[quota_files_len].path = path;
+    quota_files[quota_files_len].size = size;
+    quota_files[quota_files_len].mtime = mtime;
+    quota_files[quota_files_len].receiving = receiving;
+    ++quota_files_len;
+    quota_used += size;
+}
+
+
+// Returns the total size of the sidecar files of the file `path`.
+static size_t quota_sidecars_size(const char * path) {
+    size_t size = 0;
+    for (size_t i = 0; i < sizeof(SIDECAR_SUFFIXES) / sizeof(SIDECAR_SUFFIXES[0]); ++i) {
+        char * const sidecar_path = sprintf_malloc("%s%s", path, SIDECAR_SUFFIXES[i]);
+        struct stat st;
+        if (lstat(sidecar_path, &st) == 0 && S_ISREG(st.st_mode)) {
+            size += st.st_size;
+        }
+        free(sidecar_path);
+    }
+    return size;
+}
+
+
+static void quota_scan_dir(const char * dir_path) {
+    DIR * const dir = opendir(dir_path);
+    if (!dir) {
+        log_fmtmsg(LOG_WARNING, "Cannot open storage directory \"%s\": %s", dir_path, strerror(errno));
+        return;
+    }
+    struct dirent * entry;
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            strncmp(entry->d_name, quota_index_name, strlen(quota_index_name)) == 0) {
+            continue;
+        }
+        char * const path = sprintf_malloc("%s/%s", dir_path, entry->d_name);
+        struct stat st;
+        if (lstat(path, &st) == 0) {
+            if (S_ISREG(st.st_mode)) {
+                const size_t suffix_len = sidecar_suffix_len(entry->d_name);
+                if (suffix_len == 0) {
+                    quota_list_add(path, st.st_size + quota_sidecars_size(path), st.st_mtime, false);
+                    continue;
+                }
+                char * const file_path = sprintf_malloc("%.*s", (int)(strlen(path) - suffix_len), path);
+                struct stat file_st;
+                const bool charged = lstat(file_path, &file_st) == 0 && S_ISREG(file_st.st_mode);
+                free(file_path);
+                if (!charged) {
+                    quota_list_add(path, st.st_size, st.st_mtime, false);
+                    continue;
+                }
+            }
+            const bool archive =
+                storage_archive_dir && st.st_dev == quota_archive_stat.st_dev && st.st_ino == quota_archive_stat.st_ino;
+            if (S_ISDIR(st.st_mode) && !archive) {
+                quota_scan_dir(path);
+            }
+        }
+        free(path);
+    }
+    closedir(dir);
+}
+
+
+static int quota_file_cmp(const void * a, const void * b) {
+    const time_t a_mtime = ((const struct quota_file *)a)->mtime;
+    const time_t b_mtime = ((const struct quota_file *)b)->mtime;
+    return a_mtime < b_mtime ? -1 : a_mtime > b_mtime;
+}
+
+
+// Scans the storage. The storage root is the storage directory or the directory part
+// of --storage-file-path before the first variable.
+static bool quota_init(void) {
+    if (storage_dir) {
+        quota_root = my_strdup(storage_dir);
+    } else {
+        const char * const var = strstr(storage_file_path, "${");
+        const char * const end = var ? var : strchr(storage_file_path, '\0');
+        const char * sep = NULL;
+        for (const char * ch = storage_file_path; ch < end; ++ch) {
+            if (*ch == '/') {
+                sep = ch;
+            }
+        }
+        quota_root = my_strdup(!sep ? "." : sep == storage_file_path ? "/" : storage_file_path);
+        if (sep && sep != storage_file_path) {
+            quota_root[sep - storage_file_path] = '\0';
+        }
+    }
+    if (storage_archive_dir) {
+        struct stat root_stat;
+        if (stat(storage_archive_dir, &quota_archive_stat) == -1 || stat(quota_root, &root_stat) == -1) {
+            log_fmtmsg(LOG_ERROR, "Cannot access archive directory \"%s\": %s", storage_archive_dir, strerror(errno));
+            return false;
+        }
+        if (root_stat.st_dev != quota_archive_stat.st_dev) {
+            log_fmtmsg(
+                LOG_ERROR,
+                "Archive directory \"%s\" is not on the file system of the storage \"%s\"",
+                storage_archive_dir,
+                quota_root);
+            return false;
+        }
+    }
+    if (index_file_path) {
+        const char * const name = strrchr(index_file_path, '/');
+        quota_index_name = name ? name + 1 : index_file_path;
+    }
+    quota_scan_dir(quota_root);
+    qsort(quota_files, quota_files_len, sizeof(*quota_files), quota_file_cmp);
+    log_fmtmsg(
+        LOG_INFO,
+        "Storage \"%s\" uses %llu bytes in %u files",
+        quota_root,
+        (unsigned long long)quota_used,
+        (unsigned int)quota_files_len);
+    return true;
+}
+
+
+// Removes the file from the tracked files and passes its entry to `file`. Returns false if the file
+// is not tracked.
+static bool quota_take(const char * path, struct quota_file * file) {
+    for (size_t i = quota_first; i < quota_files_len; ++i) {
+        if (strcmp(quota_files[i].path, path) == 0) {
+            *file = quota_files[i];
+            quota_used -= file->size;
+            memmove(&quota_files[i], &quota_files[i + 1], (quota_files_len - i - 1) * sizeof(*quota_files));
+            --quota_files_len;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Returns the entry taken by quota_take() to its place in the modification time order.
+static void quota_insert(const struct quota_file * file) {
+    quota_list_add(file->path, file->size, file->mtime, file->receiving);
+    size_t i = quota_files_len - 1;
+    while (i > quota_first && quota_files[i - 1].mtime > file->mtime) {
+        quota_files[i] = quota_files[i - 1];
+        --i;
+    }
+    quota_files[i] = *file;
+}
+
+
+// Removes the file from the tracked files.
+static void quota_remove(const char * path) {
+    struct quota_file file;
+    if (quota_take(path, &file)) {
+        free(file.path);
+    }
+}
+
+
+// Updates the size of the received file when it is closed, its sidecar files are written by then.
+static void quota_file_closed(const char * path, size_t size) {
+    for (size_t i = quota_files_len; i > quota_first; --i) {
+        struct quota_file * const file = &quota_files[i - 1];
+        if (file->receiving && strcmp(file->path, path) == 0) {
+            size += quota_sidecars_size(path);
+            quota_used = quota_used - file->size + size;
+            file->size = size;
+            file->mtime = time(NULL);
+            file->receiving = false;
+            break;
+        }
+    }
+}
+
+
+// Removes the file or moves it to the archive directory. Returns false if the file remains in the storage.
+static bool quota_evict_path(const char * path) {
+    struct stat st;
+    if (lstat(path, &st) == -1 && errno == ENOENT) {
+        return true;
+    }
+    if (storage_archive_dir) {
+        const size_t root_len = strlen(quota_root);
+        const char * rel_path = path;
+        if (strncmp(rel_path, quota_root, root_len) == 0 && rel_path[root_len] == '/') {
+            rel_path += root_len + 1;
+        }
+        char * const archive_path = sprintf_malloc("%s/%s", storage_archive_dir, rel_path);
+        mkdirs(archive_path);
+        const bool moved = rename(path, archive_path) == 0;
+        const int rename_errno = errno;
+        if (moved) {
+            log_fmtmsg(LOG_INFO, "The file \"%s\" was moved to the archive \"%s\"", path, archive_path);
+        } else if (rename_errno != ENOENT) {
+            log_fmtmsg(LOG_ERROR, "Cannot move file \"%s\" to the archive: %s", path, strerror(rename_errno));
+        }
+        free(archive_path);
+        return moved || rename_errno == ENOENT;
+    }
+    if (unlink(path) == 0) {
+        log_fmtmsg(LOG_INFO, "The file \"%s\" was removed from the storage", path);
+        return true;
+    }
+    if (errno != ENOENT) {
+        log_fmtmsg(LOG_ERROR, "Cannot remove file \"%s\": %s", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+
+// Updates the size of the spooled file when it is migrated with its sidecar files to the storage.
+static void quota_file_migrated(const char * path) {
+    struct stat st;
+    if (lstat(path, &st) == -1) {
+        return;
+    }
+    for (size_t i = quota_files_len; i > quota_first; --i) {
+        struct quota_file * const file = &quota_files[i - 1];
+        if (!file->receiving && strcmp(file->path, path) == 0) {
+            const size_t size = st.st_size + quota_sidecars_size(path);
+            quota_used = quota_used - file->size + size;
+            file->size = size;
+            break;
+        }
+    }
+}
+
+
+// Evicts the oldest file with its sidecar files. Returns false if there is no file to evict or if it cannot
+// be evicted. Such a file stays tracked with the size of its remaining files.
+static bool quota_evict_oldest(void) {
+    if (quota_first == quota_files_len || quota_files[quota_first].receiving) {
+        return false;
+    }
+    struct quota_file * const file = &quota_files[quota_first];
+    const bool sidecar = sidecar_suffix_len(file->path) > 0;
+    bool evicted = true;
+    for (size_t i = 0; i < sizeof(SIDECAR_SUFFIXES) / sizeof(SIDECAR_SUFFIXES[0]) && !sidecar; ++i) {
+        char * const sidecar_path = sprintf_malloc("%s%s", file->path, SIDECAR_SUFFIXES[i]);
+        evicted = quota_evict_path(sidecar_path) && evicted;
+        free(sidecar_path);
+    }
+    if (!evicted || !quota_evict_path(file->path)) {
+        struct stat st;
+        const size_t size =
+            (lstat(file->path, &st) == 0 ? (size_t)st.st_size : 0) + (sidecar ? 0 : quota_sidecars_size(file->path));
+        quota_used = quota_used - file->size + size;
+        file->size = size;
+        return false;
+    }
+    if (!sidecar) {
+        storage_index_file_removed(file->path);
+    }
+    quota_used -= file->size;
+    free(file->path);
+    if (++quota_first == quota_files_len) {
+        quota_first = quota_files_len = 0;
+    } else if (quota_first >= 1024 && quota_first > quota_files_len / 2) {
+        quota_files_len -= quota_first;
+        memmove(quota_files, quota_files + quota_first, quota_files_len * sizeof(*quota_files));
+        quota_first = 0;
+    }
+    return true;
+}
+
+
+// Makes space for a file with `size` bytes in the quota and on the storage file system.
+// Returns false if the space cannot be made. Nothing is evicted in that case, unless a file cannot be evicted.
+static bool quota_reserve(size_t size) {
+    size_t evictable = 0;
+    for (size_t i = quota_first; i < quota_files_len && !quota_files[i].receiving; ++i) {
+        evictable += quota_files[i].size;
+    }
+    if (size > storage_quota || quota_used - evictable > storage_quota - size) {
+        return false;
+    }
+    struct statvfs st;
+    if (statvfs(quota_root, &st) == 0) {
+        const unsigned long long avail = (unsigned long long)st.f_bavail * st.f_frsize;
+        // moving to the archive does not free space on the file system
+        if (avail < size && (storage_archive_dir || avail + evictable < size)) {
+            return false;
+        }
+        unsigned long long freed = 0;
+        while (avail + freed < size) {
+            const size_t file_size = quota_first < quota_files_len ? quota_files[quota_first].size : 0;
+            if (!quota_evict_oldest()) {
+                return false;
+            }
+            freed += file_size;
+        }
+    }
+    while (quota_used > storage_quota - size && quota_evict_oldest()) {
+    }
+    return quota_used <= storage_quota - size;
+}
+
+
+// Reserves the space for the file which is being received and adds it. The size is the announced size
+// of the file. The tracked size of the replaced file is credited. Returns false if the space cannot be made.
+static bool quota_reserve_file(const char * path, size_t size, bool replace) {
+    struct quota_file replaced;
+    const bool credited = replace && quota_take(path, &replaced);
+    if (!quota_reserve(size)) {
+        if (credited) {
+            quota_insert(&replaced);
+        }
+        return false;
+    }
+    if (credited) {
+        free(replaced.path);
+    }
+    quota_list_add(my_strdup(path), size, time(NULL), true);
+    return true;
+}
+
+
+// Evicts the oldest files in batches if the usage exceeds the high watermark, until the usage
+// drops below the low watermark. Returns the time of the next call.
+static int64_t quota_service(int64_t now) {
+    if (storage_quota == 0) {
+        return NO_DEADLINE;
+    }
+    if (now < quota_retry_time) {
+        return quota_retry_time;
+    }
+    if (!quota_evicting && quota_used > storage_quota / 100 * storage_quota_high) {
+        log_fmtmsg(LOG_INFO, "Storage usage %llu bytes exceeds the high watermark", (unsigned long long)quota_used);
+        quota_evicting = true;
+    }
+    if (quota_evicting) {
+        const size_t low = storage_quota / 100 * storage_quota_low;
+        for (size_t i = 0; i < QUOTA_EVICT_BATCH && quota_used > low; ++i) {
+            if (!quota_evict_oldest()) {
+                quota_evicting = false;
+                quota_retry_time = now + QUOTA_RETRY_MS;
+                return quota_retry_time;
+            }
+        }
+        if (quota_used > low) {
+            return now;
+        }
+        quota_evicting = false;
+    }
+    return NO_DEADLINE;
+}
+
+
+// Post-receive hooks (--on-file-received).
+// A hook job is queued for each received file when it is in the storage (a spooled file after its
+// migration). The jobs are run by up to --hook-workers child processes
+// created by posix_spawn(), the receive loop only checks them. A failed or timed out job is retried
+// with an increasing delay. The queue is stored in --hook-queue-file, so the jobs are not lost
+// on restart.
+
+struct hook_job {
+    char * path;
+    char * rcv_name;
+    size_t size;
+    unsigned int attempts;
+    int64_t start_time;  // monotonic time of the next attempt
+    pid_t pid;           // running process or -1
+    int64_t deadline;    // timeout of the running process
+};
+
+// Interval of checking the running hooks
+static const int64_t HOOK_WAIT_CHECK_MS = 100;
+// Delay of the first retry, it is doubled for each next retry
+static const int64_t HOOK_RETRY_DELAY_MS = 5000;
+
+static char ** hook_argv_templ = NULL;  // command split into arguments at spaces
+static size_t hook_argc = 0;
+static struct hook_job * hook_jobs = NULL;
+static size_t hook_jobs_len = 0;
+static unsigned int hook_running = 0;
+
+
+// Splits the command into arguments and checks the variables in them.
+static bool hook_init_command(void) {
+    char * const command = my_strdup(on_file_received);
+    for (char * arg = strtok(command, " "); arg; arg = strtok(NULL, " ")) {
+        for (const char * var = strstr(arg, "${"); var; var = strstr(var + 2, "${")) {
+            if (strncmp(var, "${PATH}", 7) != 0 && strncmp(var, "${RCV_NAME}", 11) != 0 &&
+                strncmp(var, "${SIZE}", 7) != 0) {
+                fprintf(stderr, "Unknown variable in argument %s: %s\n", ARG_ON_FILE_RECEIVED, var);
+                free(command);
+                return false;
+            }
+        }
+        hook_argv_templ = realloc_assert(hook_argv_templ, (hook_argc + 1) * sizeof(*hook_argv_templ));
+        hook_argv_templ[hook_argc++] = my_strdup(arg);
+    }
+    free(command);
+    if (hook_argc == 0) {
+        fprintf(stderr, "Empty command in argument %s\n", ARG_ON_FILE_RECEIVED);
+        return false;
+    }
+    return true;
+}
+
+
+static char * hook_subst(const char * templ, const struct hook_job * job) {
+    char size_buf[24];
+    snprintf(size_buf, sizeof(size_buf), "%llu", (unsigned long long)job->size);
+    struct string out;
+    string_init(&out);
+    const char * start = templ;
+    for (const char * var; (var = strstr(start, "${"));) {
+        string_append_csubstring(&out, start, var - start);
+        if (strncmp(var, "${PATH}", 7) == 0) {
+            string_append_csubstring(&out, job->path, strlen(job->path));
+            start = var + 7;
+        } else if (strncmp(var, "${RCV_NAME}", 11) == 0) {
+            string_append_csubstring(&out, job->rcv_name, strlen(job->rcv_name));
+            start = var + 11;
+        } else {
+            string_append_csubstring(&out, size_buf, strlen(size_buf));
+            start = var + 7;
+        }
+    }
+    string_append_csubstring(&out, start, strlen(start));
+    return out.data;
+}
+
+
+// Writes the queue to a temporary file which then replaces the queue file.
+static void hook_queue_save(void) {
+    if (!hook_queue_file) {
+        return;
+    }
+    char * const tmp_path = sprintf_malloc("%s.tmp", hook_queue_file);
+    FILE * const file = fopen(tmp_path, "w");
+    if (!file) {
+        log_fmtmsg(LOG_ERROR, "Cannot create hook queue file \"%s\": %s", tmp_path, strerror(errno));
+        free(tmp_path);
+        return;
+    }
+    for (size_t i = 0; i < hook_jobs_len; ++i) {
+        const struct hook_job * const job = &hook_jobs[i];
+        fprintf(file, "%u %llu %s %s\n", job->attempts, (unsigned long long)job->size, job->rcv_name, job->path);
+    }
+    if (fclose(file) != 0 || rename(tmp_path, hook_queue_file) == -1) {
+        log_fmtmsg(LOG_ERROR, "Cannot write hook queue file \"%s\": %s", hook_queue_file, strerror(errno));
+    }
+    free(tmp_path);
+}
+
+
+static void hook_add_job(char * path, char * rcv_name, size_t size, unsigned int attempts) {
+    hook_jobs = realloc_assert(hook_jobs, (hook_jobs_len + 1) * sizeof(*hook_jobs));
+    struct hook_job * const job = &hook_jobs[hook_jobs_len++];
+    job->path = path;
+    job->rcv_name = rcv_name;
+    job->size = size;
+    job->attempts = attempts;
+    job->start_time = 0;
+    job->pid = -1;
+    job->deadline = NO_DEADLINE;
+}
+
+
+// Loads the jobs remaining in the queue file.
+static bool hook_init(void) {
+    if (!hook_queue_file) {
+        return true;
+    }
+    FILE * const file = fopen(hook_queue_file, "r");
+    if (!file) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        log_fmtmsg(LOG_ERROR, "Cannot open hook queue file \"%s\": %s", hook_queue_file, strerror(errno));
+        return false;
+    }
+    char * line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_size, file)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+        }
+        unsigned int attempts;
+        unsigned long long size;
+        int name_start, name_end, path_start;
+        if (sscanf(line, "%u %llu %n%*s%n %n", &attempts, &size, &name_start, &name_end, &path_start) < 2 ||
+            line[path_start] == '\0') {
+            log_fmtmsg(LOG_WARNING, "Bad line in hook queue file \"%s\": %s", hook_queue_file, line);
+            continue;
+        }
+        line[name_end] = '\0';
+        hook_add_job(my_strdup(line + path_start), my_strdup(line + name_start), size, attempts);
+    }
+    free(line);
+    fclose(file);
+    if (hook_jobs_len > 0) {
+        log_fmtmsg(LOG_INFO, "Loaded %u hook jobs from \"%s\"", (unsigned int)hook_jobs_len, hook_queue_file);
+    }
+    return true;
+}
+
+
+// Queues the hook of the received file.
+static void hook_file_received(const char * path, const char * rcv_name, size_t size) {
+    if (!on_file_received) {
+        return;
+    }
+    hook_add_job(my_strdup(path), my_strdup(rcv_name), size, 0);
+    hook_queue_save();
+}
+
+
+static void hook_remove_job(size_t idx) {
+    free(hook_jobs[idx].path);
+    free(hook_jobs[idx].rcv_name);
+    memmove(&hook_jobs[idx], &hook_jobs[idx + 1], (hook_jobs_len - idx - 1) * sizeof(*hook_jobs));
+    --hook_jobs_len;
+}
+
+
+static void hook_start_job(struct hook_job * job, int64_t now) {
+    char ** const argv = realloc_assert(NULL, (hook_argc + 1) * sizeof(*argv));
+    for (size_t i = 0; i < hook_argc; ++i) {
+        argv[i] = hook_subst(hook_argv_templ[i], job);
+    }
+    argv[hook_argc] = NULL;
+
+    // the hook runs in its own process group, so the whole group is killed on timeout
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+    fflush(stdout);
+    const int err = posix_spawnp(&job->pid, argv[0], NULL, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    ++job->attempts;
+    if (err != 0) {
+        log_fmtmsg(LOG_ERROR, "Cannot run hook \"%s\": %s", argv[0], strerror(err));
+        job->pid = -1;
+        job->start_time = now + (HOOK_RETRY_DELAY_MS << (job->attempts - 1));
+    } else {
+        log_fmtmsg(LOG_DEBUG, "Hook for \"%s\" started, pid %d", job->path, (int)job->pid);
+        job->deadline = hook_timeout_ms > 0 ? now + hook_timeout_ms : NO_DEADLINE;
+        ++hook_running;
+    }
+    for (size_t i = 0; i < hook_argc; ++i) {
+        free(argv[i]);
+    }
+    free(argv);
+}
+
+
+// Handles a finished hook process. Returns true if the job is done and can be removed.
+static bool hook_job_finished(struct hook_job * job, int status, int64_t now) {
+    job->pid = -1;
+    --hook_running;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        log_fmtmsg(LOG_DEBUG, "Hook for \"%s\" finished", job->path);
+        return true;
+    }
+    if (WIFEXITED(status)) {
+        log_fmtmsg(LOG_WARNING, "Hook for \"%s\" failed with exit code %d", job->path, WEXITSTATUS(status));
+    } else {
+        log_fmtmsg(LOG_WARNING, "Hook for \"%s\" was terminated by signal %d", job->path, WTERMSIG(status));
+    }
+    if (job->attempts > hook_retries) {
+        log_fmtmsg(LOG_ERROR, "Hook for \"%s\" failed %u times, giving up", job->path, job->attempts);
+        return true;
+    }
+    job->start_time = now + (HOOK_RETRY_DELAY_MS << (job->attempts - 1));
+    return false;
+}
+
+
+// Reaps the finished hooks, kills the timed out ones and starts the queued jobs.
+// Returns the time of the next call.
+static int64_t hook_service(int64_t now) {
+    if (hook_jobs_len == 0) {
+        return NO_DEADLINE;
+    }
+    bool queue_changed = false;
+    int64_t next = NO_DEADLINE;
+    for (size_t i = 0; i < hook_jobs_len;) {
+        struct hook_job * const job = &hook_jobs[i];
+        if (job->pid != -1) {
+            int status;
+            if (waitpid(job->pid, &status, WNOHANG) == job->pid) {
+                if (hook_job_finished(job, status, now)) {
+                    hook_remove_job(i);
+                    queue_changed = true;
+                    continue;
+                }
+                queue_changed = true;
+            } else if (job->deadline <= now) {
+                log_fmtmsg(LOG_WARNING, "Hook for \"%s\" timed out", job->path);
+                kill(-job->pid, SIGKILL);
+                job->deadline = NO_DEADLINE;
+            }
+        }
+        if (job->pid == -1 && job->start_time <= now && hook_running < hook_workers) {
+            if (access(job->path, F_OK) != 0) {
+                log_fmtmsg(LOG_WARNING, "File \"%s\" no longer exists, its hook is dropped", job->path);
+                hook_remove_job(i);
+                queue_changed = true;
+                continue;
+            }
+            if (job->attempts > hook_retries) {  // loaded from the queue file
+                hook_remove_job(i);
+                queue_changed = true;
+                continue;
+            }
+            hook_start_job(job, now);
+            queue_changed = true;
+        }
+        if (job->pid != -1) {
+            next = now + HOOK_WAIT_CHECK_MS < next ? now + HOOK_WAIT_CHECK_MS : next;
+        } else if (hook_running < hook_workers && job->start_time < next) {
+            next = job->start_time;
+        }
+        ++i;
+    }
+    if (queue_changed) {
+        hook_queue_save();
+    }
+    return next;
+}
+
+
+// Relay of the received files to a collector (--relay-to).
+// A relay job is queued for each received file when it is in the storage (a spooled file after its
+// migration). The file is read from the storage and sent to the collector (cyflowrec --listen) over
+// a persistent TCP connection in the transfer protocol of the instrument with the source of the file
+// added: [FILENAME]<name>[SOURCE]<host>:<port>[FILESIZE]<size><content>
+// The port is the source of a file which was itself relayed.
+// The collector acknowledges each file by a line "STORED <name>" or "DISCARDED <name>", then the job
+// is removed and the next file is sent. The queue is stored in --relay-queue-file, so the files waiting
+// for the collector are forwarded after a restart. A failed connection is re-established with a doubled
+// delay up to RELAY_RETRY_MAX_MS. A job whose file cannot be opened (evicted, removed) is dropped.
+// The socket is non-blocking and it is serviced by the receive loop like the event subscribers.
+
+struct relay_job {
+    char * path;
+    char * rcv_name;
+    char * source;  // value of the SOURCE key
+    size_t size;
+};
+
+static const int64_t RELAY_RETRY_MIN_MS = 1000;
+static const int64_t RELAY_RETRY_MAX_MS = 60 * 1000;
+// Timeout of the connection establishment and of the acknowledgement of a sent file
+static const int64_t RELAY_RESPONSE_TIMEOUT_MS = 60 * 1000;
+// Interval of sending while the socket buffer is full and of checking the connection and acknowledgement
+static const int64_t RELAY_SEND_RETRY_MS = 20;
+#define RELAY_CHUNK_SIZE (64 * 1024)
+// Maximum length of the SOURCE value, the receiver key and value buffer has 128 bytes
+static const size_t RELAY_MAX_SOURCE_LEN = 100;
+
+static const char * relay_to = NULL;
+static const char * relay_queue_file = NULL;
+static char * relay_host = NULL;
+static char * relay_port = NULL;
+static char relay_host_name[64];
+static struct relay_job * relay_jobs = NULL;
+static size_t relay_jobs_len = 0;
+static int relay_fd = -1;
+static bool relay_connecting = false;
+static int64_t relay_retry_delay_ms = 0;     // delay of the next connection attempt after a failure
+static int64_t relay_retry_time = 0;         // no connection attempt before this time
+static int64_t relay_deadline = NO_DEADLINE;  // of the connection establishment or of the acknowledgement
+static int relay_file_fd = -1;               // file of the first job being sent or -1
+static char * relay_head = NULL;             // header of the file being sent or acknowledged, NULL = idle
+static size_t relay_head_len = 0;
+static size_t relay_sent = 0;  // sent bytes of the header and the content
+static char relay_ack[128];    // received part of the acknowledgement line
+static size_t relay_ack_len = 0;
+
+
+// Splits "<host>:<port>" at the last colon. The host may be enclosed in brackets (IPv6 address).
+// An empty host is returned as NULL. Returns false if the port is missing.
+static bool net_parse_address(const char * address, char ** host, char ** port) {
+    const char * const sep = strrchr(address, ':');
+    if (!sep || sep[1] == '\0') {
+        return false;
+    }
+    const char * host_start = address;
+    size_t host_len = sep - address;
+    if (host_len >= 2 && host_start[0] == '[' && host_start[host_len - 1] == ']') {
+        ++host_start;
+        host_len -= 2;
+    }
+    *host = host_len > 0 ? strndup(host_start, host_len) : NULL;
+    *port = my_strdup(sep + 1);
+    return true;
+}
+
+
+// Starts a non-blocking TCP connection to the first address of `host`. The connection is established
+// when tcp_connect_check() returns 1. Returns the socket or -1 on error.
+static int tcp_connect(const char * host, const char * port) {
+    const struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo * addrs;
+    const int err = getaddrinfo(host, port, &hints, &addrs);
+    if (err != 0) {
+        log_fmtmsg(LOG_ERROR, "Cannot resolve address \"%s:%s\": %s", host, port, gai_strerror(err));
+        return -1;
+    }
+    const int fd = socket(addrs->ai_family, addrs->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addrs->ai_protocol);
+    if (fd == -1) {
+        log_fmtmsg(LOG_ERROR, "Cannot create socket: %s", strerror(errno));
+        freeaddrinfo(addrs);
+        return -1;
+    }
+    if (connect(fd, addrs->ai_addr, addrs->ai_addrlen) == -1 && errno != EINPROGRESS) {
+        log_fmtmsg(LOG_ERROR, "Cannot connect to \"%s:%s\": %s", host, port, strerror(errno));
+        close(fd);
+        freeaddrinfo(addrs);
+        return -1;
+    }
+    freeaddrinfo(addrs);
+    return fd;
+}
+
+
+// Returns 1 if the connection started by tcp_connect() is established, 0 if it is still in progress
+// or -1 on error.
+static int tcp_connect_check(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT, .revents = 0};
+    if (poll(&pfd, 1, 0) == 0) {
+        return 0;
+    }
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1) {
+        err = errno;
+    }
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 1;
+}
+
+
+// Writes the queue to a temporary file which then replaces the queue file.
+static void relay_queue_save(void) {
+    char * const tmp_path = sprintf_malloc("%s.tmp", relay_queue_file);
+    FILE * const file = fopen(tmp_path, "w");
+    if (!file) {
+        log_fmtmsg(LOG_ERROR, "Cannot create relay queue file \"%s\": %s", tmp_path, strerror(errno));
+        free(tmp_path);
+        return;
+    }
+    for (size_t i = 0; i < relay_jobs_len; ++i) {
+        const struct relay_job * const job = &relay_jobs[i];
+        fprintf(file, "%llu %s %s %s\n", (unsigned long long)job->size, job->rcv_name, job->source, job->path);
+    }
+    if (fclose(file) != 0 || rename(tmp_path, relay_queue_file) == -1) {
+        log_fmtmsg(LOG_ERROR, "Cannot write relay queue file \"%s\": %s", relay_queue_file, strerror(errno));
+    }
+    free(tmp_path);
+}
+
+
+static void relay_add_job(char * path, char * rcv_name, char * source, size_t size) {
+    relay_jobs = realloc_assert(relay_jobs, (relay_jobs_len + 1) * sizeof(*relay_jobs));
+    struct relay_job * const job = &relay_jobs[relay_jobs_len++];
+    job->path = path;
+    job->rcv_name = rcv_name;
+    job->source = source;
+    job->size = size;
+}
+
+
+// Parses the collector address and loads the jobs remaining in the queue file.
+static bool relay_init(void) {
+    if (!net_parse_address(relay_to, &relay_host, &relay_port) || !relay_host) {
+        fprintf(stderr, "Bad value for argument %s: %s\n", ARG_RELAY_TO, relay_to);
+        return false;
+    }
+    if (gethostname(relay_host_name, sizeof(relay_host_name)) == -1) {
+        strcpy(relay_host_name, "localhost");
+    }
+    relay_host_name[sizeof(relay_host_name) - 1] = '\0';
+    relay_retry_delay_ms = RELAY_RETRY_MIN_MS;
+
+    FILE * const file = fopen(relay_queue_file, "r");
+    if (!file) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        log_fmtmsg(LOG_ERROR, "Cannot open relay queue file \"%s\": %s", relay_queue_file, strerror(errno));
+        return false;
+    }
+    char * line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_size, file)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+        }
+        unsigned long long size;
+        int name_start, name_end, source_start, source_end, path_start = 0;
+        sscanf(line,
+               "%llu %n%*s%n %n%*s%n %n",
+               &size,
+               &name_start,
+               &name_end,
+               &source_start,
+               &source_end,
+               &path_start);
+        if (path_start == 0 || line[path_start] == '\0') {
+            log_fmtmsg(LOG_WARNING, "Bad line in relay queue file \"%s\": %s", relay_queue_file, line);
+            continue;
+        }
+        line[name_end] = '\0';
+        line[source_end] = '\0';
+        relay_add_job(
+            my_strdup(line + path_start), my_strdup(line + name_start), my_strdup(line + source_start), size);
+    }
+    free(line);
+    fclose(file);
+    if (relay_jobs_len > 0) {
+        log_fmtmsg(LOG_INFO, "Loaded %u relay jobs from \"%s\"", (unsigned int)relay_jobs_len, relay_queue_file);
+    }
+    return true;
+}
+
+
+// Queues the relay of the received file. `source` is the port or the source of a relayed file.
+static void relay_file_received(const char * path, const char * rcv_name, size_t size, const char * source) {
+    if (!relay_to) {
+        return;
+    }
+    char * const relay_source = sprintf_malloc("%s:%s", relay_host_name, source);
+    // the value must fit into the receiver buffer of the collector, it must not contain the closing '>'
+    // and the space separating the fields of the queue file
+    for (char * ch = relay_source; *ch != '\0'; ++ch) {
+        if (*ch == '>' || *ch == ' ' || (unsigned char)*ch < 0x20) {
+            *ch = '_';
+        }
+    }
+    if (strlen(relay_source) > RELAY_MAX_SOURCE_LEN) {
+        relay_source[RELAY_MAX_SOURCE_LEN] = '\0';
+    }
+    relay_add_job(my_strdup(path), my_strdup(rcv_name), relay_source, size);
+    relay_queue_save();
+}
+
+
+static void relay_remove_first_job(void) {
+    free(relay_jobs[0].path);
+    free(relay_jobs[0].rcv_name);
+    free(relay_jobs[0].source);
+    memmove(&relay_jobs[0], &relay_jobs[1], (relay_jobs_len - 1) * sizeof(*relay_jobs));
+    --relay_jobs_len;
+    relay_queue_save();
+}
+
+
+// Stops sending of the current file, it is sent again from the start.
+static void relay_cancel_file(void) {
+    if (relay_file_fd != -1) {
+        close(relay_file_fd);
+        relay_file_fd = -1;
+    }
+    free(relay_head);
+    relay_head = NULL;
+    relay_head_len = 0;
+    relay_sent = 0;
+}
+
+
+// Schedules the next connection attempt, the delay is doubled for each failed attempt.
+static void relay_schedule_retry(int64_t now) {
+    relay_retry_time = now + relay_retry_delay_ms;
+    log_fmtmsg(LOG_INFO, "Next connection to the collector in %u ms", (unsigned int)relay_retry_delay_ms);
+    relay_retry_delay_ms =
+        relay_retry_delay_ms * 2 > RELAY_RETRY_MAX_MS ? RELAY_RETRY_MAX_MS : relay_retry_delay_ms * 2;
+}
+
+
+// Closes the connection and schedules the next attempt.
+static void relay_disconnect(int64_t now) {
+    relay_cancel_file();
+    close(relay_fd);
+    relay_fd = -1;
+    relay_connecting = false;
+    relay_deadline = NO_DEADLINE;
+    relay_ack_len = 0;
+    relay_schedule_retry(now);
+}
+
+
+// Opens the file of the first job and prepares its header. Returns false if the job was dropped.
+static bool relay_start_file(void) {
+    const struct relay_job * const job = &relay_jobs[0];
+    relay_file_fd = open(job->path, O_RDONLY | O_CLOEXEC);
+    if (relay_file_fd == -1) {
+        log_fmtmsg(LOG_ERROR, "Cannot open file \"%s\", it is not relayed: %s", job->path, strerror(errno));
+        relay_remove_first_job();
+        return false;
+    }
+    struct stat st;
+    if (fstat(relay_file_fd, &st) == -1 || (size_t)st.st_size < job->size) {
+        log_fmtmsg(LOG_ERROR, "File \"%s\" is shorter than received, it is not relayed", job->path);
+        relay_cancel_file();
+        relay_remove_first_job();
+        return false;
+    }
+    relay_head = sprintf_malloc(
+        "[FILENAME]<%s>[SOURCE]<%s>[FILESIZE]<%llu>", job->rcv_name, job->source, (unsigned long long)job->size);
+    relay_head_len = strlen(relay_head);
+    relay_sent = 0;
+    return true;
+}
+
+
+// Sends the header and the content of the current file until the socket buffer is full.
+// Returns false on error.
+static bool relay_send_file(void) {
+    static char buf[RELAY_CHUNK_SIZE];
+    const size_t total_len = relay_head_len + relay_jobs[0].size;
+    while (relay_sent < total_len) {
+        const char * data;
+        size_t len;
+        if (relay_sent < relay_head_len) {
+            data = relay_head + relay_sent;
+            len = relay_head_len - relay_sent;
+        } else {
+            const size_t offset = relay_sent - relay_head_len;
+            const size_t rest_len = total_len - relay_sent;
+            const ssize_t read_len =
+                pread(relay_file_fd, buf, rest_len > sizeof(buf) ? sizeof(buf) : rest_len, (off_t)offset);
+            if (read_len <= 0) {
+                log_fmtmsg(
+                    LOG_ERROR,
+                    "Cannot read file \"%s\": %s",
+                    relay_jobs[0].path,
+                    read_len == 0 ? "end of file" : strerror(errno));
+                return false;
+            }
+            data = buf;
+            len = read_len;
+        }
+        const ssize_t sent = send(relay_fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return true;
+            }
+            log_fmtmsg(LOG_ERROR, "Cannot send to the collector: %s", strerror(errno));
+            return false;
+        }
+        relay_sent += sent;
+    }
+    return true;
+}
+
+
+// Reads the acknowledgements of the collector. Returns false if the connection must be closed.
+static bool relay_read_ack(void) {
+    while (true) {
+        const ssize_t len = recv(relay_fd, relay_ack + relay_ack_len, sizeof(relay_ack) - 1 - relay_ack_len, 0);
+        if (len == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return true;
+            }
+            log_fmtmsg(LOG_ERROR, "Cannot receive from the collector: %s", strerror(errno));
+            return false;
+        }
+        if (len == 0) {
+            log_msg(LOG_WARNING, "Connection closed by the collector");
+            return false;
+        }
+        relay_ack_len += len;
+        char * line_end;
+        while ((line_end = memchr(relay_ack, '\n', relay_ack_len))) {
+            *line_end = '\0';
+            const bool stored = strncmp(relay_ack, "STORED ", 7) == 0;
+            const char * const name = stored ? relay_ack + 7 : relay_ack + 10;
+            if (!relay_head || relay_file_fd != -1 ||
+                (!stored && strncmp(relay_ack, "DISCARDED ", 10) != 0) || strcmp(name, relay_jobs[0].rcv_name) != 0) {
+                log_fmtmsg(LOG_ERROR, "Unexpected response of the collector: %s", relay_ack);
+                return false;
+            }
+            if (stored) {
+                log_fmtmsg(LOG_INFO, "The file \"%s\" was relayed", relay_jobs[0].path);
+            } else {
+                log_fmtmsg(
+                    LOG_WARNING, "The file \"%s\" was relayed but discarded by the collector", relay_jobs[0].path);
+            }
+            relay_cancel_file();
+            relay_remove_first_job();
+            relay_deadline = NO_DEADLINE;
+            relay_retry_delay_ms = RELAY_RETRY_MIN_MS;
+            relay_ack_len -= line_end + 1 - relay_ack;
+            memmove(relay_ack, line_end + 1, relay_ack_len);
+        }
+        if (relay_ack_len == sizeof(relay_ack) - 1) {
+            log_msg(LOG_ERROR, "Response of the collector is too long");
+            return false;
+        }
+    }
+}
+
+
+// Connects to the collector, sends the queued files and processes the acknowledgements.
+// Returns the time of the next call.
+static int64_t relay_service(int64_t now) {
+    if (!relay_to) {
+        return NO_DEADLINE;
+    }
+    if (relay_fd == -1) {
+        if (relay_jobs_len == 0) {
+            return NO_DEADLINE;
+        }
+        if (relay_retry_time > now) {
+            return relay_retry_time;
+        }
+        if ((relay_fd = tcp_connect(relay_host, relay_port)) == -1) {
+            relay_schedule_retry(now);
+            return relay_retry_time;
+        }
+        relay_connecting = true;
+        relay_deadline = now + RELAY_RESPONSE_TIMEOUT_MS;
+    }
+    if (relay_connecting) {
+        const int ret = tcp_connect_check(relay_fd);
+        if (ret == -1 || (ret == 0 && relay_deadline <= now)) {
+            log_fmtmsg(
+                LOG_ERROR,
+                "Cannot connect to the collector \"%s\": %s",
+                relay_to,
+                ret == -1 ? strerror(errno) : "timeout");
+            relay_disconnect(now);
+            return relay_retry_time;
+        }
+        if (ret == 0) {
+            return now + RELAY_SEND_RETRY_MS;
+        }
+        log_fmtmsg(LOG_INFO, "Connected to the collector \"%s\"", relay_to);
+        relay_connecting = false;
+        relay_deadline = NO_DEADLINE;
+    }
+    if (!relay_read_ack()) {
+        relay_disconnect(now);
+        return relay_retry_time;
+    }
+    if (relay_head && relay_file_fd == -1) {
+        if (relay_deadline <= now) {
+            log_msg(LOG_ERROR, "Timeout, the collector did not acknowledge the file");
+            relay_disconnect(now);
+            return relay_retry_time;
+        }
+        return now + RELAY_SEND_RETRY_MS;
+    }
+    if (!relay_head) {
+        if (relay_jobs_len == 0) {
+            return NO_DEADLINE;
+        }
+        if (relay_retry_time > now) {
+            return relay_retry_time;
+        }
+        if (!relay_start_file()) {
+            return now;  // the job was dropped, the next one is started
+        }
+    }
+    if (!relay_send_file()) {
+        relay_disconnect(now);
+        return relay_retry_time;
+    }
+    if (relay_sent == relay_head_len + relay_jobs[0].size) {
+        close(relay_file_fd);
+        relay_file_fd = -1;
+        relay_deadline = now + RELAY_RESPONSE_TIMEOUT_MS;
+    }
+    return now + RELAY_SEND_RETRY_MS;
+}
+
+
+// Event notifications (--event-socket).
+// Subscribers connected to the Unix domain socket receive a line with a JSON object for each event:
+// {"event":"opened","name":"<rcv_name>","size":<size>,"path":"<storage_path>"}
+// {"event":"progress","name":"<rcv_name>","size":<size>,"received":<bytes>}
+// {"event":"completed","name":"<rcv_name>","size":<size>,"path":"<storage_path>"}
+// {"event":"aborted","name":"<rcv_name>","size":<size>,"received":<bytes>}
+// "completed" is sent when the file is closed in the storage, a spooled file after its migration.
+// Sockets are non-blocking. The waiting subscribers are accepted before an event is sent, so the listening
+// socket is not polled. Events which cannot be sent are buffered, a subscriber with more than
+// EVENT_MAX_BACKLOG bytes of buffered events is disconnected.
+
+struct event_subscriber {
+    int fd;
+    char * backlog;  // buffered events not sent yet
+    size_t backlog_len;
+};
+
+static const size_t EVENT_MAX_BACKLOG = 64 * 1024;
+// Minimum interval of the progress events of a file
+static const int64_t EVENT_PROGRESS_INTERVAL_MS = 1000;
+// Interval of flushing the buffered events
+static const int64_t EVENT_FLUSH_RETRY_MS = 200;
+
+static int event_listen_fd = -1;
+static struct event_subscriber * event_subscribers = NULL;
+static size_t event_subscribers_len = 0;
+
+
+// Creates a non-blocking listening Unix domain socket. A stale socket file is replaced.
+// Returns the socket or -1 on error.
+static int unix_socket_listen(const char * path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_fmtmsg(LOG_ERROR, "Socket path \"%s\" is too long", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        log_fmtmsg(LOG_ERROR, "Cannot create socket \"%s\": %s", path, strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1) {
+        log_fmtmsg(LOG_ERROR, "Cannot listen on socket \"%s\": %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static bool events_init(void) {
+    event_listen_fd = unix_socket_listen(event_socket);
+    return event_listen_fd != -1;
+}
+
+
+// Accepts the waiting subscribers.
+static void events_accept(void) {
+    int fd;
+    while ((fd = accept4(event_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        event_subscribers =
+            realloc_assert(event_subscribers, (event_subscribers_len + 1) * sizeof(*event_subscribers));
+        event_subscribers[event_subscribers_len].fd = fd;
+        event_subscribers[event_subscribers_len].backlog = NULL;
+        event_subscribers[event_subscribers_len].backlog_len = 0;
+        ++event_subscribers_len;
+        log_fmtmsg(LOG_DEBUG, "Event subscriber connected, %u subscribers", (unsigned int)event_subscribers_len);
+    }
+}
+
+
+// Sends the buffered data and then `data`. Data which cannot be sent are buffered.
+// Returns false if the subscriber must be disconnected, ie on error or if more than `max_backlog` bytes
+// would be buffered.
+static bool event_subscriber_send(struct event_subscriber * sub, const char * data, size_t len, size_t max_backlog) {
+    if (sub->backlog_len > 0) {
+        const ssize_t sent = send(sub->fd, sub->backlog, sub->backlog_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return false;
+        }
+        if (sent > 0) {
+            sub->backlog_len -= sent;
+            memmove(sub->backlog, sub->backlog + sent, sub->backlog_len);
+        }
+    }
+    if (len > 0 && sub->backlog_len == 0) {
+        const ssize_t sent = send(sub->fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return false;
+        }
+        if (sent > 0) {
+            data += sent;
+            len -= sent;
+        }
+    }
+    if (len > 0) {
+        if (sub->backlog_len + len > max_backlog) {
+            log_msg(LOG_WARNING, "Subscriber is too slow, it is disconnected");
+            return false;
+        }
+        sub->backlog = realloc_assert(sub->backlog, sub->backlog_len + len);
+        memcpy(sub->backlog + sub->backlog_len, data, len);
+        sub->backlog_len += len;
+    }
+    return true;
+}
+
+
+// Sends `data` to all subscribers and disconnects the failed ones.
+static void events_send(const char * data, size_t len) {
+    for (size_t i = 0; i < event_subscribers_len;) {
+        struct event_subscriber * const sub = &event_subscribers[i];
+        if (event_subscriber_send(sub, data, len, EVENT_MAX_BACKLOG)) {
+            ++i;
+            continue;
+        }
+        close(sub->fd);
+        free(sub->backlog);
+        *sub = event_subscribers[--event_subscribers_len];
+        log_fmtmsg(LOG_DEBUG, "Event subscriber disconnected, %u subscribers", (unsigned int)event_subscribers_len);
+    }
+}
+
+
+static void string_append_json_string(struct string * dest, const char * str) {
+    string_append_csubstring(dest, "\"", 1);
+    for (const char * ch = str; *ch != '\0'; ++ch) {
+        if (*ch == '"' || *ch == '\\') {
+            string_append_csubstring(dest, "\\", 1);
+            string_append_csubstring(dest, ch, 1);
+        } else if ((unsigned char)*ch < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", (unsigned int)(unsigned char)*ch);
+            string_append_csubstring(dest, esc, 6);
+        } else {
+            string_append_csubstring(dest, ch, 1);
+        }
+    }
+    string_append_csubstring(dest, "\"", 1);
+}
+
+
+// Publishes an event. `path` is used by the "opened" and "completed" events, `received` by the others.
+static void events_publish(const char * event, const char * name, size_t size, const char * path, size_t received) {
+    if (event_listen_fd == -1) {
+        return;
+    }
+    events_accept();
+    if (event_subscribers_len == 0) {
+        return;
+    }
+    struct string line;
+    string_init(&line);
+    char * const head = sprintf_malloc("{\"event\":\"%s\",\"name\":", event);
+    string_append_csubstring(&line, head, strlen(head));
+    free(head);
+    string_append_json_string(&line, name);
+    char * const size_str = sprintf_malloc(",\"size\":%llu", (unsigned long long)size);
+    string_append_csubstring(&line, size_str, strlen(size_str));
+    free(size_str);
+    if (path) {
+        string_append_csubstring(&line, ",\"path\":", 8);
+        string_append_json_string(&line, path);
+        string_append_csubstring(&line, "}\n", 2);
+    } else {
+        char * const tail = sprintf_malloc(",\"received\":%llu}\n", (unsigned long long)received);
+        string_append_csubstring(&line, tail, strlen(tail));
+        free(tail);
+    }
+    events_send(line.data, line.length);
+    free(line.data);
+}
+
+
+// Accepts the subscribers and flushes the buffered events. Returns the time of the next call.
+static int64_t events_service(int64_t now) {
+    if (event_listen_fd == -1) {
+        return NO_DEADLINE;
+    }
+    events_accept();
+    bool backlog = false;
+    for (size_t i = 0; i < event_subscribers_len; ++i) {
+        if (event_subscribers[i].backlog_len > 0) {
+            backlog = true;
+            break;
+        }
+    }
+    if (!backlog) {
+        return NO_DEADLINE;
+    }
+    events_send(NULL, 0);
+    return now + EVENT_FLUSH_RETRY_MS;
+}
+
+
+// Live tee of the file content (--payload-tee-socket).
+// Each port has its own tee: a Unix domain socket and one consumer receiving the content of the files
+// received by the port in parallel with the storage write. The socket of a single --port-dev is the given
+// path, the sockets of several ports and of the ports attached by --port-glob are "<path>.<port>", where
+// <port> is the last component of the port device with other characters than letters, digits, '.', '-'
+// and '_' replaced by '_'. The collector has one tee shared by the relay connections, a file started while
+// another one is being sent is not sent.
+// Each file starts with a line with a JSON object {"name":"<rcv_name>","size":<size>,"path":"<storage_path>"}
+// followed by `size` bytes of the content. A file which is not completely received ends the stream,
+// the consumer is disconnected and it can reconnect for the next file. A consumer connected during a file
+// reception receives the next file. Further connections are rejected while a consumer is connected.
+// The consumer is served like the event subscribers, but with TEE_MAX_BACKLOG bytes of buffered content.
+
+static const size_t TEE_MAX_BACKLOG = 4 * 1024 * 1024;
+
+struct tee {
+    char * socket_path;
+    int listen_fd;
+    struct event_subscriber consumer;
+    bool receiving;  // the content of a file is being sent
+};
+
+static struct tee ** tees = NULL;  // open tees, serviced by tee_service()
+static size_t tees_len = 0;
+
+
+// Returns the socket path of the tee of the port device: "<path>.<port>".
+static char * tee_port_socket_path(const char * dev) {
+    const char * name = strrchr(dev, '/');
+    name = name ? name + 1 : dev;
+    char * const path = sprintf_malloc("%s.%s", payload_tee_socket, name);
+    for (char * c = path + strlen(payload_tee_socket) + 1; *c != '\0'; ++c) {
+        if (!isalnum((unsigned char)*c) && *c != '.' && *c != '-' && *c != '_') {
+            *c = '_';
+        }
+    }
+    return path;
+}
+
+
+// Creates the tee listening on the socket path, takes the ownership of the path. Returns NULL on error.
+static struct tee * tee_open(char * socket_path) {
+    for (size_t i = 0; i < tees_len; ++i) {
+        if (strcmp(tees[i]->socket_path, socket_path) == 0) {
+            log_fmtmsg(LOG_ERROR, "Tee socket \"%s\" is already used by another port", socket_path);
+            free(socket_path);
+            return NULL;
+        }
+    }
+    const int listen_fd = unix_socket_listen(socket_path);
+    if (listen_fd == -1) {
+        free(socket_path);
+        return NULL;
+    }
+    struct tee * const tee = realloc_assert(NULL, sizeof(*tee));
+    tee->socket_path = socket_path;
+    tee->listen_fd = listen_fd;
+    tee->consumer.fd = -1;
+    tee->consumer.backlog = NULL;
+    tee->consumer.backlog_len = 0;
+    tee->receiving = false;
+    tees = realloc_assert(tees, (tees_len + 1) * sizeof(*tees));
+    tees[tees_len++] = tee;
+    return tee;
+}
+
+
+static void tee_disconnect(struct tee * tee) {
+    close(tee->consumer.fd);
+    free(tee->consumer.backlog);
+    tee->consumer.fd = -1;
+    tee->consumer.backlog = NULL;
+    tee->consumer.backlog_len = 0;
+    log_fmtmsg(LOG_DEBUG, "Tee consumer of \"%s\" disconnected", tee->socket_path);
+}
+
+
+// Disconnects the consumer and removes the socket. NULL is ignored.
+static void tee_close(struct tee * tee) {
+    if (!tee) {
+        return;
+    }
+    if (tee->consumer.fd != -1) {
+        tee_disconnect(tee);
+    }
+    close(tee->listen_fd);
+    unlink(tee->socket_path);
+    for (size_t i = 0; i < tees_len; ++i) {
+        if (tees[i] == tee) {
+            tees[i] = tees[--tees_len];
+            break;
+        }
+    }
+    free(tee->socket_path);
+    free(tee);
+}
+
+
+// Accepts the waiting consumer. Connections above the one consumer are closed.
+static void tee_accept(struct tee * tee) {
+    int fd;
+    while ((fd = accept4(tee->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        if (tee->consumer.fd != -1) {
+            log_fmtmsg(
+                LOG_WARNING,
+                "Tee consumer of \"%s\" is already connected, the new connection is rejected",
+                tee->socket_path);
+            close(fd);
+            continue;
+        }
+        tee->consumer.fd = fd;
+        log_fmtmsg(LOG_DEBUG, "Tee consumer of \"%s\" connected", tee->socket_path);
+    }
+}
+
+
+// Sends the file content to the consumer. Returns false if the consumer was disconnected.
+static bool tee_send(struct tee * tee, const char * data, size_t len) {
+    if (!event_subscriber_send(&tee->consumer, data, len, TEE_MAX_BACKLOG)) {
+        tee_disconnect(tee);
+        return false;
+    }
+    return true;
+}
+
+
+// Starts the tee of a file. Returns true if the file content is to be sent to the consumer.
+static bool tee_file_opened(struct tee * tee, const char * name, size_t size, const char * path) {
+    if (tee->receiving) {
+        return false;
+    }
+    tee_accept(tee);
+    if (tee->consumer.fd == -1) {
+        return false;
+    }
+    struct string line;
+    string_init(&line);
+    string_append_csubstring(&line, "{\"name\":", 8);
+    string_append_json_string(&line, name);
+    char * const size_str = sprintf_malloc(",\"size\":%llu,\"path\":", (unsigned long long)size);
+    string_append_csubstring(&line, size_str, strlen(size_str));
+    free(size_str);
+    string_append_json_string(&line, path);
+    string_append_csubstring(&line, "}\n", 2);
+    tee->receiving = tee_send(tee, line.data, line.length);
+    free(line.data);
+    return tee->receiving;
+}
+
+
+// Ends the tee of a file, the consumer is disconnected if the file was not completely sent.
+static void tee_file_closed(struct tee * tee, bool complete) {
+    if (!complete && tee->consumer.fd != -1) {
+        tee_disconnect(tee);
+    }
+    tee->receiving = false;
+}
+
+
+// Accepts the consumers and flushes the buffered content of all tees. Returns the time of the next call.
+static int64_t tee_service(int64_t now) {
+    int64_t deadline = NO_DEADLINE;
+    for (size_t i = 0; i < tees_len; ++i) {
+        struct tee * const tee = tees[i];
+        tee_accept(tee);
+        if (tee->consumer.backlog_len > 0 && tee_send(tee, NULL, 0) && tee->consumer.backlog_len > 0) {
+            deadline = now + EVENT_FLUSH_RETRY_MS;
+        }
+    }
+    return deadline;
+}
+
+
+// Grayscale preview images, 8 bits per pixel, rows from top to bottom.
+// PNG is compressed by deflate with the fixed Huffman codes and run-length matches (distance 1), which
+// suits the large uniform areas of the plots.
+
+static void string_append_u32_be(struct string * dest, uint32_t value) {
+    const char bytes[4] = {(char)(value >> 24), (char)(value >> 16), (char)(value >> 8), (char)value};
+    string_append_csubstring(dest, bytes, 4);
+}
+
+
+static uint32_t png_crc32(const unsigned char * data, size_t len, uint32_t crc) {
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                value = value & 1 ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+            }
+            table[i] = value;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+
+static void png_append_chunk(struct string * dest, const char * type, const struct string * data) {
+    string_append_u32_be(dest, data->length);
+    const size_t type_pos = dest->length;
+    string_append_csubstring(dest, type, 4);
+    string_append_csubstring(dest, data->data, data->length);
+    const unsigned char * const crc_data = (const unsigned char *)dest->data + type_pos;
+    string_append_u32_be(dest, png_crc32(crc_data, 4 + data->length, 0));
+}
+
+
+// Deflate bit stream, bits are stored from the least significant bit of each byte.
+struct deflate_bits {
+    struct string * dest;
+    uint32_t buf;
+    unsigned int len;
+};
+
+static void deflate_put_bits(struct deflate_bits * bits, uint32_t value, unsigned int len) {
+    bits->buf |= value << bits->len;
+    bits->len += len;
+    while (bits->len >= 8) {
+        const char byte = (char)bits->buf;
+        string_append_csubstring(bits->dest, &byte, 1);
+        bits->buf >>= 8;
+        bits->len -= 8;
+    }
+}
+
+
+// Huffman codes are stored from the most significant bit.
+static void deflate_put_code(struct deflate_bits * bits, uint32_t code, unsigned int len) {
+    uint32_t reversed = 0;
+    for (unsigned int i = 0; i < len; ++i) {
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    deflate_put_bits(bits, reversed, len);
+}
+
+
+// Writes a literal/length symbol with the fixed Huffman code.
+static void deflate_put_symbol(struct deflate_bits * bits, unsigned int symbol) {
+    if (symbol < 144) {
+        deflate_put_code(bits, 0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        deflate_put_code(bits, 0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        deflate_put_code(bits, symbol - 256, 7);
+    } else {
+        deflate_put_code(bits, 0xC0 + symbol - 280, 8);
+    }
+}
+
+
+// Writes a match of `len` (3 - 258) bytes at the distance 1.
+static void deflate_put_run(struct deflate_bits * bits, unsigned int len) {
+    static const unsigned short bases[] = {3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+                                           31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const unsigned char extra_bits[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                               2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    unsigned int code = sizeof(bases) / sizeof(bases[0]) - 1;
+    while (bases[code] > len) {
+        --code;
+    }
+    deflate_put_symbol(bits, 257 + code);
+    deflate_put_bits(bits, len - bases[code], extra_bits[code]);
+    deflate_put_code(bits, 0, 5);  // distance 1
+}
+
+
+// Appends the zlib stream of `data`.
+static void zlib_compress(struct string * dest, const unsigned char * data, size_t len) {
+    string_append_csubstring(dest, "\x78\x01", 2);
+    struct deflate_bits bits = {dest, 0, 0};
+    deflate_put_bits(&bits, 1, 1);  // final block
+    deflate_put_bits(&bits, 1, 2);  // fixed Huffman codes
+    size_t pos = 0;
+    while (pos < len) {
+        size_t run = 0;
+        if (pos > 0) {
+            while (run < 258 && pos + run < len && data[pos + run] == data[pos - 1]) {
+                ++run;
+            }
+        }
+        if (run >= 3) {
+            deflate_put_run(&bits, run);
+            pos += run;
+        } else {
+            deflate_put_symbol(&bits, data[pos]);
+            ++pos;
+        }
+    }
+    deflate_put_symbol(&bits, 256);  // end of block
+    deflate_put_bits(&bits, 0, 7);   // flush
+    uint32_t adler_a = 1;
+    uint32_t adler_b = 0;
+    for (size_t i = 0; i < len; ++i) {
+        adler_a = (adler_a + data[i]) % 65521;
+        adler_b = (adler_b + adler_a) % 65521;
+    }
+    string_append_u32_be(dest, (adler_b << 16) | adler_a);
+}
+
+
+static void image_encode_png(
+    struct string * dest, const unsigned char * pixels, unsigned int width, unsigned int height) {
+    string_append_csubstring(dest, "\x89PNG\r\n\x1A\n", 8);
+    struct string chunk;
+    string_init(&chunk);
+    string_append_u32_be(&chunk, width);
+    string_append_u32_be(&chunk, height);
+    string_append_csubstring(&chunk, "\x08\x00\x00\x00\x00", 5);  // 8 bits grayscale, no interlace
+    png_append_chunk(dest, "IHDR", &chunk);
+
+    // Each row is preceded by the filter type 0 (none).
+    const size_t row_len = (size_t)width + 1;
+    unsigned char * const raw = realloc_assert(NULL, row_len * height);
+    for (unsigned int y = 0; y < height; ++y) {
+        raw[y * row_len] = 0;
+        memcpy(raw + y * row_len + 1, pixels + (size_t)y * width, width);
+    }
+    chunk.length = 0;
+    zlib_compress(&chunk, raw, row_len * height);
+    free(raw);
+    png_append_chunk(dest, "IDAT", &chunk);
+    chunk.length = 0;
+    png_append_chunk(dest, "IEND", &chunk);
+    free(chunk.data);
+}
+
+
+// Writes the image to `path` in the PGM or PNG format.
+static bool image_write(
+    const char * path, bool png, const unsigned char * pixels, unsigned int width, unsigned int height) {
+    struct string image;
+    string_init(&image);
+    if (png) {
+        image_encode_png(&image, pixels, width, height);
+    } else {
+        char * const head = sprintf_malloc("P5\n%u %u\n255\n", width, height);
+        string_append_csubstring(&image, head, strlen(head));
+        free(head);
+        string_append_csubstring(&image, (const char *)pixels, (size_t)width * height);
+    }
+    FILE * const file = fopen(path, "wb");
+    bool written = false;
+    if (file) {
+        written = fwrite(image.data, 1, image.length, file) == image.length;
+        written = fclose(file) == 0 && written;
+    }
+    if (!written) {
+        log_fmtmsg(LOG_ERROR, "Cannot write image \"%s\": %s", path, strerror(errno));
+    }
+    free(image.data);
+    return written;
+}
+
+
+// Per-parameter statistics of FCS files (--fcs-stats).
+// The HEADER and TEXT segments are collected from the received content. Then the list mode DATA segment
+// is decoded as it arrives and the minimum, maximum and sum of each parameter are accumulated.
+// When the file is saved, the statistics are written to the sidecar file "<storage_path>.stats":
+// {"name":"<rcv_name>","events":<n>,"parameters":[{"name":"<$PnN>","min":<v>,"max":<v>,"mean":<v>},...]}
+// Supported are data types I (8, 16, 32 or 64 bits, masked by $PnR), F and D in any $BYTEORD permutation.
+// The values are decoded by the primitives of fcsreader.h, the same as fcs_extract() uses.
+// The decoding and accumulation loops work on whole events and separate arrays per statistic, so that
+// the compiler can vectorize them.
+// The same decoding feeds the previews (--fcs-preview): 1D histograms of the first FCS_PREVIEW_MAX_HISTOGRAMS
+// parameters in "<storage_path>.hist.<pgm/png>" and the 2D density plot of two parameters
+// in "<storage_path>.density.<pgm/png>". The values are binned linearly from 0 to $PnR.
+// It also feeds the columnar copy of the DATA segment (--fcs-columnar) in "<storage_path>.col". The file is
+// written during the reception, blocks of FCS_COLUMNAR_BLOCK_SIZE bytes of events are transposed and written
+// to their columns. Layout (all numbers little-endian):
+//   0: magic "CYFRCOL1"
+//   8: uint32 number of parameters
+//  12: uint32 value type (1 - float32, 2 - uint16, values clamped to 0 - 65535 and rounded)
+//  16: uint64 number of events
+//  24: uint64 offset of the first column, the column N starts at offset + N * stride
+//  32: uint64 column stride in bytes
+//  40: reserved (zeros)
+//  64: parameter names ($PnN), FCS_COLUMNAR_NAME_SIZE bytes each, zero padded
+// The columns are aligned to FCS_COLUMNAR_ALIGN bytes, so a single column can be mapped to memory.
+// The sidecar files of a spooled file are written next to "<name>.data" in the spool and migrated with it.
+// The header is written when the file is complete. The column stride is given by the size of the DATA
+// segment, the events above the number of events are zeros.
+
+static const size_t FCS_HEADER_LEN = 58;
+static const size_t FCS_MAX_TEXT_END = 1024 * 1024;  // the TEXT segment must end below this offset
+static const unsigned int FCS_MAX_PARAMETERS = 4096;
+#define FCS_PREVIEW_BINS 256
+static const unsigned int FCS_PREVIEW_MAX_HISTOGRAMS = 32;
+static const unsigned int FCS_PREVIEW_HIST_HEIGHT = 32;
+static const char FCS_COLUMNAR_SUFFIX[] = ".col";
+static const size_t FCS_COLUMNAR_BLOCK_SIZE = 256 * 1024;
+static const size_t FCS_COLUMNAR_NAME_SIZE = 64;
+static const size_t FCS_COLUMNAR_ALIGN = 4096;
+
+static bool parse_size(const char * str, size_t * value);
+
+enum fcs_state { FCS_HEADER, FCS_TEXT, FCS_DATA, FCS_DONE, FCS_UNSUPPORTED };
+
+struct fcs_stats {
+    enum fcs_state state;
+    size_t offset;     // offset of the next content byte in the file
+    size_t file_size;  // announced size of the file, the DATA segment must end within it
+    char * head;       // collected HEADER and TEXT segments
+    size_t head_len;
+    size_t text_begin;
+    size_t text_end;    // inclusive
+    size_t data_begin;
+    size_t data_end;    // exclusive
+    char datatype;      // 'I', 'F' or 'D'
+    struct fcs_byteord byteord;
+    unsigned int params_len;
+    unsigned int width;  // bytes per parameter value if the same for all parameters, otherwise 0
+    unsigned int * widths;
+    enum fcs_byte_order * orders;
+    uint64_t * masks;
+    char ** names;
+    double * row;  // decoded values of one event
+    double * min;
+    double * max;
+    double * sum;
+    unsigned char * event;  // event split between received blocks
+    size_t event_len;
+    size_t event_size;
+    uint64_t events;
+    double * scales;  // preview bins per unit of the parameter values
+    unsigned int hist_params_len;
+    unsigned int * bins;  // bins of the values of one event
+    uint32_t * hist;      // FCS_PREVIEW_BINS counters for each of the first hist_params_len parameters
+    uint32_t * density;   // FCS_PREVIEW_BINS x FCS_PREVIEW_BINS counters or NULL
+    unsigned int density_x;
+    unsigned int density_y;
+    char * path;  // path of the written file, the storage file or the spooled file
+    int col_fd;   // columnar file or -1
+    char * col_path;
+    size_t col_value_size;
+    size_t col_offset;
+    size_t col_stride;
+    unsigned char * col_block;  // transposed block of events, col_block_events values for each parameter
+    size_t col_block_events;    // capacity of the block in events
+    size_t col_block_len;       // number of events in the block
+    uint64_t col_written;       // number of events written to the columns
+};
+
+
+static struct fcs_stats * fcs_stats_create(const char * path, size_t file_size) {
+    struct fcs_stats * const st = realloc_assert(NULL, sizeof(*st));
+    memset(st, 0, sizeof(*st));
+    st->state = FCS_HEADER;
+    st->path = my_strdup(path);
+    st->file_size = file_size;
+    st->col_fd = -1;
+    st->head = realloc_assert(NULL, FCS_HEADER_LEN);
+    return st;
+}
+
+
+// Frees the state. An unfinished columnar file is removed.
+static void fcs_stats_free(struct fcs_stats * st) {
+    if (st->col_fd != -1) {
+        close(st->col_fd);
+        unlink(st->col_path);
+    }
+    free(st->col_path);
+    free(st->col_block);
+    free(st->path);
+    for (unsigned int i = 0; i < st->params_len && st->names; ++i) {
+        free(st->names[i]);
+    }
+    free(st->names);
+    free(st->widths);
+    free(st->orders);
+    free(st->masks);
+    free(st->row);
+    free(st->min);
+    free(st->max);
+    free(st->sum);
+    free(st->event);
+    free(st->scales);
+    free(st->bins);
+    free(st->hist);
+    free(st->density);
+    free(st->head);
+    free(st);
+}
+
+
+// Returns an error message or NULL if the keyword was processed.
+static const char * fcs_stats_keyword(struct fcs_stats * st, const char * key, const char * value, bool params) {
+    if (!params) {
+        if (strcasecmp(key, "$PAR") == 0) {
+            size_t par;
+            if (!fcs_parse_size(value, strlen(value), &par) || par == 0 || par > FCS_MAX_PARAMETERS) {
+                return "bad $PAR";
+            }
+            st->params_len = par;
+        } else if (strcasecmp(key, "$DATATYPE") == 0) {
+            st->datatype = toupper((unsigned char)value[0]);
+            if (value[0] == '\0' || value[1] != '\0' ||
+                (st->datatype != 'I' && st->datatype != 'F' && st->datatype != 'D')) {
+                return "unsupported $DATATYPE";
+            }
+        } else if (strcasecmp(key, "$BYTEORD") == 0) {
+            if (fcs_parse_byteord(value, &st->byteord) != FCS_OK) {
+                return "unsupported $BYTEORD";
+            }
+        } else if (strcasecmp(key, "$MODE") == 0) {
+            if (strcasecmp(value, "L") != 0) {
+                return "unsupported $MODE";
+            }
+        } else if (strcasecmp(key, "$BEGINDATA") == 0) {
+            if (st->data_begin == 0 && !fcs_parse_size(value, strlen(value), &st->data_begin)) {
+                return "bad $BEGINDATA";
+            }
+        } else if (strcasecmp(key, "$ENDDATA") == 0) {
+            if (st->data_end == 0 && !fcs_parse_size(value, strlen(value), &st->data_end)) {
+                return "bad $ENDDATA";
+            }
+        }
+        return NULL;
+    }
+
+    if ((key[0] != '$') || toupper((unsigned char)key[1]) != 'P' || !isdigit((unsigned char)key[2])) {
+        return NULL;
+    }
+    char * suffix;
+    const unsigned long idx = strtoul(key + 2, &suffix, 10);
+    if (idx == 0 || idx > st->params_len || suffix[0] == '\0' || suffix[1] != '\0') {
+        return NULL;
+    }
+    switch (toupper((unsigned char)suffix[0])) {
+        case 'B': {
+            size_t bits;
+            if (!fcs_parse_size(value, strlen(value), &bits) || (bits != 8 && bits != 16 && bits != 32 && bits != 64)) {
+                return "unsupported $PnB";
+            }
+            st->widths[idx - 1] = bits / 8;
+            break;
+        }
+        case 'N':
+            free(st->names[idx - 1]);
+            st->names[idx - 1] = my_strdup(value);
+            break;
+        case 'R':
+            st->masks[idx - 1] = fcs_range_mask(value);
+            st->scales[idx - 1] = FCS_PREVIEW_BINS / strtod(value, NULL);
+            break;
+    }
+    return NULL;
+}
+
+
+// Allocates the preview counters. The density plot parameters are found by their names ($PnN),
+// the first two parameters are used by default. A file with one parameter has no default density plot.
+static void fcs_preview_init(struct fcs_stats * st) {
+    st->hist_params_len =
+        st->params_len < FCS_PREVIEW_MAX_HISTOGRAMS ? st->params_len : FCS_PREVIEW_MAX_HISTOGRAMS;
+    st->bins = realloc_assert(NULL, st->params_len * sizeof(*st->bins));
+    st->hist = realloc_assert(NULL, st->hist_params_len * FCS_PREVIEW_BINS * sizeof(*st->hist));
+    memset(st->hist, 0, st->hist_params_len * FCS_PREVIEW_BINS * sizeof(*st->hist));
+    st->density_x = 0;
+    st->density_y = 1;
+    if (fcs_preview_density_x) {
+        st->density_x = st->density_y = st->params_len;
+        for (unsigned int i = 0; i < st->params_len; ++i) {
+            if (strcmp(st->names[i], fcs_preview_density_x) == 0) {
+                st->density_x = i;
+            }
+            if (strcmp(st->names[i], fcs_preview_density_y) == 0) {
+                st->density_y = i;
+            }
+        }
+    }
+    if (st->density_x < st->params_len && st->density_y < st->params_len) {
+        st->density = realloc_assert(NULL, FCS_PREVIEW_BINS * FCS_PREVIEW_BINS * sizeof(*st->density));
+        memset(st->density, 0, FCS_PREVIEW_BINS * FCS_PREVIEW_BINS * sizeof(*st->density));
+    } else if (fcs_preview_density_x) {
+        log_fmtmsg(
+            LOG_WARNING,
+            "Density plot parameters \"%s\" and \"%s\" not found, the plot is not created",
+            fcs_preview_density_x,
+            fcs_preview_density_y);
+    }
+}
+
+
+// Creates the columnar file. On error, the columnar copy of the file is not created.
+static void fcs_columnar_init(struct fcs_stats * st) {
+    st->col_path = sprintf_malloc("%s%s", st->path, FCS_COLUMNAR_SUFFIX);
+    if (storage_create_dirs || (storage_dir && storage_shard_levels > 0)) {
+        mkdirs(st->col_path);
+    }
+    st->col_fd = open(st->col_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (st->col_fd == -1) {
+        log_fmtmsg(LOG_ERROR, "Cannot create columnar file \"%s\": %s", st->col_path, strerror(errno));
+        return;
+    }
+    st->col_value_size = fcs_columnar == FCS_COLUMNAR_FLOAT32 ? 4 : 2;
+    const size_t header_size = 64 + st->params_len * FCS_COLUMNAR_NAME_SIZE;
+    const size_t capacity = (st->data_end - st->data_begin) / st->event_size;
+    st->col_offset = (header_size + FCS_COLUMNAR_ALIGN - 1) / FCS_COLUMNAR_ALIGN * FCS_COLUMNAR_ALIGN;
+    st->col_stride =
+        (capacity * st->col_value_size + FCS_COLUMNAR_ALIGN - 1) / FCS_COLUMNAR_ALIGN * FCS_COLUMNAR_ALIGN;
+    st->col_block_events = FCS_COLUMNAR_BLOCK_SIZE / (st->params_len * st->col_value_size);
+    st->col_block_events = st->col_block_events > 0 ? st->col_block_events : 1;
+    st->col_block = realloc_assert(NULL, st->params_len * st->col_block_events * st->col_value_size);
+}
+
+
+// Parses the TEXT segment and prepares the decoding of the DATA segment. Returns an error message or NULL.
+static const char * fcs_stats_parse_text(struct fcs_stats * st) {
+    const char * const text = st->head + st->text_begin + 1;
+    const size_t text_len = st->text_end - st->text_begin;
+    const char delim = st->head[st->text_begin];
+    st->datatype = '\0';
+    st->byteord.len = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+        if (pass == 1) {
+            if (st->params_len == 0 || st->datatype == '\0') {
+                return "missing $PAR or $DATATYPE";
+            }
+            st->widths = realloc_assert(NULL, st->params_len * sizeof(*st->widths));
+            st->masks = realloc_assert(NULL, st->params_len * sizeof(*st->masks));
+            st->names = realloc_assert(NULL, st->params_len * sizeof(*st->names));
+            st->scales = realloc_assert(NULL, st->params_len * sizeof(*st->scales));
+            for (unsigned int i = 0; i < st->params_len; ++i) {
+                st->widths[i] = 0;
+                st->masks[i] = UINT64_MAX;
+                st->names[i] = NULL;
+                st->scales[i] = 0;
+            }
+        }
+        size_t pos = 0;
+        while (pos < text_len) {
+            char * const key = fcs_text_token(text, text_len, delim, &pos);
+            char * const value = fcs_text_token(text, text_len, delim, &pos);
+            const char * const error = fcs_stats_keyword(st, key, value, pass == 1);
+            free(value);
+            free(key);
+            if (error) {
+                return error;
+            }
+        }
+    }
+
+    st->width = st->widths[0];
+    st->event_size = 0;
+    st->orders = realloc_assert(NULL, st->params_len * sizeof(*st->orders));
+    for (unsigned int i = 0; i < st->params_len; ++i) {
+        const unsigned int width = st->widths[i];
+        if (width == 0 || (st->datatype == 'F' && width != 4) || (st->datatype == 'D' && width != 8)) {
+            return "missing or unsupported $PnB";
+        }
+        st->orders[i] = fcs_value_byte_order(&st->byteord, width);
+        if (width != st->width) {
+            st->width = 0;
+        }
+        if (!st->names[i]) {
+            st->names[i] = sprintf_malloc("P%u", i + 1);
+        }
+        st->event_size += width;
+    }
+    if (st->data_end <= st->data_begin || st->data_begin <= st->text_end || st->data_end >= st->file_size) {
+        return "bad DATA segment offsets";
+    }
+    ++st->data_end;
+    st->row = realloc_assert(NULL, st->params_len * sizeof(*st->row));
+    st->min = realloc_assert(NULL, st->params_len * sizeof(*st->min));
+    st->max = realloc_assert(NULL, st->params_len * sizeof(*st->max));
+    st->sum = realloc_assert(NULL, st->params_len * sizeof(*st->sum));
+    for (unsigned int i = 0; i < st->params_len; ++i) {
+        st->min[i] = HUGE_VAL;
+        st->max[i] = -HUGE_VAL;
+        st->sum[i] = 0;
+    }
+    st->event = realloc_assert(NULL, st->event_size);
+    if (fcs_preview != FCS_PREVIEW_NONE) {
+        fcs_preview_init(st);
+    }
+    if (fcs_columnar != FCS_COLUMNAR_NONE) {
+        fcs_columnar_init(st);
+    }
+    return NULL;
+}
+
+
+// Parses the collected HEADER or TEXT segment. Returns an error message or NULL.
+static const char * fcs_stats_parse_head(struct fcs_stats * st) {
+    if (st->state == FCS_HEADER) {
+        if (memcmp(st->head, "FCS", 3) != 0) {
+            return "not an FCS file";
+        }
+        if (!fcs_parse_size(st->head + 10, 8, &st->text_begin) || !fcs_parse_size(st->head + 18, 8, &st->text_end) ||
+            !fcs_parse_size(st->head + 26, 8, &st->data_begin) || !fcs_parse_size(st->head + 34, 8, &st->data_end)) {
+            return "bad HEADER segment";
+        }
+        if (st->text_begin < FCS_HEADER_LEN || st->text_end <= st->text_begin || st->text_end >= FCS_MAX_TEXT_END) {
+            return "bad or too large TEXT segment";
+        }
+        st->head = realloc_assert(st->head, st->text_end + 1);
+        st->state = FCS_TEXT;
+        return NULL;
+    }
+    const char * const error = fcs_stats_parse_text(st);
+    if (!error) {
+        st->state = FCS_DATA;
+    }
+    return error;
+}
+
+
+static double fcs_load_value(const struct fcs_stats * st, const unsigned char * src, unsigned int idx) {
+    const unsigned int width = st->widths[idx];
+    const uint64_t bits = st->orders[idx] == FCS_ORDER_PERMUTED ? fcs_load_uint_permuted(&st->byteord, src, width)
+                                                                 : fcs_load_uint(src, width, st->orders[idx]);
+    if (st->datatype == 'F') {
+        const uint32_t bits32 = bits;
+        float value;
+        memcpy(&value, &bits32, sizeof(value));
+        return value;
+    }
+    if (st->datatype == 'D') {
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    return (double)(bits & st->masks[idx]);
+}
+
+
+// Decodes one event to `st->row`. Separate loops with a constant width are used for the common layouts,
+// the permuted byte orders are decoded value by value.
+static void fcs_decode_event(struct fcs_stats * st, const unsigned char * src) {
+    const unsigned int params_len = st->params_len;
+    const enum fcs_byte_order order = st->orders[0];
+    double * const row = st->row;
+    if (order != FCS_ORDER_PERMUTED && st->datatype == 'I' && st->width == 2) {
+        for (unsigned int i = 0; i < params_len; ++i) {
+            row[i] = (double)(fcs_load_uint(src + 2 * i, 2, order) & st->masks[i]);
+        }
+    } else if (order != FCS_ORDER_PERMUTED && st->datatype == 'I' && st->width == 4) {
+        for (unsigned int i = 0; i < params_len; ++i) {
+            row[i] = (double)(fcs_load_uint(src + 4 * i, 4, order) & st->masks[i]);
+        }
+    } else if (order != FCS_ORDER_PERMUTED && st->datatype == 'F') {
+        for (unsigned int i = 0; i < params_len; ++i) {
+            const uint32_t bits = fcs_load_uint(src + 4 * i, 4, order);
+            float value;
+            memcpy(&value, &bits, sizeof(value));
+            row[i] = value;
+        }
+    } else {
+        for (unsigned int i = 0; i < params_len; ++i) {
+            row[i] = fcs_load_value(st, src, i);
+            src += st->widths[i];
+        }
+    }
+}
+
+
+// Adds the decoded event to the histograms and to the density plot. NaN and values below 0 fall
+// to the first bin, values above the range to the last one.
+static void fcs_preview_bin_event(struct fcs_stats * st) {
+    const unsigned int params_len = st->params_len;
+    const double * const row = st->row;
+    const double * const scales = st->scales;
+    unsigned int * const bins = st->bins;
+    for (unsigned int i = 0; i < params_len; ++i) {
+        const double bin = row[i] * scales[i];
+        bins[i] = bin >= 0 ? (bin < FCS_PREVIEW_BINS ? (unsigned int)bin : FCS_PREVIEW_BINS - 1) : 0;
+    }
+    for (unsigned int i = 0; i < st->hist_params_len; ++i) {
+        ++st->hist[i * FCS_PREVIEW_BINS + bins[i]];
+    }
+    if (st->density) {
+        ++st->density[(FCS_PREVIEW_BINS - 1 - bins[st->density_y]) * FCS_PREVIEW_BINS + bins[st->density_x]];
+    }
+}
+
+
+static void fcs_columnar_failed(struct fcs_stats * st) {
+    log_fmtmsg(LOG_ERROR, "Cannot write columnar file \"%s\": %s", st->col_path, strerror(errno));
+    close(st->col_fd);
+    unlink(st->col_path);
+    st->col_fd = -1;
+}
+
+
+static bool fcs_pwrite(int fd, const unsigned char * data, size_t len, size_t offset) {
+    while (len > 0) {
+        const ssize_t written = pwrite(fd, data, len, (off_t)offset);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        len -= written;
+        offset += written;
+    }
+    return true;
+}
+
+
+// Writes the block of events to the columns.
+static void fcs_columnar_flush(struct fcs_stats * st) {
+    const size_t block_size = st->col_block_events * st->col_value_size;
+    const size_t len = st->col_block_len * st->col_value_size;
+    for (unsigned int i = 0; i < st->params_len && st->col_fd != -1; ++i) {
+        const size_t offset = st->col_offset + i * st->col_stride + st->col_written * st->col_value_size;
+        if (!fcs_pwrite(st->col_fd, st->col_block + i * block_size, len, offset)) {
+            fcs_columnar_failed(st);
+        }
+    }
+    st->col_written += st->col_block_len;
+    st->col_block_len = 0;
+}
+
+
+// Stores the decoded event to the transposed block.
+static void fcs_columnar_add_event(struct fcs_stats * st) {
+    const unsigned int params_len = st->params_len;
+    const double * const row = st->row;
+    unsigned char * dest = st->col_block + st->col_block_len * st->col_value_size;
+    const size_t block_size = st->col_block_events * st->col_value_size;
+    if (fcs_columnar == FCS_COLUMNAR_FLOAT32) {
+        for (unsigned int i = 0; i < params_len; ++i, dest += block_size) {
+            const float value = row[i];
+            uint32_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            dest[0] = bits;
+            dest[1] = bits >> 8;
+            dest[2] = bits >> 16;
+            dest[3] = bits >> 24;
+        }
+    } else {
+        for (unsigned int i = 0; i < params_len; ++i, dest += block_size) {
+            const double value = row[i] >= 0 ? (row[i] < 65535 ? row[i] + 0.5 : 65535) : 0;
+            const uint16_t bits = value;
+            dest[0] = bits;
+            dest[1] = bits >> 8;
+        }
+    }
+    if (++st->col_block_len == st->col_block_events) {
+        fcs_columnar_flush(st);
+    }
+}
+
+
+static void store_le(unsigned char * dest, uint64_t value, unsigned int len) {
+    for (unsigned int i = 0; i < len; ++i) {
+        dest[i] = value >> (8 * i);
+    }
+}
+
+
+// Writes the rest of the events and the header. The file gets the full size of the columns.
+static void fcs_columnar_finish(struct fcs_stats * st) {
+    fcs_columnar_flush(st);
+    if (st->col_fd == -1) {
+        return;
+    }
+    const size_t header_size = 64 + st->params_len * FCS_COLUMNAR_NAME_SIZE;
+    unsigned char * const header = realloc_assert(NULL, header_size);
+    memset(header, 0, header_size);
+    memcpy(header, "CYFRCOL1", 8);
+    store_le(header + 8, st->params_len, 4);
+    store_le(header + 12, fcs_columnar == FCS_COLUMNAR_FLOAT32 ? 1 : 2, 4);
+    store_le(header + 16, st->col_written, 8);
+    store_le(header + 24, st->col_offset, 8);
+    store_le(header + 32, st->col_stride, 8);
+    for (unsigned int i = 0; i < st->params_len; ++i) {
+        strncpy((char *)header + 64 + i * FCS_COLUMNAR_NAME_SIZE, st->names[i], FCS_COLUMNAR_NAME_SIZE);
+    }
+    const bool written = fcs_pwrite(st->col_fd, header, header_size, 0) &&
+                         ftruncate(st->col_fd, (off_t)(st->col_offset + st->params_len * st->col_stride)) == 0;
+    free(header);
+    if (!written) {
+        fcs_columnar_failed(st);
+        return;
+    }
+    close(st->col_fd);
+    st->col_fd = -1;
+    log_fmtmsg(LOG_DEBUG, "Columnar data were written to \"%s\"", st->col_path);
+}
+
+
+// Decodes `count` complete events and accumulates them.
+static void fcs_accumulate_events(struct fcs_stats * st, const unsigned char * src, size_t count) {
+    const unsigned int params_len = st->params_len;
+    double * const row = st->row;
+    double * const min = st->min;
+    double * const max = st->max;
+    double * const sum = st->sum;
+    for (size_t event = 0; event < count; ++event) {
+        fcs_decode_event(st, src);
+        src += st->event_size;
+        for (unsigned int i = 0; i < params_len; ++i) {
+            const double value = row[i];
+            min[i] = value < min[i] ? value : min[i];
+            max[i] = value > max[i] ? value : max[i];
+            sum[i] += value;
+        }
+        if (st->bins) {
+            fcs_preview_bin_event(st);
+        }
+        if (st->col_fd != -1) {
+            fcs_columnar_add_event(st);
+        }
+    }
+    st->events += count;
+}
+
+
+// Decodes a block of the DATA segment. An event split between blocks is completed from the next block.
+static void fcs_stats_decode(struct fcs_stats * st, const unsigned char * data, size_t len) {
+    if (st->event_len > 0) {
+        const size_t missing = st->event_size - st->event_len;
+        const size_t copy_len = len < missing ? len : missing;
+        memcpy(st->event + st->event_len, data, copy_len);
+        st->event_len += copy_len;
+        data += copy_len;
+        len -= copy_len;
+        if (st->event_len < st->event_size) {
+            return;
+        }
+        fcs_accumulate_events(st, st->event, 1);
+        st->event_len = 0;
+    }
+    const size_t count = len / st->event_size;
+    fcs_accumulate_events(st, data, count);
+    st->event_len = len - count * st->event_size;
+    memcpy(st->event, data + count * st->event_size, st->event_len);
+}
+
+
+// Processes the next block of the file content.
+static void fcs_stats_feed(struct fcs_stats * st, const char * data, size_t len, const char * rcv_name) {
+    while (len > 0 && (st->state == FCS_HEADER || st->state == FCS_TEXT || st->state == FCS_DATA)) {
+        size_t used_len;
+        if (st->state != FCS_DATA) {
+            const size_t head_end = st->state == FCS_HEADER ? FCS_HEADER_LEN : st->text_end + 1;
+            used_len = head_end - st->head_len < len ? head_end - st->head_len : len;
+            memcpy(st->head + st->head_len, data, used_len);
+            st->head_len += used_len;
+            if (st->head_len == head_end) {
+                const char * const error = fcs_stats_parse_head(st);
+                if (error) {
+                    log_fmtmsg(LOG_WARNING, "Statistics of file \"%s\" are not computed: %s", rcv_name, error);
+                    st->state = FCS_UNSUPPORTED;
+                }
+            }
+        } else if (st->offset < st->data_begin) {
+            used_len = st->data_begin - st->offset < len ? st->data_begin - st->offset : len;
+        } else {
+            used_len = st->data_end - st->offset < len ? st->data_end - st->offset : len;
+            fcs_stats_decode(st, (const unsigned char *)data, used_len);
+            if (st->offset + used_len == st->data_end) {
+                st->state = FCS_DONE;
+            }
+        }
+        st->offset += used_len;
+        data += used_len;
+        len -= used_len;
+    }
+}
+
+
+static void string_append_json_number(struct string * dest, double value) {
+    if (!isfinite(value)) {
+        string_append_csubstring(dest, "null", 4);
+        return;
+    }
+    char buf[32];
+    const int len = snprintf(buf, sizeof(buf), "%.10g", value);
+    string_append_csubstring(dest, buf, len);
+}
+
+
+// Writes the statistics to the sidecar file of the storage file `path`.
+static void fcs_stats_write(const struct fcs_stats * st, const char * path, const char * rcv_name) {
+    struct string json;
+    string_init(&json);
+    string_append_csubstring(&json, "{\"name\":", 8);
+    string_append_json_string(&json, rcv_name);
+    char * const events = sprintf_malloc(",\"events\":%llu,\"parameters\":[", (unsigned long long)st->events);
+    string_append_csubstring(&json, events, strlen(events));
+    free(events);
+    for (unsigned int i = 0; i < st->params_len; ++i) {
+        string_append_csubstring(&json, i > 0 ? ",{\"name\":" : "{\"name\":", i > 0 ? 9 : 8);
+        string_append_json_string(&json, st->names[i]);
+        string_append_csubstring(&json, ",\"min\":", 7);
+        string_append_json_number(&json, st->min[i]);
+        string_append_csubstring(&json, ",\"max\":", 7);
+        string_append_json_number(&json, st->max[i]);
+        string_append_csubstring(&json, ",\"mean\":", 8);
+        string_append_json_number(&json, st->events > 0 ? st->sum[i] / st->events : NAN);
+        string_append_csubstring(&json, "}", 1);
+    }
+    string_append_csubstring(&json, "]}\n", 3);
+
+    char * const stats_path = sprintf_malloc("%s%s", path, FCS_STATS_SUFFIX);
+    FILE * const file = fopen(stats_path, "w");
+    bool written = false;
+    if (file) {
+        written = fputs(json.data, file) != EOF;
+        written = fclose(file) == 0 && written;
+    }
+    if (!written) {
+        log_fmtmsg(LOG_ERROR, "Cannot write statistics file \"%s\": %s", stats_path, strerror(errno));
+    } else {
+        log_fmtmsg(LOG_DEBUG, "Statistics of file \"%s\" were written to \"%s\"", rcv_name, stats_path);
+    }
+    free(stats_path);
+    free(json.data);
+}
+
+
+// Writes the preview images of the storage file `path`. Histogram bars are scaled to the highest bin
+// of each parameter, the density plot is scaled logarithmically.
+static void fcs_preview_write(const struct fcs_stats * st, const char * path) {
+    const bool png = fcs_preview == FCS_PREVIEW_PNG;
+    const char * const format = png ? "png" : "pgm";
+
+    const unsigned int height = st->hist_params_len * FCS_PREVIEW_HIST_HEIGHT;
+    unsigned char * const hist_pixels = realloc_assert(NULL, (size_t)FCS_PREVIEW_BINS * height);
+    memset(hist_pixels, 255, (size_t)FCS_PREVIEW_BINS * height);
+    for (unsigned int i = 0; i < st->hist_params_len; ++i) {
+        const uint32_t * const hist = st->hist + i * FCS_PREVIEW_BINS;
+        uint32_t hist_max = 1;
+        for (unsigned int bin = 0; bin < FCS_PREVIEW_BINS; ++bin) {
+            hist_max = hist[bin] > hist_max ? hist[bin] : hist_max;
+        }
+        unsigned char * const band = hist_pixels + (size_t)i * FCS_PREVIEW_HIST_HEIGHT * FCS_PREVIEW_BINS;
+        memset(band, 192, FCS_PREVIEW_BINS);  // separator line
+        for (unsigned int bin = 0; bin < FCS_PREVIEW_BINS; ++bin) {
+            const unsigned int bar = (uint64_t)hist[bin] * (FCS_PREVIEW_HIST_HEIGHT - 1) / hist_max;
+            for (unsigned int y = FCS_PREVIEW_HIST_HEIGHT - bar; y < FCS_PREVIEW_HIST_HEIGHT; ++y) {
+                band[y * FCS_PREVIEW_BINS + bin] = 0;
+            }
+        }
+    }
+    char * const hist_path = sprintf_malloc("%s.hist.%s", path, format);
+    image_write(hist_path, png, hist_pixels, FCS_PREVIEW_BINS, height);
+    free(hist_path);
+    free(hist_pixels);
+
+    if (st->density) {
+        uint32_t density_max = 1;
+        for (unsigned int i = 0; i < FCS_PREVIEW_BINS * FCS_PREVIEW_BINS; ++i) {
+            density_max = st->density[i] > density_max ? st->density[i] : density_max;
+        }
+        const double log_max = log(1.0 + density_max);
+        unsigned char * const density_pixels = realloc_assert(NULL, FCS_PREVIEW_BINS * FCS_PREVIEW_BINS);
+        for (unsigned int i = 0; i < FCS_PREVIEW_BINS * FCS_PREVIEW_BINS; ++i) {
+            density_pixels[i] = 255 - (unsigned char)(255 * log(1.0 + st->density[i]) / log_max);
+        }
+        char * const density_path = sprintf_malloc("%s.density.%s", path, format);
+        image_write(density_path, png, density_pixels, FCS_PREVIEW_BINS, FCS_PREVIEW_BINS);
+        free(density_path);
+        free(density_pixels);
+    }
+}
+
+
+// Writes the statistics, the previews and the columnar file next to the written file.
+static void fcs_stats_finish(struct fcs_stats * st, const char * rcv_name) {
+    const char * const path = st->path;
+    if (st->state != FCS_DONE) {
+        if (st->state != FCS_UNSUPPORTED) {
+            log_fmtmsg(LOG_WARNING, "Statistics of file \"%s\" are not computed: incomplete file", rcv_name);
+        }
+        return;
+    }
+    if (storage_create_dirs || (storage_dir && storage_shard_levels > 0)) {
+        mkdirs(path);
+    }
+    if (fcs_stats) {
+        fcs_stats_write(st, path, rcv_name);
+    }
+    if (fcs_preview != FCS_PREVIEW_NONE) {
+        fcs_preview_write(st, path);
+    }
+    if (st->col_fd != -1) {
+        fcs_columnar_finish(st);
+    }
+}
+
+
+#ifdef __linux__
+// Minimal io_uring interface using the raw system calls.
+struct uring {
+    int fd;
+    unsigned int * sq_head;
+    unsigned int * sq_tail;
+    unsigned int sq_mask;
+    unsigned int * sq_array;
+    struct io_uring_sqe * sqes;
+    unsigned int sq_entries;
+    unsigned int * cq_head;
+    unsigned int * cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe * cqes;
+    void * ring_ptr;
+    size_t ring_size;
+    unsigned int to_submit;  // number of prepared and not yet submitted entries
+};
+
+
+static bool uring_init(struct uring * ring, unsigned int entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1) {
+        log_fmtmsg(LOG_ERROR, "io_uring_setup: %s", strerror(errno));
+        return false;
+    }
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0 || (params.features & IORING_FEAT_EXT_ARG) == 0) {
+        log_msg(LOG_ERROR, "io_uring: kernel is too old");
+        close(ring->fd);
+        return false;
+    }
+
+    const size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    const size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_ptr =
+        mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED) {
+        log_fmtmsg(LOG_ERROR, "io_uring: mmap: %s", strerror(errno));
+        close(ring->fd);
+        return false;
+    }
+    ring->sq_entries = params.sq_entries;
+    ring->sqes = mmap(
+        NULL,
+        params.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        ring->fd,
+        IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        log_fmtmsg(LOG_ERROR, "io_uring: mmap: %s", strerror(errno));
+        munmap(ring->ring_ptr, ring->ring_size);
+        close(ring->fd);
+        return false;
+    }
+
+    char * const ptr = ring->ring_ptr;
+    ring->sq_head = (unsigned int *)(ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(ptr + params.sq_off.tail);
+    ring->sq_mask = *(unsigned int *)(ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(ptr + params.sq_off.array);
+    ring->cq_head = (unsigned int *)(ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(ptr + params.cq_off.tail);
+    ring->cq_mask = *(unsigned int *)(ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ptr + params.cq_off.cqes);
+    ring->to_submit = 0;
+    return true;
+}
+
+
+static void uring_free(struct uring * ring) {
+    munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    munmap(ring->ring_ptr, ring->ring_size);
+    close(ring->fd);
+}
+
+
+// Submits prepared entries and waits for at least `wait_nr` completions or for the timeout.
+// `timeout_ms` -1 means infinite. Returns false on error other than timeout or interrupt.
+static bool uring_submit_and_wait(struct uring * ring, unsigned int wait_nr, int timeout_ms) {
+    struct __kernel_timespec ts = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L};
+    struct io_uring_getevents_arg arg = {.sigmask = 0, .sigmask_sz = _NSIG / 8, .pad = 0, .ts = 0};
+    if (timeout_ms >= 0) {
+        arg.ts = (uintptr_t)&ts;
+    }
+    const unsigned int flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : IORING_ENTER_EXT_ARG;
+    const int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_nr, flags, &arg, sizeof(arg));
+    if (ret == -1) {
+        if (errno == ETIME || errno == EINTR) {
+            return true;
+        }
+        log_fmtmsg(LOG_ERROR, "io_uring_enter: %s", strerror(errno));
+        return false;
+    }
+    ring->to_submit -= ret;
+    return true;
+}
+
+
+// Returns a free submission queue entry or NULL if the queue is full.
+static struct io_uring_sqe * uring_get_sqe(struct uring * ring) {
+    const unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    const unsigned int tail = *ring->sq_tail;
+    if (tail - head >= ring->sq_entries) {
+        if (!uring_submit_and_wait(ring, 0, 0)) {
+            return NULL;
+        }
+        if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+    const unsigned int idx = tail & ring->sq_mask;
+    struct io_uring_sqe * const sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++ring->to_submit;
+    return sqe;
+}
+
+
+// Returns the next completion queue entry or NULL. The entry must be released by uring_cqe_seen().
+static struct io_uring_cqe * uring_peek_cqe(struct uring * ring) {
+    const unsigned int head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+
+static void uring_cqe_seen(struct uring * ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+#endif
+
+
+// Metadata segments of the received files (--metadata-dir).
+// A record is appended for each received file to the segment "<bucket>.log" of the current time bucket
+// (--metadata-segment-age), so an append is a single write() however large the archive is. The records
+// are lines of tab separated fields escaped as in the index: <time> <port> <outcome> <name> <size>
+// <received> <path> followed by pairs <keyword> <value> of the TEXT segment of an FCS file. The outcome
+// is "completed", "discarded" (received but not stored) or "aborted" (incomplete transfer).
+// A child process compacts the segments of the past buckets into the day segments "<day>.seg". A day
+// segment starts with the line METADATA_SEGMENT_MAGIC <min time> <max time> <records> <ports...>
+// followed by the records sorted by time. It is replaced as a whole by rename(), so readers always see
+// a complete segment and skip the segments out of the queried time range or port by the first line.
+
+static const char METADATA_SEGMENT_MAGIC[] = "CYFLOWREC-SEGMENT 1";
+static const int64_t METADATA_DAY_S = 24 * 60 * 60;
+// Interval of checking the compaction process
+static const int64_t METADATA_WAIT_CHECK_MS = 200;
+
+static const char * metadata_dir = NULL;
+static int64_t metadata_segment_age_s = 60 * 60;
+static int metadata_fd = -1;               // segment of the current bucket
+static int64_t metadata_bucket = -1;       // start time of the current bucket
+static pid_t metadata_pid = -1;            // compaction process or -1
+static int64_t metadata_compact_time = 0;  // monotonic time of the next compaction
+
+struct metadata_record {
+    int64_t time;
+    char * line;  // with the line end
+};
+
+
+static int64_t metadata_bucket_of(int64_t time) {
+    return time - time % metadata_segment_age_s;
+}
+
+
+static bool metadata_init(void) {
+    if (access(metadata_dir, W_OK) == -1) {
+        log_fmtmsg(LOG_ERROR, "Cannot access metadata directory \"%s\": %s", metadata_dir, strerror(errno));
+        return false;
+    }
+    metadata_compact_time = monotonic_ms();
+    return true;
+}
+
+
+// Writes the keywords of the collected HEADER and TEXT segments as the record fields.
+static void metadata_write_keywords(FILE * out, const char * head, size_t head_len) {
+    size_t text_begin;
+    size_t text_end;
+    if (head_len < FCS_HEADER_LEN || memcmp(head, "FCS", 3) != 0 || !fcs_parse_size(head + 10, 8, &text_begin) ||
+        !fcs_parse_size(head + 18, 8, &text_end) || text_begin < FCS_HEADER_LEN || text_end <= text_begin ||
+        text_end >= head_len) {
+        return;
+    }
+    const char * const text = head + text_begin + 1;
+    const size_t text_len = text_end - text_begin;
+    const char delim = head[text_begin];
+    size_t pos = 0;
+    while (pos < text_len) {
+        size_t padding_end = pos;
+        while (padding_end < text_len && text[padding_end] == ' ') {
+            ++padding_end;
+        }
+        if (padding_end == text_len) {
+            break;
+        }
+        char * const key = fcs_text_token(text, text_len, delim, &pos);
+        char * const value = fcs_text_token(text, text_len, delim, &pos);
+        if (index_keyword_wanted(key)) {
+            fputc('\t', out);
+            index_write_field(out, key);
+            fputc('\t', out);
+            index_write_field(out, value);
+        }
+        free(value);
+        free(key);
+    }
+}
+
+
+// Appends the record of the received file to the segment of the current bucket.
+static void metadata_record(
+    const char * source,
+    const char * outcome,
+    const char * name,
+    size_t size,
+    size_t received,
+    const char * path,
+    const char * head,
+    size_t head_len) {
+    if (!metadata_dir) {
+        return;
+    }
+    const int64_t now = time(NULL);
+    if (metadata_bucket_of(now) != metadata_bucket) {
+        if (metadata_fd != -1) {
+            close(metadata_fd);
+            metadata_compact_time = monotonic_ms();
+        }
+        metadata_bucket = metadata_bucket_of(now);
+        char * const segment_path = sprintf_malloc("%s/%lld.log", metadata_dir, (long long)metadata_bucket);
+        metadata_fd = open(segment_path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (metadata_fd == -1) {
+            log_fmtmsg(LOG_ERROR, "Cannot open metadata segment \"%s\": %s", segment_path, strerror(errno));
+        }
+        free(segment_path);
+    }
+    if (metadata_fd == -1) {
+        return;
+    }
+    char * line = NULL;
+    size_t line_len = 0;
+    FILE * const out = open_memstream(&line, &line_len);
+    if (!out) {
+        log_fmtmsg(LOG_ERROR, "Cannot create metadata record: %s", strerror(errno));
+        return;
+    }
+    fprintf(out, "%lld\t", (long long)now);
+    index_write_field(out, source ? source : "");
+    fprintf(out, "\t%s\t", outcome);
+    index_write_field(out, name);
+    fprintf(out, "\t%llu\t%llu\t", (unsigned long long)size, (unsigned long long)received);
+    index_write_field(out, path ? path : "");
+    metadata_write_keywords(out, head, head_len);
+    fputc('\n', out);
+    fclose(out);
+    if (write(metadata_fd, line, line_len) != (ssize_t)line_len) {
+        log_fmtmsg(LOG_ERROR, "Cannot write metadata record: %s", strerror(errno));
+    }
+    free(line);
+}
+
+
+// Reads the records of the segment file. Returns false if the file cannot be read.
+static bool metadata_read_records(
+    const char * path, bool header, struct metadata_record ** records, size_t * records_len) {
+    FILE * const file = fopen(path, "r");
+    if (!file) {
+        return errno == ENOENT;
+    }
+    char * line = NULL;
+    size_t line_size = 0;
+    ssize_t line_len;
+    bool first = header;
+    while ((line_len = getline(&line, &line_size, file)) != -1) {
+        if (first) {
+            first = false;
+            continue;
+        }
+        if (line_len == 0 || line[line_len - 1] != '\n') {
+            continue;  // incomplete record
+        }
+        *records = realloc_assert(*records, (*records_len + 1) * sizeof(**records));
+        (*records)[*records_len].time = strtoll(line, NULL, 10);
+        (*records)[(*records_len)++].line = my_strdup(line);
+    }
+    free(line);
+    const bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+
+static int metadata_record_cmp(const void * a, const void * b) {
+    const struct metadata_record * const a_rec = a;
+    const struct metadata_record * const b_rec = b;
+    if (a_rec->time != b_rec->time) {
+        return a_rec->time < b_rec->time ? -1 : 1;
+    }
+    return strcmp(a_rec->line, b_rec->line);
+}
+
+
+// Sorts the records and removes the duplicates (records of a segment compacted twice after a crash).
+static void metadata_sort_records(struct metadata_record * records, size_t * records_len) {
+    qsort(records, *records_len, sizeof(*records), metadata_record_cmp);
+    size_t len = 0;
+    for (size_t i = 0; i < *records_len; ++i) {
+        if (len > 0 && strcmp(records[len - 1].line, records[i].line) == 0) {
+            free(records[i].line);
+        } else {
+            records[len++] = records[i];
+        }
+    }
+    *records_len = len;
+}
+
+
+// Returns the length of the port field of the record line.
+static size_t metadata_port_field(const char * line, const char ** port) {
+    const char * const tab = strchr(line, '\t');
+    *port = tab ? tab + 1 : "";
+    return strcspn(*port, "\t\n");
+}
+
+
+// Writes the day segment with the records through a temporary file.
+static bool metadata_write_segment(int64_t day, const struct metadata_record * records, size_t records_len) {
+    char * const segment_path = sprintf_malloc("%s/%lld.seg", metadata_dir, (long long)day);
+    char * const tmp_path = sprintf_malloc("%s.tmp", segment_path);
+    FILE * const out = fopen(tmp_path, "w");
+    if (out) {
+        fprintf(
+            out,
+            "%s\t%lld\t%lld\t%llu",
+            METADATA_SEGMENT_MAGIC,
+            (long long)records[0].time,
+            (long long)records[records_len - 1].time,
+            (unsigned long long)records_len);
+        for (size_t i = 0; i < records_len; ++i) {
+            const char * port;
+            const size_t port_len = metadata_port_field(records[i].line, &port);
+            bool known = false;
+            for (size_t j = 0; j < i && !known; ++j) {
+                const char * other;
+                known = metadata_port_field(records[j].line, &other) == port_len && memcmp(port, other, port_len) == 0;
+            }
+            if (!known) {
+                fprintf(out, "\t%.*s", (int)port_len, port);
+            }
+        }
+        fputc('\n', out);
+        for (size_t i = 0; i < records_len; ++i) {
+            fputs(records[i].line, out);
+        }
+    }
+    const bool ok = out && (!storage_sync || (fflush(out) == 0 && fsync(fileno(out)) == 0)) && fclose(out) == 0 &&
+                    rename(tmp_path, segment_path) == 0;
+    if (!ok) {
+        log_fmtmsg(LOG_ERROR, "Cannot write metadata segment \"%s\": %s", segment_path, strerror(errno));
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    free(segment_path);
+    return ok;
+}
+
+
+// Returns true if the name is "<time><suffix>".
+static bool metadata_segment_name(const char * name, const char * suffix, int64_t * time) {
+    char * end;
+    errno = 0;
+    *time = strtoll(name, &end, 10);
+    return end != name && errno == 0 && strcmp(end, suffix) == 0;
+}
+
+
+// Merges the segments of the buckets before `current_bucket` into the day segments.
+static void metadata_compact(int64_t current_bucket) {
+    DIR * const dir = opendir(metadata_dir);
+    if (!dir) {
+        log_fmtmsg(LOG_ERROR, "Cannot open metadata directory \"%s\": %s", metadata_dir, strerror(errno));
+        return;
+    }
+    char ** logs = NULL;
+    size_t logs_len = 0;
+    struct metadata_record * records = NULL;
+    size_t records_len = 0;
+    bool ok = true;
+    struct dirent * entry;
+    while ((entry = readdir(dir))) {
+        int64_t bucket;
+        if (metadata_segment_name(entry->d_name, ".log", &bucket) && bucket < current_bucket) {
+            char * const path = sprintf_malloc("%s/%s", metadata_dir, entry->d_name);
+            if (!metadata_read_records(path, false, &records, &records_len)) {
+                log_fmtmsg(LOG_ERROR, "Cannot read metadata segment \"%s\": %s", path, strerror(errno));
+                ok = false;
+            }
+            logs = realloc_assert(logs, (logs_len + 1) * sizeof(*logs));
+            logs[logs_len++] = path;
+        }
+    }
+    closedir(dir);
+
+    qsort(records, records_len, sizeof(*records), metadata_record_cmp);
+    const size_t compacted = records_len;
+    for (size_t first = 0; ok && first < records_len;) {
+        const int64_t day = records[first].time - records[first].time % METADATA_DAY_S;
+        size_t end = first;
+        while (end < records_len && records[end].time - records[end].time % METADATA_DAY_S == day) {
+            ++end;
+        }
+        struct metadata_record * day_records = NULL;
+        size_t day_records_len = 0;
+        char * const segment_path = sprintf_malloc("%s/%lld.seg", metadata_dir, (long long)day);
+        if (!metadata_read_records(segment_path, true, &day_records, &day_records_len)) {
+            log_fmtmsg(LOG_ERROR, "Cannot read metadata segment \"%s\": %s", segment_path, strerror(errno));
+            ok = false;
+        } else {
+            day_records = realloc_assert(day_records, (day_records_len + end - first) * sizeof(*day_records));
+            for (size_t i = first; i < end; ++i) {
+                day_records[day_records_len++] = records[i];
+                records[i].line = NULL;
+            }
+            metadata_sort_records(day_records, &day_records_len);
+            ok = metadata_write_segment(day, day_records, day_records_len);
+        }
+        for (size_t i = 0; i < day_records_len; ++i) {
+            free(day_records[i].line);
+        }
+        free(day_records);
+        free(segment_path);
+        first = end;
+    }
+
+    for (size_t i = 0; i < logs_len; ++i) {
+        if (ok) {
+            unlink(logs[i]);
+        }
+        free(logs[i]);
+    }
+    free(logs);
+    for (size_t i = 0; i < records_len; ++i) {
+        free(records[i].line);
+    }
+    free(records);
+    if (ok && logs_len > 0) {
+        log_fmtmsg(
+            LOG_INFO, "Compacted %u metadata records of %u segments", (unsigned int)compacted, (unsigned int)logs_len);
+    }
+}
+
+
+// Reaps the compaction process and starts a new compaction after the end of a bucket.
+static int64_t metadata_service(int64_t now) {
+    if (!metadata_dir) {
+        return NO_DEADLINE;
+    }
+    if (metadata_pid != -1) {
+        int status;
+        if (waitpid(metadata_pid, &status, WNOHANG) == 0) {
+            return now + METADATA_WAIT_CHECK_MS;
+        }
+        metadata_pid = -1;
+    }
+    if (now < metadata_compact_time) {
+        return metadata_compact_time;
+    }
+    const int64_t time_now = time(NULL);
+    const int64_t current_bucket = metadata_bucket_of(time_now);
+    metadata_compact_time = now + (current_bucket + metadata_segment_age_s - time_now) * 1000 + 1000;
+    fflush(stdout);
+    metadata_pid = fork();
+    if (metadata_pid == 0) {
+        metadata_compact(current_bucket);
+        fflush(stdout);
+        _exit(0);
+    }
+    if (metadata_pid == -1) {
+        log_fmtmsg(
+            LOG_WARNING, "Cannot create compaction process, segments are compacted directly: %s", strerror(errno));
+        metadata_compact(current_bucket);
+        return metadata_compact_time;
+    }
+    return now + METADATA_WAIT_CHECK_MS;
+}
+
+
+// State of the transfer protocol parser.
+// Transfered data contain [KEY]<value> pairs folowed by file content. [FILENAME] and [FILESIZE] are mandatory.
+// Example: [FILENAME]<A0000001.FCS>[FILESIZE]<9732>FCS2.0...
+// The parser is fed by chunks of the received byte stream. The result does not depend on how the stream
+// was split into the chunks.
+enum read_state {
+    READ_START,
+    READ_NEXT,
+    READ_KEY,
+    READ_FILE_NAME,
+    READ_FILE_SIZE,
+    READ_SOURCE,
+    READ_UNKNOWN_VALUE,
+    READ_FILE,
+    READ_DISCARD  // until the no-data timeout expires or until the next file header is found
+};
+
+// Start of the file header searched for in discarded data
+static const char RESYNC_MARKER[] = "[FILENAME]<";
+
+struct receiver;
+
+// Storage file operations of the receiver.
+struct file_ops {
+    int access_mode;  // access mode used to open the storage file
+    // Called after the storage file was opened, may be NULL.
+    void (*opened)(struct receiver * rcv);
+    // Writes the file content. On error returns false and sets errno.
+    bool (*write)(struct receiver * rcv, const char * data, size_t len);
+    void (*close)(struct receiver * rcv);
+};
+
+struct receiver {
+    struct tokens tokens;
+    const struct file_ops * file_ops;
+    void * file_ops_ctx;
+    // Called when a file is finished and its storage file is closed, `stored` is false if the file was
+    // discarded or truncated. May be NULL.
+    void (*finished)(struct receiver * rcv, const char * name, bool stored);
+    void * finished_ctx;
+    const char * source;  // port or peer the data are received from, recorded in the metadata
+    enum read_state state;
+    bool discard_message_logged;
+    size_t discarded_bytes;
+    size_t resync_marker_len;  // length of the matched part of RESYNC_MARKER
+    size_t resync_skip;        // number of discarded bytes known to be content of the previous file
+    unsigned int files_started;  // incremented at the start of each file reception
+    char buf[128];  // received key or value
+    size_t buf_data_len;
+    char * rcv_file_name;
+    size_t rcv_file_size;
+    char * rcv_source;  // source announced by the SOURCE key (relayed files) or NULL
+    size_t total_rcv_file_bytes;
+    char * storage_file_path;
+    int file_fd;
+    char * file_map;  // storage file mapped to memory or NULL
+    char * spool_name;  // name of the spooled file or NULL
+    int64_t progress_event_time;  // monotonic time of the last progress event
+    struct tee * payload_tee;  // tee of the port or of the collector or NULL
+    bool tee;  // the file content is sent to the tee consumer
+    struct fcs_stats * stats;  // statistics of the receiving FCS file or NULL
+    char * meta_head;          // collected HEADER and TEXT segments for the metadata record or NULL
+    size_t meta_head_len;
+    size_t meta_head_end;  // number of bytes to collect
+};
+
+// Blocking write() and close()
+static bool file_write_blocking(struct receiver * rcv, const char * data, size_t len);
+static void file_close_blocking(struct receiver * rcv);
+static const struct file_ops blocking_file_ops = {O_WRONLY, NULL, file_write_blocking, file_close_blocking};
+
+static void receiver_init(struct receiver * rcv, struct tokens tokens) {
+    rcv->tokens = tokens;
+    rcv->file_ops = &blocking_file_ops;
+    rcv->file_ops_ctx = NULL;
+    rcv->finished = NULL;
+    rcv->finished_ctx = NULL;
+    rcv->source = NULL;
+    rcv->state = READ_START;
+    rcv->discard_message_logged = false;
+    rcv->files_started = 0;
+    rcv->discarded_bytes = 0;
+    rcv->resync_marker_len = 0;
+    rcv->resync_skip = 0;
+    rcv->buf_data_len = 0;
+    rcv->rcv_file_name = NULL;
+    rcv->rcv_file_size = 0;
+    rcv->rcv_source = NULL;
+    rcv->total_rcv_file_bytes = 0;
+    rcv->storage_file_path = NULL;
+    rcv->file_fd = -1;
+    rcv->file_map = NULL;
+    rcv->spool_name = NULL;
+    rcv->progress_event_time = 0;
+    rcv->payload_tee = NULL;
+    rcv->tee = false;
+    rcv->stats = NULL;
+    rcv->meta_head = NULL;
+    rcv->meta_head_len = 0;
+    rcv->meta_head_end = 0;
+}
+
+
+// Closes the storage file, releases the received file information and prepares the receiver for the next file.
+static void receiver_reset(struct receiver * rcv) {
+    if (rcv->file_fd != -1 && rcv->total_rcv_file_bytes < rcv->rcv_file_size) {
+        events_publish("aborted", rcv->rcv_file_name, rcv->rcv_file_size, NULL, rcv->total_rcv_file_bytes);
+    }
+    if (rcv->state == READ_FILE && rcv->total_rcv_file_bytes < rcv->rcv_file_size) {
+        metadata_record(
+            rcv->rcv_source ? rcv->rcv_source : rcv->source,
+            "aborted",
+            rcv->rcv_file_name,
+            rcv->rcv_file_size,
+            rcv->total_rcv_file_bytes,
+            rcv->file_fd != -1 ? rcv->storage_file_path : NULL,
+            rcv->meta_head,
+            rcv->meta_head_len);
+    }
+    free(rcv->meta_head);
+    rcv->meta_head = NULL;
+    rcv->meta_head_len = 0;
+    rcv->meta_head_end = 0;
+    if (rcv->tee) {
+        tee_file_closed(rcv->payload_tee, rcv->total_rcv_file_bytes >= rcv->rcv_file_size);
+    }
+    rcv->tee = false;
+    if (rcv->stats) {
+        fcs_stats_free(rcv->stats);
+        rcv->stats = NULL;
+    }
+    const bool stored = rcv->file_fd != -1 && rcv->total_rcv_file_bytes >= rcv->rcv_file_size;
+    if (rcv->file_fd != -1) {
+        rcv->file_ops->close(rcv);
+        rcv->file_fd = -1;
+    }
+    if (rcv->spool_name) {
+        if (stored) {
+            spool_file_received(rcv->spool_name,
+                                rcv->rcv_file_name,
+                                rcv->rcv_file_size,
+                                rcv->rcv_source ? rcv->rcv_source : rcv->source);
+        }
+        spool_file_closed(rcv->spool_name, rcv->rcv_file_size);
+        rcv->spool_name = NULL;
+    }
+    if (rcv->storage_file_path) {
+        if (storage_quota > 0) {
+            quota_file_closed(rcv->storage_file_path, rcv->total_rcv_file_bytes);
+        }
+        free(rcv->storage_file_path);
+        rcv->storage_file_path = NULL;
+    }
+    if (rcv->rcv_file_name) {
+        free(rcv->rcv_file_name);
+        rcv->rcv_file_name = NULL;
+    }
+    free(rcv->rcv_source);
+    rcv->rcv_source = NULL;
+    rcv->rcv_file_size = 0;
+    rcv->buf_data_len = 0;
+    rcv->state = READ_START;
+}
+
+
+// Aborts the file being received after a failure of its source. Unlike receiver_reset(), which keeps
+// the truncated file, the incomplete storage file (or the spooled file) is removed.
+static void receiver_abort(struct receiver * rcv) {
+    if (rcv->file_fd != -1 && rcv->total_rcv_file_bytes < rcv->rcv_file_size) {
+        log_fmtmsg(LOG_WARNING, "Incomplete file \"%s\" removed", rcv->storage_file_path);
+        events_publish("aborted", rcv->rcv_file_name, rcv->rcv_file_size, NULL, rcv->total_rcv_file_bytes);
+        rcv->file_ops->close(rcv);
+        rcv->file_fd = -1;
+        if (rcv->spool_name) {
+            spool_cancel(rcv->spool_name, rcv->rcv_file_size);
+            rcv->spool_name = NULL;
+        } else if (unlink(rcv->storage_file_path) == -1 && errno != ENOENT) {
+            log_fmtmsg(LOG_ERROR, "Cannot remove file \"%s\": %s", rcv->storage_file_path, strerror(errno));
+        }
+        if (storage_quota > 0) {
+            quota_remove(rcv->storage_file_path);
+        }
+    }
+    receiver_reset(rcv);
+}
+
+
+static void receiver_discard(struct receiver * rcv) {
+    rcv->state = READ_DISCARD;
+    rcv->buf_data_len = 0;
+    rcv->discarded_bytes = 0;
+    rcv->resync_marker_len = 0;
+    rcv->resync_skip = 0;
+}
+
+
+// Returns true if the receiver waits for the start of a new transfer. No timeout applies in this state.
+static bool receiver_idle(const struct receiver * rcv) {
+    return rcv->state == READ_START;
+}
+
+
+// Returns the number of bytes the receiver wants to process at once, limited by `max_len`.
+// During file content reception it does not look ahead into the next file.
+static size_t receiver_wanted_len(const struct receiver * rcv, size_t max_len) {
+    if (rcv->state == READ_FILE) {
+        const size_t bytes_to_end = rcv->rcv_file_size - rcv->total_rcv_file_bytes;
+        return bytes_to_end > max_len ? max_len : bytes_to_end;
+    }
+    return max_len;
+}
+
+
+// Called when no data was received during the intercharacter timeout.
+static void receiver_timeout(struct receiver * rcv) {
+    if (rcv->state != READ_START && rcv->state != READ_DISCARD) {
+        log_msg(LOG_ERROR, "Timeout, data reception not completed");
+    }
+    if (rcv->state == READ_DISCARD) {
+        log_msg(LOG_INFO, "Discarding of received data stopped. Ready to receive the next file");
+    }
+    receiver_reset(rcv);
+}
+
+
+// Called when the reception of a file takes longer than the transfer timeout.
+// The rest of the file is discarded.
+static void receiver_transfer_timeout(struct receiver * rcv) {
+    if (rcv->state == READ_START || rcv->state == READ_DISCARD) {
+        return;
+    }
+    log_msg(LOG_ERROR, "Transfer timeout, data reception not completed");
+    const size_t bytes_to_end =
+        rcv->state == READ_FILE ? rcv->rcv_file_size - rcv->total_rcv_file_bytes : 0;
+    receiver_reset(rcv);
+    receiver_discard(rcv);
+    rcv->discard_message_logged = false;
+    // the next file header is expected after the rest of the file content
+    rcv->resync_skip = bytes_to_end;
+}
+
+
+// Searches discarded data for the start of the next file header. If it is found, the reception restarts.
+// Bytes known to be content of the previous file are skipped, the header must not start inside them.
+// Returns the number of consumed bytes.
+static size_t receiver_resync(struct receiver * rcv, const char * data, size_t len) {
+    size_t pos = rcv->resync_skip > len ? len : rcv->resync_skip;
+    rcv->resync_skip -= pos;
+    if (!resync) {
+        pos = len;
+    }
+    while (pos < len) {
+        const char ch = data[pos++];
+        if (ch != RESYNC_MARKER[rcv->resync_marker_len]) {
+            rcv->resync_marker_len = ch == RESYNC_MARKER[0] ? 1 : 0;
+            continue;
+        }
+        if (++rcv->resync_marker_len == sizeof(RESYNC_MARKER) - 1) {
+            rcv->discarded_bytes += pos;
+            rcv->discarded_bytes -= rcv->resync_marker_len;
+            log_fmtmsg(
+                LOG_INFO,
+                "File header found after %u discarded bytes. Start receiving",
+                (unsigned int)rcv->discarded_bytes);
+            receiver_reset(rcv);
+            ++rcv->files_started;
+            rcv->buf[0] = '<';
+            rcv->buf_data_len = 1;
+            rcv->state = READ_FILE_NAME;
+            return pos;
+        }
+    }
+    rcv->discarded_bytes += pos;
+    return pos;
+}
+
+
+static void receiver_open_file(struct receiver * rcv) {
+    if (storage_dir) {
+        rcv->storage_file_path = shard_file_path(storage_dir, rcv->rcv_file_name, storage_shard_levels);
+    } else {
+        strncpy(received_file_name, rcv->rcv_file_name, sizeof(received_file_name) - 1);
+        received_file_name[sizeof(received_file_name) - 1] = '\0';
+        rcv->storage_file_path = create_file_path(rcv->tokens);
+    }
+    log_fmtmsg(
+        LOG_INFO,
+        "Incoming file \"%s\" with length %u will be stored in \"%s\"",
+        rcv->rcv_file_name,
+        (unsigned int)rcv->rcv_file_size,
+        rcv->storage_file_path);
+    rcv->file_fd = -1;
+    rcv->total_rcv_file_bytes = 0;
+    rcv->state = READ_FILE;
+    if (metadata_dir) {
+        rcv->meta_head = realloc_assert(NULL, FCS_HEADER_LEN);
+        rcv->meta_head_end = FCS_HEADER_LEN;
+    }
+    // The existence of the storage file is resolved first, nothing is evicted for a dropped file.
+    const bool exists = access(rcv->storage_file_path, F_OK) == 0;
+    if (exists && file_exists_policy == FILE_DROP) {
+        log_fmtmsg(
+            LOG_WARNING,
+            "The file \"%s\" already exists in the storage, the received file \"%s\" "
+            "will be dropped",
+            rcv->storage_file_path,
+            rcv->rcv_file_name);
+        return;
+    }
+    if (exists) {
+        log_fmtmsg(
+            LOG_WARNING,
+            "The file \"%s\" already exists in the storage and will be replaced by "
+            "the received file \"%s\"",
+            rcv->storage_file_path,
+            rcv->rcv_file_name);
+    }
+    // With the spool, the file is stored in the spool directory, the spooled file is always created.
+    char * spool_data_path = NULL;
+    if (spool_dir && (rcv->spool_name = spool_create(rcv->storage_file_path, rcv->rcv_file_size))) {
+        spool_data_path = spool_path(rcv->spool_name, "data");
+        log_fmtmsg(LOG_DEBUG, "The file is spooled in \"%s\"", spool_data_path);
+    } else if (storage_create_dirs || (storage_dir && storage_shard_levels > 0)) {
+        mkdirs(rcv->storage_file_path);
+    }
+    const char * const path = spool_data_path ? spool_data_path : rcv->storage_file_path;
+    // The replaced storage file is truncated only after the space for the received file is reserved.
+    const bool truncate = exists && !spool_data_path;
+    rcv->file_fd = open(
+        path, rcv->file_ops->access_mode | O_CREAT | (truncate ? 0 : O_EXCL), S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (rcv->file_fd == -1) {
+        log_fmtmsg(
+            LOG_ERROR,
+            "Cannot open/create file \"%s\", received file \"%s\" will no be stored: %s",
+            path,
+            rcv->rcv_file_name,
+            strerror(errno));
+    } else if (storage_quota > 0 && !quota_reserve_file(rcv->storage_file_path, rcv->rcv_file_size, exists)) {
+        log_fmtmsg(
+            LOG_ERROR, "Not enough space in the storage, received file \"%s\" will not be stored", rcv->rcv_file_name);
+        close(rcv->file_fd);
+        rcv->file_fd = -1;
+        if (!exists && !spool_data_path) {
+            unlink(rcv->storage_file_path);
+        }
+    } else if (truncate && ftruncate(rcv->file_fd, 0) == -1) {
+        log_fmtmsg(
+            LOG_ERROR,
+            "Cannot truncate file \"%s\", received file \"%s\" will no be stored: %s",
+            path,
+            rcv->rcv_file_name,
+            strerror(errno));
+        close(rcv->file_fd);
+        rcv->file_fd = -1;
+        if (storage_quota > 0) {
+            quota_remove(rcv->storage_file_path);
+        }
+    }
+    if (rcv->file_fd == -1 && rcv->spool_name) {
+        spool_cancel(rcv->spool_name, rcv->rcv_file_size);
+        rcv->spool_name = NULL;
+    }
+    if (rcv->file_fd != -1 && rcv->file_ops->opened) {
+        rcv->file_ops->opened(rcv);
+    }
+    if (rcv->file_fd != -1) {
+        events_publish("opened", rcv->rcv_file_name, rcv->rcv_file_size, rcv->storage_file_path, 0);
+        rcv->progress_event_time = monotonic_ms();
+        rcv->tee = rcv->payload_tee &&
+                   tee_file_opened(rcv->payload_tee, rcv->rcv_file_name, rcv->rcv_file_size, rcv->storage_file_path);
+        if (fcs_stats || fcs_preview != FCS_PREVIEW_NONE || fcs_columnar != FCS_COLUMNAR_NONE) {
+            rcv->stats = fcs_stats_create(path, rcv->rcv_file_size);
+        }
+    }
+    free(spool_data_path);
+}
+
+
+// Closes the storage file after a write error. The rest of the file content is discarded.
+static void receiver_write_file_failed(struct receiver * rcv, int errnum) {
+    log_fmtmsg(
+        LOG_ERROR,
+        "Cannot write to file \"%s\", received file \"%s\" will be truncated: %s",
+        rcv->storage_file_path,
+        rcv->rcv_file_name,
+        strerror(errnum));
+    rcv->file_ops->close(rcv);
+    rcv->file_fd = -1;
+    events_publish("aborted", rcv->rcv_file_name, rcv->rcv_file_size, NULL, rcv->total_rcv_file_bytes);
+}
+
+
+// Accounts `len` bytes of the file content which were stored (or discarded). Finishes the file when
+// the whole content was received. `len` must not exceed the number of bytes remaining to the end of the file.
+static void receiver_file_content_done(struct receiver * rcv, size_t len) {
+    rcv->total_rcv_file_bytes += len;
+
+    if (rcv->total_rcv_file_bytes >= rcv->rcv_file_size) {
+        if (rcv->file_fd != -1) {
+            if (rcv->stats) {
+                fcs_stats_finish(rcv->stats, rcv->rcv_file_name);
+            }
+            log_fmtmsg(
+                LOG_INFO,
+                rcv->spool_name ? "The file \"%s\" was received and spooled, it will be saved as \"%s\""
+                                : "The file \"%s\" was received and saved as \"%s\"",
+                rcv->rcv_file_name,
+                rcv->storage_file_path);
+        } else {
+            log_fmtmsg(LOG_INFO, "The file \"%s\" was received but discarded or truncated", rcv->rcv_file_name);
+        }
+        metadata_record(
+            rcv->rcv_source ? rcv->rcv_source : rcv->source,
+            rcv->file_fd != -1 ? "completed" : "discarded",
+            rcv->rcv_file_name,
+            rcv->rcv_file_size,
+            rcv->total_rcv_file_bytes,
+            rcv->file_fd != -1 ? rcv->storage_file_path : NULL,
+            rcv->meta_head,
+            rcv->meta_head_len);
+        if (rcv->finished) {
+            const bool stored = rcv->file_fd != -1;
+            char * const name = my_strdup(rcv->rcv_file_name);
+            receiver_reset(rcv);
+            rcv->finished(rcv, name, stored);
+            free(name);
+        } else {
+            receiver_reset(rcv);
+        }
+    } else if (rcv->file_fd != -1 && event_listen_fd != -1) {
+        const int64_t now = monotonic_ms();
+        if (now - rcv->progress_event_time >= EVENT_PROGRESS_INTERVAL_MS) {
+            events_publish("progress", rcv->rcv_file_name, rcv->rcv_file_size, NULL, rcv->total_rcv_file_bytes);
+            rcv->progress_event_time = now;
+        }
+    }
+}
+
+
+// Called when the completely received file is in the storage: closed, or migrated from the spool.
+static void storage_file_stored(const char * path, const char * rcv_name, size_t size, const char * source) {
+    events_publish("completed", rcv_name, size, path, 0);
+    hook_file_received(path, rcv_name, size);
+    relay_file_received(path, rcv_name, size, source);
+}
+
+
+static bool file_write_blocking(struct receiver * rcv, const char * data, size_t len) {
+    size_t written = 0;
+    while (written < len) {
+        const ssize_t write_ret = write(rcv->file_fd, data + written, len - written);
+        if (write_ret == -1) {
+            return false;
+        }
+        written += write_ret;
+    }
+    return true;
+}
+
+
+static void file_close_blocking(struct receiver * rcv) {
+    if (storage_sync && fsync(rcv->file_fd) == -1) {
+        log_fmtmsg(LOG_ERROR, "Cannot sync file \"%s\": %s", rcv->storage_file_path, strerror(errno));
+    }
+    close(rcv->file_fd);
+    if (rcv->total_rcv_file_bytes >= rcv->rcv_file_size && !rcv->spool_name) {
+        storage_file_stored(rcv->storage_file_path,
+                            rcv->rcv_file_name,
+                            rcv->rcv_file_size,
+                            rcv->rcv_source ? rcv->rcv_source : rcv->source);
+        storage_index_file_saved(rcv->storage_file_path);
+    }
+}
+
+
+#ifdef __linux__
+// Allocates the storage file to the announced size and maps it to memory. The file content is then
+// copied directly to the page cache without write() calls. If the file cannot be mapped, write() is used.
+static void file_opened_mmap(struct receiver * rcv) {
+    const int err = posix_fallocate(rcv->file_fd, 0, (off_t)rcv->rcv_file_size);
+    if (err != 0) {
+        log_fmtmsg(
+            LOG_WARNING, "Cannot allocate file \"%s\", write is used: %s", rcv->storage_file_path, strerror(err));
+        return;
+    }
+    void * const map = mmap(NULL, rcv->rcv_file_size, PROT_WRITE, MAP_SHARED, rcv->file_fd, 0);
+    if (map == MAP_FAILED) {
+        log_fmtmsg(LOG_WARNING, "Cannot map file \"%s\", write is used: %s", rcv->storage_file_path, strerror(errno));
+        return;
+    }
+    madvise(map, rcv->rcv_file_size, MADV_SEQUENTIAL);
+    rcv->file_map = map;
+}
+
+
+static bool file_write_mmap(struct receiver * rcv, const char * data, size_t len) {
+    if (!rcv->file_map) {
+        return file_write_blocking(rcv, data, len);
+    }
+    memcpy(rcv->file_map + rcv->total_rcv_file_bytes, data, len);
+    return true;
+}
+
+
+// Unmaps the file. The file is truncated to the received length if the transfer was not completed.
+static void file_close_mmap(struct receiver * rcv) {
+    if (rcv->file_map) {
+        if (storage_sync && msync(rcv->file_map, rcv->rcv_file_size, MS_SYNC) == -1) {
+            log_fmtmsg(LOG_ERROR, "Cannot sync file \"%s\": %s", rcv->storage_file_path, strerror(errno));
+        }
+        munmap(rcv->file_map, rcv->rcv_file_size);
+        rcv->file_map = NULL;
+    }
+    if (rcv->total_rcv_file_bytes < rcv->rcv_file_size && ftruncate(rcv->file_fd, rcv->total_rcv_file_bytes) == -1) {
+        log_fmtmsg(LOG_WARNING, "Cannot truncate file \"%s\": %s", rcv->storage_file_path, strerror(errno));
+    }
+    file_close_blocking(rcv);
+}
+
+static const struct file_ops mmap_file_ops = {O_RDWR, file_opened_mmap, file_write_mmap, file_close_mmap};
+#endif
+
+
+// Stores the file content. `len` must not exceed the number of bytes remaining to the end of the file.
+// Collects the HEADER and TEXT segments of the file for its metadata record.
+static void receiver_collect_meta_head(struct receiver * rcv, const char * data, size_t len) {
+    const size_t rest_len = rcv->meta_head_end - rcv->meta_head_len;
+    const size_t used_len = rest_len < len ? rest_len : len;
+    memcpy(rcv->meta_head + rcv->meta_head_len, data, used_len);
+    rcv->meta_head_len += used_len;
+    if (rcv->meta_head_len == FCS_HEADER_LEN && rcv->meta_head_end == FCS_HEADER_LEN) {
+        size_t text_end;
+        if (memcmp(rcv->meta_head, "FCS", 3) == 0 && fcs_parse_size(rcv->meta_head + 18, 8, &text_end) &&
+            text_end >= FCS_HEADER_LEN && text_end < FCS_MAX_TEXT_END) {
+            rcv->meta_head_end = text_end + 1;
+            rcv->meta_head = realloc_assert(rcv->meta_head, rcv->meta_head_end);
+            receiver_collect_meta_head(rcv, data + used_len, len - used_len);
+        }
+    }
+}
+
+
+static void receiver_write_file(struct receiver * rcv, const char * data, size_t len) {
+    if (rcv->meta_head_len < rcv->meta_head_end) {
+        receiver_collect_meta_head(rcv, data, len);
+    }
+    if (rcv->tee && !tee_send(rcv->payload_tee, data, len)) {
+        rcv->tee = false;
+        rcv->payload_tee->receiving = false;
+    }
+    if (rcv->stats) {
+        fcs_stats_feed(rcv->stats, data, len, rcv->rcv_file_name);
+    }
+    if (rcv->file_fd != -1 && !rcv->file_ops->write(rcv, data, len)) {
+        receiver_write_file_failed(rcv, errno);
+    }
+
+    receiver_file_content_done(rcv, len);
+}
+
+
+// Returns true if `name` is acceptable as a file name in the storage.
+// Only letters, digits and dots are allowed. The name must not be empty and must not start with a dot.
+static bool valid_file_name(const char * name) {
+    if (*name == '\0' || *name == '.') {
+        return false;
+    }
+    for (const char * ch = name; *ch != '\0'; ++ch) {
+        if (*ch != '.' && !isdigit((unsigned char)*ch) && !isupper((unsigned char)*ch) &&
+            !islower((unsigned char)*ch)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Parses decimal number. Unlike `strtol`, leading white spaces and signs are not accepted and overflow is detected.
+static bool parse_size(const char * str, size_t * value) {
+    if (*str == '\0') {
+        return false;
+    }
+    size_t result = 0;
+    for (const char * ch = str; *ch != '\0'; ++ch) {
+        if (!isdigit((unsigned char)*ch)) {
+            return false;
+        }
+        const size_t digit = *ch - '0';
+        if (result > ((size_t)-1 - digit) / 10) {
+            return false;
+        }
+        result = result * 10 + digit;
+    }
+    *value = result;
+    return true;
+}
+
+
+// Processes one character of the header part of the transfer.
+// Returns false if the character was not consumed because it is the first character of the file content.
+static bool receiver_process_char(struct receiver * rcv, char ch) {
+    char * const buf = rcv->buf;
+    switch (rcv->state) {
+        case READ_START:
+            if (ch != '[') {
+                log_msg(LOG_ERROR, "Unexpected character received");
+                break;
+            }
+            rcv->discard_message_logged = false;
+            ++rcv->files_started;
+            log_msg(LOG_INFO, "Start receiving");
+            rcv->buf_data_len = 0;
+            rcv->state = READ_KEY;
+            break;
+        case READ_KEY:
+            if (ch == ']') {
+                buf[rcv->buf_data_len] = '\0';
+                if (strcmp(buf, "FILENAME") == 0) {
+                    if (rcv->rcv_file_name) {
+                        log_msg(LOG_WARNING, "Received FILENAME key again");
+                        free(rcv->rcv_file_name);
+                        rcv->rcv_file_name = NULL;
+                        rcv->rcv_file_size = 0;
+                    }
+                    rcv->state = READ_FILE_NAME;
+                } else if (strcmp(buf, "FILESIZE") == 0) {
+                    if (!rcv->rcv_file_name) {
+                        log_msg(LOG_ERROR, "Received FILESIZE key before FILENAME");
+                        receiver_discard(rcv);
+                        break;
+                    }
+                    if (rcv->rcv_file_size > 0) {
+                        log_msg(LOG_ERROR, "Received FILESIZE key again");
+                        receiver_discard(rcv);
+                        break;
+                    }
+                    rcv->state = READ_FILE_SIZE;
+                } else if (strcmp(buf, "SOURCE") == 0) {
+                    rcv->state = READ_SOURCE;
+                } else {
+                    log_fmtmsg(LOG_DEBUG, "Received unknown key: %s", buf);
+                    rcv->state = READ_UNKNOWN_VALUE;
+                }
+                rcv->buf_data_len = 0;
+            } else {
+                buf[rcv->buf_data_len] = ch;
+                if (++rcv->buf_data_len >= sizeof(rcv->buf)) {
+                    log_msg(LOG_ERROR, "Received key name is too long");
+                    receiver_discard(rcv);
+                }
+            }
+            break;
+        case READ_FILE_NAME:
+            // buf[0] contains the opening '<', the name follows
+            if (rcv->buf_data_len == 0 && ch != '<') {
+                log_msg(LOG_ERROR, "Received FILENAME value does not start with '<'");
+                receiver_discard(rcv);
+                break;
+            }
+            if (ch == '>' && rcv->buf_data_len > 0) {
+                buf[rcv->buf_data_len] = '\0';
+                if (!valid_file_name(buf + 1)) {
+                    log_fmtmsg(LOG_ERROR, "Received FILENAME contains forbidden characters: %s", buf + 1);
+                    receiver_discard(rcv);
+                    break;
+                }
+                log_fmtmsg(LOG_DEBUG, "Received FILENAME: %s", buf + 1);
+                rcv->rcv_file_name = my_strdup(buf + 1);
+                rcv->state = READ_NEXT;
+                rcv->buf_data_len = 0;
+            } else {
+                // the name must fit into `received_file_name` including the trailing null byte
+                if (rcv->buf_data_len >= sizeof(received_file_name)) {
+                    log_msg(LOG_ERROR, "Received FILENAME is too long");
+                    receiver_discard(rcv);
+                    break;
+                }
+                buf[rcv->buf_data_len++] = ch;
+            }
+            break;
+        case READ_FILE_SIZE:
+            if (rcv->buf_data_len == 0 && ch != '<') {
+                log_msg(LOG_ERROR, "Received FILESIZE value does not start with '<'");
+                receiver_discard(rcv);
+                break;
+            }
+            if (ch == '>' && rcv->buf_data_len > 0) {
+                buf[rcv->buf_data_len] = '\0';
+                size_t file_size;
+                if (!parse_size(buf + 1, &file_size)) {
+                    log_fmtmsg(LOG_ERROR, "Received invalid FILESIZE: %s", buf + 1);
+                    receiver_discard(rcv);
+                    break;
+                }
+                log_fmtmsg(LOG_DEBUG, "Received FILESIZE: %s", buf + 1);
+                rcv->rcv_file_size = file_size;
+                rcv->state = READ_NEXT;
+                rcv->buf_data_len = 0;
+            } else {
+                buf[rcv->buf_data_len] = ch;
+                if (++rcv->buf_data_len >= sizeof(rcv->buf)) {
+                    log_msg(LOG_ERROR, "Received FILESIZE is too long");
+                    receiver_discard(rcv);
+                }
+            }
+            break;
+        case READ_SOURCE:
+            if (rcv->buf_data_len == 0 && ch != '<') {
+                log_msg(LOG_ERROR, "Received SOURCE value does not start with '<'");
+                receiver_discard(rcv);
+                break;
+            }
+            if (ch == '>') {
+                buf[rcv->buf_data_len] = '\0';
+                log_fmtmsg(LOG_DEBUG, "Received SOURCE: %s", buf + 1);
+                free(rcv->rcv_source);
+                rcv->rcv_source = my_strdup(buf + 1);
+                rcv->state = READ_NEXT;
+                rcv->buf_data_len = 0;
+            } else {
+                buf[rcv->buf_data_len] = ch;
+                if (++rcv->buf_data_len >= sizeof(rcv->buf)) {
+                    log_msg(LOG_ERROR, "Received SOURCE is too long");
+                    receiver_discard(rcv);
+                }
+            }
+            break;
+        case READ_UNKNOWN_VALUE:
+            if (ch == '>') {
+                rcv->state = READ_NEXT;
+            }
+            break;
+        case READ_NEXT:
+            if (ch == '[') {
+                rcv->state = READ_KEY;
+                break;
+            }
+            if (rcv->rcv_file_size == 0) {
+                log_msg(LOG_ERROR, "Missing FILESIZE");
+                receiver_discard(rcv);
+                break;
+            }
+            receiver_open_file(rcv);
+            return false;
+        case READ_FILE:
+        case READ_DISCARD:
+            // processed by receiver_process()
+            break;
+    }
+    return true;
+}
+
+
+// Processes a chunk of the received byte stream.
+static void receiver_process(struct receiver * rcv, const char * data, size_t len) {
+    while (len > 0) {
+        switch (rcv->state) {
+            case READ_FILE: {
+                const size_t bytes_to_end = rcv->rcv_file_size - rcv->total_rcv_file_bytes;
+                const size_t chunk_len = len > bytes_to_end ? bytes_to_end : len;
+                receiver_write_file(rcv, data, chunk_len);
+                data += chunk_len;
+                len -= chunk_len;
+                break;
+            }
+            case READ_DISCARD: {
+                if (!rcv->discard_message_logged) {
+                    log_msg(
+                        LOG_WARNING,
+                        resync ? "Start discarding received data until the next file header is found "
+                                 "or the no-data timeout expires"
+                               : "Start discarding received data until the no-data timeout expires");
+                    rcv->discard_message_logged = true;
+                }
+                const size_t used_len = receiver_resync(rcv, data, len);
+                data += used_len;
+                len -= used_len;
+                break;
+            }
+            default:
+                if (receiver_process_char(rcv, *data)) {
+                    ++data;
+                    --len;
+                }
+                break;
+        }
+    }
+}
+
+
+// Number of the input queue checks during the intercharacter timeout in the file content phase.
+static const int GAP_CHECKS_PER_TIMEOUT = 4;
+
+// Network ports (--port-dev=tcp://<host>:<port> or rfc2217://<host>:<port>) are TCP connections
+// to a terminal server (eg ser2net). The serial line is configured by the server, with rfc2217:// it is set
+// to the attributes of set_port() by the Telnet COM port control option (RFC 2217) and the Telnet commands
+// are removed from the received data.
+//
+// A port which fails (read error, hangup of the serial device, lost connection) is closed and reopened
+// with a doubled delay up to PORT_REOPEN_MAX_MS. The file being received is aborted and its incomplete
+// storage file is removed. Several ports (repeated --port-dev) are served by one poll() loop, a failing
+// port does not affect the others.
+
+static const char PORT_TCP_PREFIX[] = "tcp://";
+static const char PORT_RFC2217_PREFIX[] = "rfc2217://";
+static const int64_t PORT_REOPEN_MIN_MS = 1000;
+static const int64_t PORT_REOPEN_MAX_MS = 60 * 1000;
+// Timeout of the TCP connection establishment
+static const int64_t PORT_CONNECT_TIMEOUT_MS = 10 * 1000;
+
+enum telnet_state {
+    TELNET_STATE_DATA,
+    TELNET_STATE_IAC,
+    TELNET_STATE_OPTION,  // option of WILL, WONT, DO or DONT
+    TELNET_STATE_SB,      // subnegotiation
+    TELNET_STATE_SB_IAC
+};
+
+struct port {
+    const char * dev;
+    int fd;
+    struct termios tty;  // current port attributes
+    struct receiver rcv;
+    int64_t intercharacter_deadline;  // monotonic time in milliseconds or NO_DEADLINE
+    int64_t transfer_deadline;        // monotonic time in milliseconds or NO_DEADLINE
+    int64_t gap_check_time;           // time of the next input queue check
+    char * buf;                       // receive buffer
+    size_t buf_size;
+    bool splice;      // file content is moved from the port to the file by splice()
+    int pipe_fds[2];  // pipe for splice()
+    bool network;     // TCP connection to a terminal server
+    bool rfc2217;     // Telnet protocol with the COM port control option
+    char * host;      // host and port of the terminal server
+    char * service;
+    bool connecting;             // the TCP connection is being established
+    int64_t connect_deadline;    // timeout of the connection establishment
+    int64_t reopen_time;         // time of the next open attempt while the port is closed (fd == -1)
+    int64_t reopen_delay_ms;     // delay of the next open attempt after a failure
+    enum telnet_state telnet;    // state of the Telnet command parser
+    unsigned char telnet_verb;   // WILL, WONT, DO or DONT being parsed
+    char * glob_dev;             // device path of a port attached by --port-glob, otherwise NULL
+};
+
+
+// Telnet commands and options (RFC 854, RFC 856, RFC 858) and the COM port control commands (RFC 2217)
+enum telnet_code {
+    TELNET_SE = 240,
+    TELNET_SB = 250,
+    TELNET_WILL = 251,
+    TELNET_WONT = 252,
+    TELNET_DO = 253,
+    TELNET_DONT = 254,
+    TELNET_IAC = 255
+};
+enum telnet_option { TELNET_OPT_BINARY = 0, TELNET_OPT_SGA = 3, TELNET_OPT_COM_PORT = 44 };
+enum com_port_command {
+    COM_PORT_SET_BAUDRATE = 1,
+    COM_PORT_SET_DATASIZE = 2,
+    COM_PORT_SET_PARITY = 3,
+    COM_PORT_SET_STOPSIZE = 4,
+    COM_PORT_SET_CONTROL = 5
+};
+
+
+static void port_telnet_send(struct port * port, const unsigned char * data, size_t len) {
+    if (send(port->fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)len) {
+        log_fmtmsg(LOG_WARNING, "Cannot send Telnet command to \"%s\"", port->dev);
+    }
+}
+
+
+// Negotiates the binary transmission and sets the serial line of the terminal server like set_port():
+// 9600 baud, 8 bits, no parity, 2 stop bits and no flow control.
+static void port_telnet_negotiate(struct port * port) {
+    static const unsigned char commands[] = {
+        TELNET_IAC, TELNET_WILL, TELNET_OPT_BINARY,   TELNET_IAC,   TELNET_DO,   TELNET_OPT_BINARY,
+        TELNET_IAC, TELNET_WILL, TELNET_OPT_SGA,      TELNET_IAC,   TELNET_DO,   TELNET_OPT_SGA,
+        TELNET_IAC, TELNET_WILL, TELNET_OPT_COM_PORT,
+        TELNET_IAC, TELNET_SB,   TELNET_OPT_COM_PORT, COM_PORT_SET_BAUDRATE, 0, 0, 0x25, 0x80, TELNET_IAC, TELNET_SE,
+        TELNET_IAC, TELNET_SB,   TELNET_OPT_COM_PORT, COM_PORT_SET_DATASIZE, 8, TELNET_IAC, TELNET_SE,
+        TELNET_IAC, TELNET_SB,   TELNET_OPT_COM_PORT, COM_PORT_SET_PARITY,   1, TELNET_IAC, TELNET_SE,
+        TELNET_IAC, TELNET_SB,   TELNET_OPT_COM_PORT, COM_PORT_SET_STOPSIZE, 2, TELNET_IAC, TELNET_SE,
+        TELNET_IAC, TELNET_SB,   TELNET_OPT_COM_PORT, COM_PORT_SET_CONTROL,  1, TELNET_IAC, TELNET_SE};
+    port_telnet_send(port, commands, sizeof(commands));
+}
+
+
+// Answers an option request of the server. Options other than the negotiated ones are refused.
+static void port_telnet_option(struct port * port, unsigned char verb, unsigned char option) {
+    const bool supported = option == TELNET_OPT_BINARY || option == TELNET_OPT_SGA;
+    if (option == TELNET_OPT_COM_PORT && (verb == TELNET_WONT || verb == TELNET_DONT)) {
+        log_fmtmsg(
+            LOG_WARNING, "\"%s\" does not support RFC 2217, the serial line is not configured", port->dev);
+    }
+    if (verb == TELNET_DO && !supported && option != TELNET_OPT_COM_PORT) {
+        const unsigned char answer[] = {TELNET_IAC, TELNET_WONT, option};
+        port_telnet_send(port, answer, sizeof(answer));
+    } else if (verb == TELNET_WILL && !supported) {
+        const unsigned char answer[] = {TELNET_IAC, TELNET_DONT, option};
+        port_telnet_send(port, answer, sizeof(answer));
+    }
+}
+
+
+// Removes the Telnet commands from the received data in place. Returns the length of the remaining data.
+static size_t port_telnet_filter(struct port * port, char * data, size_t len) {
+    size_t data_len = 0;
+    for (size_t i = 0; i < len; ++i) {
+        const unsigned char ch = data[i];
+        switch (port->telnet) {
+            case TELNET_STATE_DATA:
+                if (ch == TELNET_IAC) {
+                    port->telnet = TELNET_STATE_IAC;
+                } else {
+                    data[data_len++] = ch;
+                }
+                break;
+            case TELNET_STATE_IAC:
+                if (ch == TELNET_IAC) {
+                    data[data_len++] = ch;  // escaped data byte 255
+                    port->telnet = TELNET_STATE_DATA;
+                } else if (ch >= TELNET_WILL) {
+                    port->telnet_verb = ch;
+                    port->telnet = TELNET_STATE_OPTION;
+                } else {
+                    port->telnet = ch == TELNET_SB ? TELNET_STATE_SB : TELNET_STATE_DATA;
+                }
+                break;
+            case TELNET_STATE_OPTION:
+                port_telnet_option(port, port->telnet_verb, ch);
+                port->telnet = TELNET_STATE_DATA;
+                break;
+            case TELNET_STATE_SB:
+                // subnegotiation (eg COM port control answers) is ignored
+                if (ch == TELNET_IAC) {
+                    port->telnet = TELNET_STATE_SB_IAC;
+                }
+                break;
+            case TELNET_STATE_SB_IAC:
+                port->telnet = ch == TELNET_SE ? TELNET_STATE_DATA : TELNET_STATE_SB;
+                break;
+        }
+    }
+    return data_len;
+}
+
+
+// Services the spool, the quota, the hooks, the events, the tee, the metadata compaction and the relay.
+// Returns the time of the next call.
+static int64_t services_handle_deadlines(int64_t now) {
+    const int64_t spool_deadline = spool_service(now);
+    const int64_t quota_deadline = quota_service(now);
+    const int64_t hook_deadline = hook_service(now);
+    const int64_t events_deadline = events_service(now);
+    const int64_t tee_deadline = tee_service(now);
+    const int64_t metadata_deadline = metadata_service(now);
+    const int64_t relay_deadline = relay_service(now);
+    int64_t deadline = spool_deadline < quota_deadline ? spool_deadline : quota_deadline;
+    if (hook_deadline < deadline) {
+        deadline = hook_deadline;
+    }
+    if (events_deadline < deadline) {
+        deadline = events_deadline;
+    }
+    if (tee_deadline < deadline) {
+        deadline = tee_deadline;
+    }
+    if (metadata_deadline < deadline) {
+        deadline = metadata_deadline;
+    }
+    return relay_deadline < deadline ? relay_deadline : deadline;
+}
+
+
+// Handles expired deadlines of the port. Returns the nearest remaining deadline.
+static int64_t port_handle_deadlines(struct port * port, int64_t now) {
+    if (port->intercharacter_deadline <= now) {
+        receiver_timeout(&port->rcv);
+        port->intercharacter_deadline = NO_DEADLINE;
+        port->transfer_deadline = NO_DEADLINE;
+    }
+    if (port->transfer_deadline <= now) {
+        receiver_transfer_timeout(&port->rcv);
+        port->transfer_deadline = NO_DEADLINE;
+    }
+    return port->intercharacter_deadline < port->transfer_deadline ? port->intercharacter_deadline
+                                                                   : port->transfer_deadline;
+}
+
+
+// Updates the port deadlines after received data were processed.
+// `files_started` is the receiver file counter before the data were processed.
+static void port_update_deadlines(struct port * port, unsigned int files_started) {
+    if (receiver_idle(&port->rcv)) {
+        port->intercharacter_deadline = NO_DEADLINE;
+        port->transfer_deadline = NO_DEADLINE;
+        return;
+    }
+    const int64_t now = monotonic_ms();
+    port->intercharacter_deadline = now + intercharacter_timeout_ms;
+    if (port->rcv.files_started != files_started && transfer_timeout_ms > 0) {
+        port->transfer_deadline = now + transfer_timeout_ms;
+    }
+}
+
+
+#ifdef __linux__
+static ssize_t port_splice(struct port * port);
+#endif
+
+// Reads data waiting in the port input queue and passes them to the parser.
+// Returns the number of processed bytes, 0 if no data are available or -1 on error.
+static ssize_t port_read(struct port * port) {
+#ifdef __linux__
+    if (port->splice && port->rcv.state == READ_FILE && port->rcv.file_fd != -1 && !port->rcv.tee &&
+        !port->rcv.stats && port->rcv.meta_head_len >= port->rcv.meta_head_end) {
+        const ssize_t splice_len = port_splice(port);
+        if (splice_len != 0 || port->splice) {
+            return splice_len;
+        }
+    }
+#endif
+    const ssize_t read_len = read(port->fd, port->buf, receiver_wanted_len(&port->rcv, port->buf_size));
+    if (read_len == -1) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return 0;
+        }
+        log_fmtmsg(LOG_ERROR, "Cannot read port \"%s\": %s", port->dev, strerror(errno));
+        return -1;
+    }
+    if (read_len == 0) {
+        log_fmtmsg(
+            LOG_ERROR, "Cannot read port \"%s\": %s", port->dev, port->network ? "connection closed" : "end of file");
+        return -1;
+    }
+    const size_t data_len = port->rfc2217 ? port_telnet_filter(port, port->buf, read_len) : (size_t)read_len;
+    receiver_process(&port->rcv, port->buf, data_len);
+    return read_len;
+}
+
+
+#ifdef __linux__
+// Maximum number of bytes moved by one splice() call, default pipe capacity
+static const size_t MAX_SPLICE_LEN = 65536;
+
+// Moves the file content from the port to the storage file through a pipe without copying it
+// to the user space. If the port does not support splice(), the port falls back to read().
+// If the storage file does not support splice(), the content is read from the pipe and written.
+// Returns the number of processed bytes, 0 if no data are available or -1 on error.
+static ssize_t port_splice(struct port * port) {
+    const size_t len = receiver_wanted_len(&port->rcv, MAX_SPLICE_LEN);
+    const ssize_t in_len = splice(port->fd, NULL, port->pipe_fds[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (in_len == -1) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return 0;
+        }
+        if (errno == EINVAL || errno == ENOSYS) {
+            log_fmtmsg(LOG_WARNING, "Port \"%s\" does not support splice, read is used", port->dev);
+            port->splice = false;
+            return 0;
+        }
+        log_fmtmsg(LOG_ERROR, "Cannot read port \"%s\": %s", port->dev, strerror(errno));
+        return -1;
+    }
+    if (in_len == 0) {
+        log_fmtmsg(
+            LOG_ERROR, "Cannot read port \"%s\": %s", port->dev, port->network ? "connection closed" : "end of file");
+        return -1;
+    }
+
+    size_t moved_len = 0;
+    while (moved_len < (size_t)in_len && port->rcv.file_fd != -1) {
+        const ssize_t out_len =
+            splice(port->pipe_fds[0], NULL, port->rcv.file_fd, NULL, in_len - moved_len, SPLICE_F_MOVE);
+        if (out_len == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL || errno == ENOSYS) {
+                log_fmtmsg(
+                    LOG_WARNING, "File \"%s\" does not support splice, write is used", port->rcv.storage_file_path);
+                port->splice = false;
+            } else {
+                receiver_write_file_failed(&port->rcv, errno);
+            }
+            break;
+        }
+        moved_len += out_len;
+    }
+    receiver_file_content_done(&port->rcv, moved_len);
+
+    // Data not moved to the file are passed from the pipe to the receiver.
+    size_t rest_len = in_len - moved_len;
+    while (rest_len > 0) {
+        const size_t buf_len = rest_len > port->buf_size ? port->buf_size : rest_len;
+        const ssize_t read_len = read(port->pipe_fds[0], port->buf, buf_len);
+        if (read_len == -1 && errno == EINTR) {
+            continue;
+        }
+        if (read_len <= 0) {
+            log_fmtmsg(LOG_ERROR, "Cannot read splice pipe: %s", read_len == 0 ? "end of file" : strerror(errno));
+            return -1;
+        }
+        receiver_write_file(&port->rcv, port->buf, read_len);
+        rest_len -= read_len;
+    }
+
+    return in_len;
+}
+#endif
+
+
+// Maximum wake-up threshold, independent of the receive buffer size. Linux stops the sender when its input
+// buffer is full and resumes it only when less than 128 characters remain in the buffer, so a larger threshold
+// could stall the reception of a large file. Moreover, with VMIN above 64 read() returns at most 64 characters.
+static const cc_t MAX_VMIN = 64;
+
+// Returns the number of received characters needed to wake up poll().
+// In the header phase it is woken up by every character. In the file content phase it is woken up
+// by a block of data or by the end of the file. Data below the threshold are picked up by periodic checks
+// of the input queue.
+static cc_t port_wanted_vmin(const struct port * port) {
+    if (port->rcv.state != READ_FILE) {
+        return 1;
+    }
+    const size_t len = receiver_wanted_len(&port->rcv, port->buf_size);
+    return len > MAX_VMIN ? MAX_VMIN : len > 0 ? len : 1;
+}
+
+
+static bool port_set_vmin(struct port * port, cc_t vmin, int64_t now) {
+    if (port->network || port->tty.c_cc[VMIN] == vmin) {
+        return true;
+    }
+    if (port->tty.c_cc[VMIN] == 1) {
+        port->gap_check_time = now + intercharacter_timeout_ms / GAP_CHECKS_PER_TIMEOUT;
+    }
+    port->tty.c_cc[VMIN] = vmin;
+    if (tcsetattr(port->fd, TCSANOW, &port->tty) != 0) {
+        log_fmtmsg(LOG_ERROR, "Cannot set port attributes: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+
+// Data below the wake-up threshold do not wake up poll(). They are read and processed here.
+// Returns false on a read error.
+static bool port_check_input_queue(struct port * port, int64_t now) {
+    port->gap_check_time = now + intercharacter_timeout_ms / GAP_CHECKS_PER_TIMEOUT;
+    int queue_len;
+    if (ioctl(port->fd, FIONREAD, &queue_len) == 0 && queue_len == 0) {
+        return true;
+    }
+    while (true) {
+        const unsigned int files_started = port->rcv.files_started;
+        const ssize_t read_len = port_read(port);
+        if (read_len <= 0) {
+            return read_len == 0;
+        }
+        port_update_deadlines(port, files_started);
+    }
+}
+
+
+// Schedules the next open attempt, the delay is doubled for each failed attempt.
+static void port_schedule_reopen(struct port * port, int64_t now) {
+    port->reopen_time = now + port->reopen_delay_ms;
+    log_fmtmsg(LOG_INFO, "Port \"%s\" will be reopened in %u ms", port->dev, (unsigned int)port->reopen_delay_ms);
+    port->reopen_delay_ms =
+        port->reopen_delay_ms * 2 > PORT_REOPEN_MAX_MS ? PORT_REOPEN_MAX_MS : port->reopen_delay_ms * 2;
+}
+
+
+// Opens the serial device or starts the connection to the terminal server.
+// On failure, the next attempt is scheduled.
+static bool port_connect(struct port * port, int64_t now) {
+    if (port->network) {
+        if ((port->fd = tcp_connect(port->host, port->service)) == -1) {
+            port_schedule_reopen(port, now);
+            return false;
+        }
+        port->connecting = true;
+        port->connect_deadline = now + PORT_CONNECT_TIMEOUT_MS;
+        return true;
+    }
+    if ((port->fd = open(port->dev, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) == -1) {
+        log_fmtmsg(LOG_ERROR, "Cannot open port \"%s\": %s", port->dev, strerror(errno));
+        port_schedule_reopen(port, now);
+        return false;
+    }
+    if (!set_port(port->fd, &port->tty)) {
+        close(port->fd);
+        port->fd = -1;
+        port_schedule_reopen(port, now);
+        return false;
+    }
+    if (port->reopen_time != 0) {
+        log_fmtmsg(LOG_INFO, "Port \"%s\" reopened", port->dev);
+    }
+    port->reopen_delay_ms = PORT_REOPEN_MIN_MS;
+    return true;
+}
+
+
+// Called when the connection to the terminal server is established.
+static void port_connected(struct port * port) {
+    log_fmtmsg(LOG_INFO, "Connected to \"%s\"", port->dev);
+    port->connecting = false;
+    port->reopen_delay_ms = PORT_REOPEN_MIN_MS;
+    port->telnet = TELNET_STATE_DATA;
+    if (port->rfc2217) {
+        port_telnet_negotiate(port);
+    }
+}
+
+
+// Closes the port after an error, the file being received is aborted. The next open attempt is scheduled.
+static void port_disconnect(struct port * port, int64_t now) {
+    if (!receiver_idle(&port->rcv)) {
+        log_fmtmsg(LOG_ERROR, "Port \"%s\" closed, data reception not completed", port->dev);
+    }
+    receiver_abort(&port->rcv);
+    port->intercharacter_deadline = NO_DEADLINE;
+    port->transfer_deadline = NO_DEADLINE;
+    close(port->fd);
+    port->fd = -1;
+    port->connecting = false;
+    port_schedule_reopen(port, now);
+}
+
+
+// Returns true if the port is a network port (tcp:// or rfc2217://).
+static bool port_dev_is_network(const char * dev) {
+    return strncmp(dev, PORT_TCP_PREFIX, sizeof(PORT_TCP_PREFIX) - 1) == 0 ||
+           strncmp(dev, PORT_RFC2217_PREFIX, sizeof(PORT_RFC2217_PREFIX) - 1) == 0;
+}
+
+
+static bool port_open(struct port * port, const char * dev, struct tokens tokens) {
+    port->dev = dev;
+    port->intercharacter_deadline = NO_DEADLINE;
+    port->transfer_deadline = NO_DEADLINE;
+    port->network = false;
+    port->rfc2217 = false;
+    port->host = NULL;
+    port->service = NULL;
+    port->connecting = false;
+    port->reopen_time = 0;
+    port->reopen_delay_ms = PORT_REOPEN_MIN_MS;
+    port->telnet = TELNET_STATE_DATA;
+    port->glob_dev = NULL;
+    const char * address = NULL;
+    if (strncmp(dev, PORT_TCP_PREFIX, sizeof(PORT_TCP_PREFIX) - 1) == 0) {
+        address = dev + sizeof(PORT_TCP_PREFIX) - 1;
+    } else if (strncmp(dev, PORT_RFC2217_PREFIX, sizeof(PORT_RFC2217_PREFIX) - 1) == 0) {
+        address = dev + sizeof(PORT_RFC2217_PREFIX) - 1;
+        port->rfc2217 = true;
+    }
+    if (address) {
+        if (!net_parse_address(address, &port->host, &port->service) || !port->host) {
+            log_fmtmsg(LOG_ERROR, "Bad network port address \"%s\"", dev);
+            free(port->service);
+            return false;
+        }
+        port->network = true;
+        memset(&port->tty, 0, sizeof(port->tty));
+        port->tty.c_cc[VMIN] = 1;
+    }
+    struct tee * tee = NULL;
+    if (payload_tee_socket) {
+        tee = tee_open(
+            port_devs_len == 1 && !port_glob ? my_strdup(payload_tee_socket) : tee_port_socket_path(dev));
+        if (!tee) {
+            free(port->host);
+            free(port->service);
+            return false;
+        }
+    }
+    // a port which cannot be opened now is reopened later
+    port_connect(port, monotonic_ms());
+
+    receiver_init(&port->rcv, tokens);
+    port->rcv.payload_tee = tee;
+    port->rcv.source = port->dev;
+    port->buf_size = recv_buffer_size;
+    port->buf = realloc_assert(NULL, port->buf_size);
+    port->splice = false;
+    port->pipe_fds[0] = port->pipe_fds[1] = -1;
+    if (storage_mmap) {
+#ifdef __linux__
+        port->rcv.file_ops = &mmap_file_ops;
+        if (payload_splice) {
+            log_msg(LOG_WARNING, "splice is not used with memory-mapped storage files");
+        }
+#else
+        log_msg(LOG_WARNING, "Memory-mapped storage files are not supported on this system, write is used");
+#endif
+    } else if (payload_splice && port->rfc2217) {
+        log_msg(LOG_WARNING, "splice is not used with RFC 2217 ports");
+    } else if (payload_splice) {
+#ifdef __linux__
+        if (pipe2(port->pipe_fds, O_NONBLOCK | O_CLOEXEC) == 0) {
+            port->splice = true;
+        } else {
+            log_fmtmsg(LOG_WARNING, "Cannot create pipe for splice, read is used: %s", strerror(errno));
+        }
+#else
+        log_msg(LOG_WARNING, "splice is not supported on this system, read is used");
+#endif
+    }
+    return true;
+}
+
+
+static void port_close(struct port * port) {
+    receiver_reset(&port->rcv);
+    tee_close(port->rcv.payload_tee);
+    if (port->pipe_fds[0] != -1) {
+        close(port->pipe_fds[0]);
+        close(port->pipe_fds[1]);
+    }
+    free(port->buf);
+    free(port->host);
+    free(port->service);
+    free(port->glob_dev);
+    if (port->fd != -1) {
+        close(port->fd);
+    }
+}
+
+
+// Opens the port when it is due and handles its deadlines. A failed port is closed and its reopening
+// is scheduled. Returns the nearest deadline of the port.
+static int64_t port_service(struct port * port, int64_t now) {
+    if (port->fd == -1 && port->reopen_time <= now) {
+        port_connect(port, now);
+    }
+    if (port->connecting && port->connect_deadline <= now) {
+        log_fmtmsg(LOG_ERROR, "Cannot connect to \"%s\": timeout", port->dev);
+        port_disconnect(port, now);
+    }
+    if (port->fd != -1 && port->tty.c_cc[VMIN] > 1 &&
+        (port->gap_check_time <= now || port->intercharacter_deadline <= now)) {
+        if (!port_check_input_queue(port, now)) {
+            port_disconnect(port, now);
+        }
+    }
+    int64_t deadline = port_handle_deadlines(port, now);
+    if (port->fd != -1 && !port_set_vmin(port, port_wanted_vmin(port), now)) {
+        port_disconnect(port, now);
+    }
+    if (port->fd == -1) {
+        return port->reopen_time < deadline ? port->reopen_time : deadline;
+    }
+    if (port->tty.c_cc[VMIN] > 1 && port->gap_check_time < deadline) {
+        deadline = port->gap_check_time;
+    }
+    if (port->connecting && port->connect_deadline < deadline) {
+        deadline = port->connect_deadline;
+    }
+    return deadline;
+}
+
+
+// Handles the poll() events of the open port. A failed port is closed and its reopening is scheduled.
+static void port_handle_events(struct port * port, short revents) {
+    if (port->connecting) {
+        const int ret = tcp_connect_check(port->fd);
+        if (ret == 1) {
+            port_connected(port);
+        } else if (ret == -1) {
+            log_fmtmsg(LOG_ERROR, "Cannot connect to \"%s\": %s", port->dev, strerror(errno));
+            port_disconnect(port, monotonic_ms());
+        }
+        return;
+    }
+    // received data are read before the hangup is handled
+    if ((revents & (POLLERR | POLLHUP | POLLNVAL)) != 0 && (revents & POLLIN) == 0) {
+        log_fmtmsg(LOG_ERROR,
+                   "Cannot read port \"%s\": %s",
+                   port->dev,
+                   (revents & POLLHUP) != 0 ? (port->network ? "connection closed" : "hang up") : "poll error");
+        port_disconnect(port, monotonic_ms());
+        return;
+    }
+    if ((revents & POLLIN) == 0) {
+        return;
+    }
+
+    const unsigned int files_started = port->rcv.files_started;
+    const ssize_t read_len = port_read(port);
+    if (read_len == -1) {
+        port_disconnect(port, monotonic_ms());
+    } else if (read_len > 0) {
+        port_update_deadlines(port, files_started);
+    }
+}
+
+
+static struct port ** ports = NULL;
+static size_t ports_len = 0;
+
+
+// Hot-plug of serial adapters (--port-glob=<pattern>, eg /dev/serial/by-id/*).
+// A port is attached for each character device matching the pattern and detached when the device path
+// disappears. The directory of the pattern is watched by inotify, while it does not exist (no adapter
+// is plugged in) its nearest existing parent is watched instead. The pattern is expanded again after each
+// change of the watched directory, so a device is attached without polling as soon as udev creates its
+// path. Wildcards are allowed only in the last path component.
+
+static struct tokens port_glob_tokens;
+static int port_glob_fd = -1;               // inotify instance or -1
+static int port_glob_wd = -1;               // watch of the pattern directory or of its parent
+static bool port_glob_dir_watched = false;  // the pattern directory itself is watched
+
+
+static bool port_attach(const char * dev) {
+    struct port * const port = realloc_assert(NULL, sizeof(*port));
+    char * const glob_dev = my_strdup(dev);
+    if (!port_open(port, glob_dev, port_glob_tokens)) {
+        free(glob_dev);
+        free(port);
+        return false;
+    }
+    port->glob_dev = glob_dev;
+    ports = realloc_assert(ports, (ports_len + 1) * sizeof(*ports));
+    ports[ports_len++] = port;
+    log_fmtmsg(LOG_INFO, "Port \"%s\" attached, %u ports", dev, (unsigned int)ports_len);
+    return true;
+}
+
+
+// Closes the port of the removed device, the file being received is aborted.
+static void port_detach(size_t idx) {
+    struct port * const port = ports[idx];
+    if (!receiver_idle(&port->rcv)) {
+        log_fmtmsg(LOG_ERROR, "Port \"%s\" removed, data reception not completed", port->dev);
+    }
+    receiver_abort(&port->rcv);
+    ports[idx] = ports[--ports_len];
+    log_fmtmsg(LOG_INFO, "Port \"%s\" detached, %u ports", port->dev, (unsigned int)ports_len);
+    port_close(port);
+    free(port);
+}
+
+
+// Expands the pattern, attaches the new devices and detaches the removed ones. A closed port
+// of a present device is reopened immediately, the device may have been plugged in again.
+static void port_glob_scan(void) {
+    glob_t matches;
+    const int ret = glob(port_glob, 0, NULL, &matches);
+    if (ret != 0 && ret != GLOB_NOMATCH) {
+        log_fmtmsg(LOG_ERROR, "Cannot expand port pattern \"%s\"", port_glob);
+        return;
+    }
+    const size_t matches_len = ret == 0 ? matches.gl_pathc : 0;
+
+    for (size_t i = ports_len; i > 0; --i) {
+        const struct port * const port = ports[i - 1];
+        if (!port->glob_dev) {
+            continue;
+        }
+        size_t j = 0;
+        while (j < matches_len && strcmp(matches.gl_pathv[j], port->glob_dev) != 0) {
+            ++j;
+        }
+        if (j == matches_len) {
+            port_detach(i - 1);
+        }
+    }
+
+    const int64_t now = monotonic_ms();
+    for (size_t i = 0; i < matches_len; ++i) {
+        const char * const dev = matches.gl_pathv[i];
+        struct stat st;
+        if (stat(dev, &st) == -1 || !S_ISCHR(st.st_mode)) {
+            continue;
+        }
+        size_t j = 0;
+        while (j < ports_len && strcmp(ports[j]->dev, dev) != 0) {
+            ++j;
+        }
+        if (j < ports_len) {
+            if (ports[j]->fd == -1) {
+                ports[j]->reopen_time = now;
+            }
+            continue;
+        }
+        port_attach(dev);
+    }
+    if (ret == 0) {
+        globfree(&matches);
+    }
+}
+
+
+#ifdef __linux__
+// Watches the directory of the pattern or, if it does not exist, its nearest existing parent.
+static void port_glob_watch(void) {
+    if (port_glob_wd != -1) {
+        inotify_rm_watch(port_glob_fd, port_glob_wd);
+        port_glob_wd = -1;
+    }
+    char * const dir = my_strdup(port_glob);
+    char * sep = strrchr(dir, '/');
+    if (!sep) {
+        strcpy(dir, ".");
+    } else {
+        sep[sep == dir ? 1 : 0] = '\0';
+    }
+    const size_t dir_len = strlen(dir);
+    const uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |
+                          IN_ONLYDIR;
+    while ((port_glob_wd = inotify_add_watch(port_glob_fd, dir, mask)) == -1) {
+        if ((errno != ENOENT && errno != ENOTDIR) || (sep = strrchr(dir, '/')) == NULL || strcmp(dir, "/") == 0) {
+            log_fmtmsg(LOG_ERROR, "Cannot watch directory \"%s\": %s", dir, strerror(errno));
+            break;
+        }
+        sep[sep == dir ? 1 : 0] = '\0';
+    }
+    port_glob_dir_watched = port_glob_wd != -1 && strlen(dir) == dir_len;
+    free(dir);
+}
+
+
+// Reads the inotify events, the pattern is expanded again after any change. The watch is moved when
+// the pattern directory is created or removed.
+static void port_glob_handle_events(void) {
+    union {
+        struct inotify_event event;
+        char buf[4096];
+    } events;
+    bool rewatch = !port_glob_dir_watched;
+    ssize_t len;
+    while ((len = read(port_glob_fd, events.buf, sizeof(events.buf))) > 0) {
+        for (ssize_t offset = 0; offset < len;) {
+            const struct inotify_event * const event = (const struct inotify_event *)(events.buf + offset);
+            if (event->wd == port_glob_wd && (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) != 0) {
+                rewatch = true;
+            }
+            offset += sizeof(*event) + event->len;
+        }
+    }
+    if (rewatch) {
+        port_glob_watch();
+    }
+    port_glob_scan();
+}
+#endif
+
+
+static bool port_glob_init(void) {
+#ifdef __linux__
+    if ((port_glob_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+        log_fmtmsg(LOG_ERROR, "Cannot create inotify instance: %s", strerror(errno));
+        return false;
+    }
+    port_glob_watch();
+#else
+    log_msg(LOG_WARNING, "Device hot-plug is not supported on this system, the port pattern is expanded once");
+#endif
+    port_glob_scan();
+    return true;
+}
+
+
+// Receive loop of the ports using poll() and read(). The loop ends only on a poll() failure,
+// the failed ports are reopened.
+static void recv_loop_poll(void) {
+    struct pollfd * fds = NULL;
+    size_t fds_size = 0;
+    while (true) {
+        const int64_t now = monotonic_ms();
+        int64_t deadline = services_handle_deadlines(now);
+        const size_t polled_ports_len = ports_len;
+        if (fds_size < polled_ports_len + 1) {
+            fds_size = polled_ports_len + 1;
+            fds = realloc_assert(fds, fds_size * sizeof(*fds));
+        }
+        for (size_t i = 0; i < ports_len; ++i) {
+            struct port * const port = ports[i];
+            const int64_t port_deadline = port_service(port, now);
+            if (port_deadline < deadline) {
+                deadline = port_deadline;
+            }
+            // a closed port (fd -1) is ignored by poll()
+            fds[i].fd = port->fd;
+            fds[i].events = port->connecting ? POLLOUT : POLLIN;
+            fds[i].revents = 0;
+        }
+        fds[polled_ports_len].fd = port_glob_fd;
+        fds[polled_ports_len].events = POLLIN;
+        fds[polled_ports_len].revents = 0;
+        int timeout_ms = -1;  // timeout in miliseconds, -1 = infinite
+        if (deadline != NO_DEADLINE) {
+            timeout_ms = deadline <= now ? 0 : deadline - now > INT32_MAX ? INT32_MAX : (int)(deadline - now);
+        }
+
+        const int poll_ret = poll(fds, polled_ports_len + 1, timeout_ms);
+        if (poll_ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_fmtmsg(LOG_ERROR, "poll: %s", strerror(errno));
+            break;
+        }
+        for (size_t i = 0; i < polled_ports_len && poll_ret > 0; ++i) {
+            if (fds[i].revents != 0) {
+                port_handle_events(ports[i], fds[i].revents);
+            }
+        }
+#ifdef __linux__
+        // ports are attached and detached after the events of the polled ports are handled
+        if (fds[polled_ports_len].revents != 0) {
+            port_glob_handle_events();
+        }
+#endif
+    }
+    free(fds);
+}
+
+
+#ifdef __linux__
+// Number of receive buffers of a port with the io_uring backend. A buffer is reused when all writes
+// of the file content stored in it are completed.
+#define URING_BUFFERS 8
+
+// Storage file with writes in flight
+struct uring_file {
+    int fd;
+    off_t offset;  // offset of the next write
+    unsigned int pending_writes;
+    bool close_requested;
+    bool synced;  // fsync was requested, used with --storage-sync
+    int write_errno;  // error of a completed write, 0 = no error
+    char * storage_file_path;
+    char * rcv_file_name;  // name of the received file if it was received completely, otherwise NULL
+    char * source;         // source of the received file, set with rcv_file_name
+    size_t rcv_file_size;
+    bool spooled;  // the file is in the spool, it is stored by the migration
+};
+
+enum uring_op { URING_OP_READ, URING_OP_WRITE, URING_OP_FSYNC, URING_OP_CLOSE };
+
+struct uring_request {
+    enum uring_op op;
+    struct uring_file * file;
+    int buffer;  // index of the used receive buffer or -1
+    const char * data;
+    size_t len;
+    off_t offset;
+};
+
+struct uring_port {
+    struct uring ring;
+    struct port * port;
+    char * buffers[URING_BUFFERS];
+    unsigned int buffer_refs[URING_BUFFERS];  // number of requests using the buffer
+    struct uring_request * read_request;      // pending read or NULL
+    struct uring_file * file;                 // current storage file or NULL
+    unsigned int requests;                    // number of requests in flight
+};
+
+
+static struct uring_request * uring_port_new_request(
+    struct uring_port * up, enum uring_op op, struct uring_file * file, int buffer) {
+    struct uring_request * const req = realloc_assert(NULL, sizeof(*req));
+    req->op = op;
+    req->file = file;
+    req->buffer = buffer;
+    req->data = NULL;
+    req->len = 0;
+    req->offset = 0;
+    if (buffer != -1) {
+        ++up->buffer_refs[buffer];
+    }
+    ++up->requests;
+    return req;
+}
+
+
+static void uring_port_release_request(struct uring_port * up, struct uring_request * req) {
+    if (req->buffer != -1) {
+        --up->buffer_refs[req->buffer];
+    }
+    --up->requests;
+    free(req);
+}
+
+
+static void uring_file_closed(struct uring_file * file) {
+    if (file->rcv_file_name && file->write_errno == 0 && !file->spooled) {
+        storage_file_stored(file->storage_file_path, file->rcv_file_name, file->rcv_file_size, file->source);
+        storage_index_file_saved(file->storage_file_path);
+    }
+    free(file->rcv_file_name);
+    free(file->source);
+    free(file->storage_file_path);
+    free(file);
+}
+
+
+// Closes the file. With --storage-sync, the file is synced first and closed after the fsync completes.
+static void uring_port_submit_close(struct uring_port * up, struct uring_file * file) {
+    if (storage_sync && !file->synced) {
+        file->synced = true;
+        struct io_uring_sqe * const sqe = uring_get_sqe(&up->ring);
+        if (sqe) {
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd = file->fd;
+            sqe->user_data = (uintptr_t)uring_port_new_request(up, URING_OP_FSYNC, file, -1);
+            return;
+        }
+        if (fsync(file->fd) == -1) {
+            log_fmtmsg(LOG_ERROR, "Cannot sync file \"%s\": %s", file->storage_file_path, strerror(errno));
+        }
+    }
+    struct io_uring_sqe * const sqe = uring_get_sqe(&up->ring);
+    if (!sqe) {
+        close(file->fd);
+        uring_file_closed(file);
+        return;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = file->fd;
+    sqe->user_data = (uintptr_t)uring_port_new_request(up, URING_OP_CLOSE, file, -1);
+}
+
+
+static bool uring_port_submit_write(struct uring_port * up, struct uring_request * req) {
+    struct io_uring_sqe * const sqe = uring_get_sqe(&up->ring);
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = req->file->fd;
+    sqe->addr = (uintptr_t)req->data;
+    sqe->len = req->len;
+    sqe->off = req->offset;
+    sqe->user_data = (uintptr_t)req;
+    ++req->file->pending_writes;
+    return true;
+}
+
+
+// Writes the file content asynchronously. The data must be located in a receive buffer of the port,
+// otherwise, or if the submission queue is full, they are written synchronously.
+static bool uring_file_write(struct receiver * rcv, const char * data, size_t len) {
+    struct uring_port * const up = rcv->file_ops_ctx;
+    if (!up->file) {
+        up->file = realloc_assert(NULL, sizeof(*up->file));
+        up->file->fd = rcv->file_fd;
+        up->file->offset = 0;
+        up->file->pending_writes = 0;
+        up->file->close_requested = false;
+        up->file->synced = false;
+        up->file->write_errno = 0;
+        up->file->storage_file_path = my_strdup(rcv->storage_file_path);
+    }
+    struct uring_file * const file = up->file;
+    if (file->write_errno != 0) {
+        errno = file->write_errno;
+        return false;
+    }
+
+    int buffer = -1;
+    for (int i = 0; i < URING_BUFFERS; ++i) {
+        if (data >= up->buffers[i] && data < up->buffers[i] + up->port->buf_size) {
+            buffer = i;
+            break;
+        }
+    }
+    if (buffer != -1) {
+        struct uring_request * const req = uring_port_new_request(up, URING_OP_WRITE, file, buffer);
+        req->data = data;
+        req->len = len;
+        req->offset = file->offset;
+        if (uring_port_submit_write(up, req)) {
+            file->offset += len;
+            return true;
+        }
+        uring_port_release_request(up, req);
+    }
+
+    size_t written = 0;
+    while (written < len) {
+        const ssize_t write_ret = pwrite(file->fd, data + written, len - written, file->offset + written);
+        if (write_ret == -1) {
+            return false;
+        }
+        written += write_ret;
+    }
+    file->offset += len;
+    return true;
+}
+
+
+// Closes the file asynchronously after all its writes are completed.
+static void uring_file_close(struct receiver * rcv) {
+    struct uring_port * const up = rcv->file_ops_ctx;
+    struct uring_file * file = up->file;
+    up->file = NULL;
+    if (!file) {
+        file = realloc_assert(NULL, sizeof(*file));
+        file->fd = rcv->file_fd;
+        file->offset = 0;
+        file->pending_writes = 0;
+        file->synced = false;
+        file->write_errno = 0;
+        file->storage_file_path = my_strdup(rcv->storage_file_path);
+    }
+    file->close_requested = true;
+    file->rcv_file_name = NULL;
+    file->source = NULL;
+    file->spooled = rcv->spool_name != NULL;
+    if (rcv->total_rcv_file_bytes >= rcv->rcv_file_size) {
+        file->rcv_file_name = my_strdup(rcv->rcv_file_name);
+        file->source = my_strdup(rcv->rcv_source ? rcv->rcv_source : rcv->source);
+        file->rcv_file_size = rcv->rcv_file_size;
+    }
+    if (file->pending_writes == 0) {
+        uring_port_submit_close(up, file);
+    }
+}
+
+static const struct file_ops uring_file_ops = {O_WRONLY, NULL, uring_file_write, uring_file_close};
+
+
+static void uring_port_submit_read(struct uring_port * up) {
+    int buffer = -1;
+    for (int i = 0; i < URING_BUFFERS; ++i) {
+        if (up->buffer_refs[i] == 0) {
+            buffer = i;
+            break;
+        }
+    }
+    if (buffer == -1) {
+        return;  // waiting for completion of writes
+    }
+    struct io_uring_sqe * const sqe = uring_get_sqe(&up->ring);
+    if (!sqe) {
+        return;
+    }
+    struct uring_request * const req = uring_port_new_request(up, URING_OP_READ, NULL, buffer);
+    req->data = up->buffers[buffer];
+    req->len = receiver_wanted_len(&up->port->rcv, up->port->buf_size);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = up->port->fd;
+    sqe->addr = (uintptr_t)req->data;
+    sqe->len = req->len;
+    sqe->user_data = (uintptr_t)req;
+    up->read_request = req;
+}
+
+
+// Handles a completion. Returns false on a port read error.
+static bool uring_port_complete(struct uring_port * up, struct uring_request * req, int res) {
+    struct port * const port = up->port;
+    bool ret = true;
+    switch (req->op) {
+        case URING_OP_READ:
+            up->read_request = NULL;
+            if (res < 0) {
+                if (res != -EAGAIN && res != -EINTR) {
+                    log_fmtmsg(LOG_ERROR, "Cannot read port \"%s\": %s", port->dev, strerror(-res));
+                    ret = false;
+                }
+            } else if (res == 0) {
+                log_fmtmsg(LOG_ERROR, "Cannot read port \"%s\": end of file", port->dev);
+                ret = false;
+            } else {
+                const unsigned int files_started = port->rcv.files_started;
+                receiver_process(&port->rcv, req->data, res);
+                port_update_deadlines(port, files_started);
+            }
+            break;
+        case URING_OP_WRITE: {
+            struct uring_file * const file = req->file;
+            --file->pending_writes;
+            if (res >= 0 && (size_t)res < req->len) {
+                // short write, the rest is written by a new request
+                struct uring_request * const rest = uring_port_new_request(up, URING_OP_WRITE, file, req->buffer);
+                rest->data = req->data + res;
+                rest->len = req->len - res;
+                rest->offset = req->offset + res;
+                if (!uring_port_submit_write(up, rest)) {
+                    uring_port_release_request(up, rest);
+                    res = -EAGAIN;
+                }
+            }
+            if (res < 0 && file->write_errno == 0) {
+                file->write_errno = -res;
+                if (file->close_requested) {
+                    log_fmtmsg(
+                        LOG_ERROR,
+                        "Cannot write to file \"%s\", the file is truncated: %s",
+                        file->storage_file_path,
+                        strerror(-res));
+                }
+            }
+            if (file->pending_writes == 0 && file->close_requested) {
+                uring_port_submit_close(up, file);
+            }
+            break;
+        }
+        case URING_OP_FSYNC:
+            if (res < 0) {
+                log_fmtmsg(
+                    LOG_ERROR, "Cannot sync file \"%s\": %s", req->file->storage_file_path, strerror(-res));
+            }
+            uring_port_submit_close(up, req->file);
+            break;
+        case URING_OP_CLOSE:
+            uring_file_closed(req->file);
+            break;
+    }
+    uring_port_release_request(up, req);
+    return ret;
+}
+
+
+// Receive loop of the port using io_uring. Reads from the port and writes to the storage are submitted
+// asynchronously, the receive loop is not blocked by the storage. A failed port is closed and reopened.
+// Returns false if io_uring cannot be used.
+static bool recv_loop_uring(struct port * port) {
+    struct uring_port up = {.port = port, .read_request = NULL, .file = NULL, .requests = 0};
+    if (!uring_init(&up.ring, 64)) {
+        return false;
+    }
+    for (int i = 0; i < URING_BUFFERS; ++i) {
+        up.buffers[i] = realloc_assert(NULL, port->buf_size);
+        up.buffer_refs[i] = 0;
+    }
+    const struct file_ops * const file_ops = port->rcv.file_ops;
+    port->rcv.file_ops = &uring_file_ops;
+    port->rcv.file_ops_ctx = &up;
+
+    while (true) {
+        const int64_t now = monotonic_ms();
+        if (port->fd == -1 && port->reopen_time <= now) {
+            port_connect(port, now);
+        }
+        int64_t deadline = services_handle_deadlines(now);
+        const int64_t port_deadline = port_handle_deadlines(port, now);
+        if (port_deadline < deadline) {
+            deadline = port_deadline;
+        }
+        if (port->fd == -1 && port->reopen_time < deadline) {
+            deadline = port->reopen_time;
+        }
+        if (!up.read_request && port->fd != -1) {
+            uring_port_submit_read(&up);
+        }
+        int timeout_ms = -1;  // timeout in miliseconds, -1 = infinite
+        if (deadline != NO_DEADLINE) {
+            timeout_ms = deadline <= now ? 0 : deadline - now > INT32_MAX ? INT32_MAX : (int)(deadline - now);
+        }
+        if (!uring_submit_and_wait(&up.ring, 1, timeout_ms)) {
+            break;
+        }
+        struct io_uring_cqe * cqe;
+        while ((cqe = uring_peek_cqe(&up.ring))) {
+            struct uring_request * const req = (struct uring_request *)(uintptr_t)cqe->user_data;
+            const int res = cqe->res;
+            uring_cqe_seen(&up.ring);
+            if (!uring_port_complete(&up, req, res)) {
+                port_disconnect(port, monotonic_ms());
+            }
+        }
+    }
+
+    // wait for the storage requests, the pending read is canceled by closing the ring
+    receiver_reset(&port->rcv);
+    const unsigned int read_requests = up.read_request ? 1 : 0;
+    while (up.requests > read_requests && uring_submit_and_wait(&up.ring, 1, -1)) {
+        struct io_uring_cqe * cqe;
+        while ((cqe = uring_peek_cqe(&up.ring))) {
+            struct uring_request * const req = (struct uring_request *)(uintptr_t)cqe->user_data;
+            const int res = cqe->res;
+            uring_cqe_seen(&up.ring);
+            uring_port_complete(&up, req, res);
+        }
+    }
+    uring_free(&up.ring);
+    if (up.read_request) {
+        free(up.read_request);
+    }
+    for (int i = 0; i < URING_BUFFERS; ++i) {
+        free(up.buffers[i]);
+    }
+    port->rcv.file_ops = file_ops;
+    port->rcv.file_ops_ctx = NULL;
+    return true;
+}
+#endif
+
+
+static void recv_loop(struct tokens tokens) {
+    for (size_t i = 0; i < port_devs_len; ++i) {
+        struct port * const port = realloc_assert(NULL, sizeof(*port));
+        if (!port_open(port, port_devs[i], tokens)) {
+            free(port);
+            goto out;
+        }
+        ports = realloc_assert(ports, (ports_len + 1) * sizeof(*ports));
+        ports[ports_len++] = port;
+    }
+    if (port_glob) {
+        port_glob_tokens = tokens;
+        if (!port_glob_init()) {
+            goto out;
+        }
+    }
+
+    bool done = false;
+#ifdef __linux__
+    // main() allows the io_uring backend only with a single serial port
+    if (io_backend == IO_BACKEND_IO_URING) {
+        struct port * const port = ports[0];
+        if (port->splice) {
+            log_msg(LOG_WARNING, "splice is not used with the io_uring backend");
+            port->splice = false;
+        }
+        if (storage_mmap) {
+            log_msg(LOG_WARNING, "Memory-mapped storage files are not used with the io_uring backend");
+        }
+        done = recv_loop_uring(port);
+        if (!done) {
+            log_msg(LOG_WARNING, "Cannot use the io_uring backend, poll is used");
+        }
+    }
+#endif
+    if (!done) {
+        recv_loop_poll();
+    }
+
+out:
+    for (size_t i = 0; i < ports_len; ++i) {
+        port_close(ports[i]);
+        free(ports[i]);
+    }
+    free(ports);
+    ports = NULL;
+    ports_len = 0;
+    if (port_glob_fd != -1) {
+        close(port_glob_fd);
+        port_glob_fd = -1;
+    }
+}
+
+
+// Collector of the relayed files (--listen).
+// Each relay connection has its own receiver, so the files are stored, indexed and hooked like the files
+// received from a port. A line "STORED <name>" or "DISCARDED <name>" is sent back when a file is finished
+// and its storage file is closed. The listening socket and the connections are served by one poll() loop.
+// A connection without data during an unfinished transfer for the intercharacter timeout is closed.
+
+struct collector_conn {
+    int fd;
+    char * peer;  // "<address>:<port>" of the relay
+    struct receiver rcv;
+    int64_t intercharacter_deadline;  // monotonic time in milliseconds or NO_DEADLINE
+    struct string acks;               // acknowledgements of the files finished by the current read
+    struct event_subscriber out;      // acknowledgements not sent yet
+};
+
+static const size_t COLLECTOR_MAX_BACKLOG = 64 * 1024;
+
+static const char * listen_address = NULL;
+static struct tee * collector_tee = NULL;  // tee shared by the relay connections or NULL
+static struct collector_conn ** collector_conns = NULL;
+static size_t collector_conns_len = 0;
+
+
+// Creates a non-blocking listening TCP socket. Returns the socket or -1 on error.
+static int tcp_listen(const char * host, const char * port) {
+    const struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE};
+    struct addrinfo * addrs;
+    const int err = getaddrinfo(host, port, &hints, &addrs);
+    if (err != 0) {
+        log_fmtmsg(LOG_ERROR, "Cannot resolve address \"%s\": %s", listen_address, gai_strerror(err));
+        return -1;
+    }
+    const int fd = socket(addrs->ai_family, addrs->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addrs->ai_protocol);
+    if (fd == -1) {
+        log_fmtmsg(LOG_ERROR, "Cannot create socket: %s", strerror(errno));
+        freeaddrinfo(addrs);
+        return -1;
+    }
+    const int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(fd, addrs->ai_addr, addrs->ai_addrlen) == -1 || listen(fd, 16) == -1) {
+        log_fmtmsg(LOG_ERROR, "Cannot listen on \"%s\": %s", listen_address, strerror(errno));
+        close(fd);
+        freeaddrinfo(addrs);
+        return -1;
+    }
+    freeaddrinfo(addrs);
+    return fd;
+}
+
+
+static void collector_file_finished(struct receiver * rcv, const char * name, bool stored) {
+    struct collector_conn * const conn = rcv->finished_ctx;
+    const char * const status = stored ? "STORED " : "DISCARDED ";
+    string_append_csubstring(&conn->acks, status, strlen(status));
+    string_append_csubstring(&conn->acks, name, strlen(name));
+    string_append_csubstring(&conn->acks, "\n", 1);
+}
+
+
+// Accepts the waiting relays.
+static void collector_accept(int listen_fd, struct tokens tokens) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd;
+    while ((fd = accept4(listen_fd, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        char host[NI_MAXHOST] = "?";
+        char port[NI_MAXSERV] = "?";
+        getnameinfo(
+            (struct sockaddr *)&addr,
+            addr_len,
+            host,
+            sizeof(host),
+            port,
+            sizeof(port),
+            NI_NUMERICHOST | NI_NUMERICSERV);
+        struct collector_conn * const conn = realloc_assert(NULL, sizeof(*conn));
+        conn->fd = fd;
+        conn->peer = sprintf_malloc("%s:%s", host, port);
+        receiver_init(&conn->rcv, tokens);
+        conn->rcv.source = conn->peer;
+        conn->rcv.payload_tee = collector_tee;
+        conn->rcv.finished = collector_file_finished;
+        conn->rcv.finished_ctx = conn;
+#ifdef __linux__
+        if (storage_mmap) {
+            conn->rcv.file_ops = &mmap_file_ops;
+        }
+#endif
+        conn->intercharacter_deadline = NO_DEADLINE;
+        string_init(&conn->acks);
+        conn->out.fd = fd;
+        conn->out.backlog = NULL;
+        conn->out.backlog_len = 0;
+        collector_conns =
+            realloc_assert(collector_conns, (collector_conns_len + 1) * sizeof(*collector_conns));
+        collector_conns[collector_conns_len++] = conn;
+        log_fmtmsg(
+            LOG_INFO, "Relay \"%s\" connected, %u relays", conn->peer, (unsigned int)collector_conns_len);
+        addr_len = sizeof(addr);
+    }
+}
+
+
+// Closes the connection. An unfinished file is aborted and removed, the relay sends it again.
+static void collector_close(size_t idx) {
+    struct collector_conn * const conn = collector_conns[idx];
+    receiver_abort(&conn->rcv);
+    close(conn->fd);
+    free(conn->acks.data);
+    free(conn->out.backlog);
+    collector_conns[idx] = collector_conns[--collector_conns_len];
+    log_fmtmsg(
+        LOG_INFO, "Relay \"%s\" disconnected, %u relays", conn->peer, (unsigned int)collector_conns_len);
+    free(conn->peer);
+    free(conn);
+}
+
+
+// Reads and processes the data of the relay and sends the acknowledgements. Returns false if the connection
+// must be closed.
+static bool collector_read(struct collector_conn * conn, char * buf, size_t buf_size) {
+    const ssize_t read_len = recv(conn->fd, buf, receiver_wanted_len(&conn->rcv, buf_size), 0);
+    if (read_len == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return true;
+        }
+        log_fmtmsg(LOG_ERROR, "Cannot receive from relay \"%s\": %s", conn->peer, strerror(errno));
+        return false;
+    }
+    if (read_len == 0) {
+        if (!receiver_idle(&conn->rcv)) {
+            log_fmtmsg(LOG_ERROR, "Connection closed by relay \"%s\", data reception not completed", conn->peer);
+        }
+        return false;
+    }
+    receiver_process(&conn->rcv, buf, read_len);
+    conn->intercharacter_deadline =
+        receiver_idle(&conn->rcv) ? NO_DEADLINE : monotonic_ms() + intercharacter_timeout_ms;
+    const bool sent = event_subscriber_send(&conn->out, conn->acks.data, conn->acks.length, COLLECTOR_MAX_BACKLOG);
+    conn->acks.length = 0;
+    return sent;
+}
+
+
+static void collector_loop(struct tokens tokens) {
+    char * host;
+    char * port;
+    if (!net_parse_address(listen_address, &host, &port)) {
+        log_fmtmsg(LOG_ERROR, "Bad listen address \"%s\"", listen_address);
+        return;
+    }
+    const int listen_fd = tcp_listen(host, port);
+    free(host);
+    free(port);
+    if (listen_fd == -1) {
+        return;
+    }
+    log_fmtmsg(LOG_INFO, "Listening on \"%s\"", listen_address);
+    char * const buf = realloc_assert(NULL, recv_buffer_size);
+    struct pollfd * fds = NULL;
+
+    while (true) {
+        const int64_t now = monotonic_ms();
+        int64_t deadline = services_handle_deadlines(now);
+        for (size_t i = 0; i < collector_conns_len;) {
+            struct collector_conn * const conn = collector_conns[i];
+            if (conn->intercharacter_deadline <= now) {
+                log_fmtmsg(LOG_ERROR, "Timeout, data reception from relay \"%s\" not completed", conn->peer);
+                collector_close(i);
+                continue;
+            }
+            if (conn->intercharacter_deadline < deadline) {
+                deadline = conn->intercharacter_deadline;
+            }
+            ++i;
+        }
+        int timeout_ms = -1;  // timeout in miliseconds, -1 = infinite
+        if (deadline != NO_DEADLINE) {
+            timeout_ms = deadline <= now ? 0 : deadline - now > INT32_MAX ? INT32_MAX : (int)(deadline - now);
+        }
+
+        fds = realloc_assert(fds, (collector_conns_len + 1) * sizeof(*fds));
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (size_t i = 0; i < collector_conns_len; ++i) {
+            fds[i + 1].fd = collector_conns[i]->fd;
+            fds[i + 1].events = collector_conns[i]->out.backlog_len > 0 ? POLLIN | POLLOUT : POLLIN;
+        }
+        const size_t fds_len = collector_conns_len + 1;
+        if (poll(fds, fds_len, timeout_ms) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_fmtmsg(LOG_ERROR, "poll: %s", strerror(errno));
+            break;
+        }
+
+        // the connections are processed from the end, a closed connection is replaced by the last one
+        for (size_t i = fds_len - 1; i > 0; --i) {
+            struct collector_conn * const conn = collector_conns[i - 1];
+            bool ok = true;
+            if ((fds[i].revents & POLLOUT) != 0) {
+                ok = event_subscriber_send(&conn->out, NULL, 0, COLLECTOR_MAX_BACKLOG);
+            }
+            if (ok && (fds[i].revents & (POLLIN | POLLERR | POLLHUP)) != 0) {
+                ok = collector_read(conn, buf, recv_buffer_size);
+            }
+            if (!ok || (fds[i].revents & POLLNVAL) != 0) {
+                collector_close(i - 1);
+            }
+        }
+        if ((fds[0].revents & POLLIN) != 0) {
+            collector_accept(listen_fd, tokens);
+        }
+    }
+
+    while (collector_conns_len > 0) {
+        collector_close(collector_conns_len - 1);
+    }
+    free(fds);
+    free(buf);
+    close(listen_fd);
+}
+
+
+static void print_help() {
+    const int LEFT_COLUMN_WIDTH = 33;
+
+    printf("CyFlowRec %s, Copyright 2024 Jaroslav Rohel <jaroslav.rohel@gmail.com>\n", CYFLOWREC_VERSION);
+    printf(
+        "CyFlowRec comes with ABSOLUTELY NO WARRANTY. This is free software\n"
+        "and you are welcome to redistribute it under the terms of the GNU GPL v2.\n\n");
+
+    printf(
+        "Usage: cyflowrec [%s] %s=<port> %s=<path> [<options>]\n"
+        "  or:  cyflowrec [%s] %s=<port> %s=<path> [<options>]\n"
+        "  or:  cyflowrec [%s] %s=[<host>]:<port> %s=<path> [<options>]\n"
+        "  or:  cyflowrec reshard %s=<path> %s=<n> [%s=<n>]\n"
+        "  or:  cyflowrec index %s <path> [%s=<path>] [%s=<n>]\n"
+        "  or:  cyflowrec query %s=<path> [%s=<path>] %s=<filter> ...\n"
+        "  or:  cyflowrec metadata %s=<path> [%s=<time>] [%s=<time>] [%s=<port>]\n\n",
+        ARG_HELP,
+        ARG_PORT_DEV,
+        ARG_STORAGE_DIR,
+        ARG_HELP,
+        ARG_PORT_DEV,
+        ARG_STORAGE_FILE_PATH,
+        ARG_HELP,
+        ARG_LISTEN,
+        ARG_STORAGE_DIR,
+        ARG_STORAGE_DIR,
+        ARG_STORAGE_SHARD_LEVELS,
+        ARG_JOBS,
+        ARG_REBUILD,
+        ARG_INDEX_FILE,
+        ARG_JOBS,
+        ARG_STORAGE_DIR,
+        ARG_INDEX_FILE,
+        ARG_MATCH,
+        ARG_METADATA_DIR,
+        ARG_FROM,
+        ARG_TO,
+        ARG_PORT_DEV);
+
+    printf(
+        "%s=<path>%*spath of the Unix domain socket where\n"
+        "%*ssubscribers receive events of the received\n"
+        "%*sfiles (a JSON object per line)\n",
+        ARG_EVENT_SOCKET,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_EVENT_SOCKET) - 7),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<type>%*svalue type of the columnar copy of the\n"
+        "%*sreceived FCS files in \"<storage_path>%s\"\n"
+        "%*s(none, float32, uint16; none by default)\n",
+        ARG_FCS_COLUMNAR,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_FCS_COLUMNAR) - 7),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        FCS_COLUMNAR_SUFFIX,
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<format>%*sformat of the preview images of the\n"
+        "%*sreceived FCS files, 1D histograms and\n"
+        "%*sdensity plot (none, pgm, png; none by\n"
+        "%*sdefault)\n",
+        ARG_FCS_PREVIEW,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_FCS_PREVIEW) - 9),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<x>,<y>%*sparameter names ($PnN) of the density\n"
+        "%*splot axes (the first two parameters\n"
+        "%*sby default)\n",
+        ARG_FCS_PREVIEW_DENSITY,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_FCS_PREVIEW_DENSITY) - 8),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<0/1>%*sdisable/enable per-parameter statistics\n"
+        "%*sof the received FCS files, they are\n"
+        "%*sstored in \"<storage_path>%s\" (0 - disable,\n"
+        "%*s1 - enable; disabled by default)\n",
+        ARG_FCS_STATS,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_FCS_STATS) - 6),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        FCS_STATS_SUFFIX,
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<time>%*sstart of the time range of the metadata\n"
+        "%*scommand (Unix time, YYYY-MM-DD or\n"
+        "%*sYYYY-MM-DDTHH:MM:SSZ)\n",
+        ARG_FROM,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_FROM) - 7),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf("%s%*sprint this help\n", ARG_HELP, (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_HELP)), "");
+    printf(
+        "%s=<path>%*sfile where the queue of the hook jobs\n"
+        "%*sis stored, the jobs are resumed on start\n"
+        "%*s(not stored by default)\n",
+        ARG_HOOK_QUEUE_FILE,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_HOOK_QUEUE_FILE) - 7),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<n>%*snumber of retries of a failed hook\n"
+        "%*s(0 - 10; %u by default)\n",
+        ARG_HOOK_RETRIES,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_HOOK_RETRIES) - 4),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        hook_retries);
+    printf(
+        "%s=<s>%*smaximum run time of a hook, then it is\n"
+        "%*skilled (0 - unlimited; %u by default)\n",
+        ARG_HOOK_TIMEOUT,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_HOOK_TIMEOUT) - 4),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        (unsigned int)(hook_timeout_ms / 1000));
+    printf(
+        "%s=<n>%*smaximum number of hooks running at once\n"
+        "%*s(1 - 64; %u by default)\n",
+        ARG_HOOK_WORKERS,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_HOOK_WORKERS) - 4),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        hook_workers);
+    printf(
+        "%s=<path>%*sindex file of the index and query commands\n"
+        "%*sand of %s\n"
+        "%*s(<dir>/%s by default)\n",
+        ARG_INDEX_FILE,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_INDEX_FILE) - 7),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        ARG_STORAGE_INDEX,
+        LEFT_COLUMN_WIDTH,
+        "",
+        INDEX_DEFAULT_NAME);
+    printf(
+        "%s=<ms>%*smaximum time without received data\n"
+        "%*sbefore the reception is terminated\n"
+        "%*s(1000 by default)\n",
+        ARG_INTERCHARACTER_TIMEOUT,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_INTERCHARACTER_TIMEOUT) - 5),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<backend>%*sI/O backend for the port and the storage\n"
+        "%*s(poll - poll() and blocking writes,\n"
+        "%*sio_uring - asynchronous I/O by io_uring,\n"
+        "%*sLinux only; poll by default)\n",
+        ARG_IO_BACKEND,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_IO_BACKEND) - 10),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<n>%*snumber of parallel jobs of the reshard\n"
+        "%*sand index commands (1 - 256; 4 by default\n"
+        "%*sfor reshard, number of CPUs for index)\n",
+        ARG_JOBS,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_JOBS) - 4),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=[<host>]:<port>%*scollector mode, files relayed by other\n"
+        "%*sinstances (%s) are received on this\n"
+        "%*sTCP address instead of a port\n",
+        ARG_LISTEN,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_LISTEN) - 16),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        ARG_RELAY_TO,
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<filter>%*sfilter of the query command, files\n"
+        "%*smatching all filters are printed:\n"
+        "%*s<keyword>=<value> - exact value\n"
+        "%*s<keyword>=<prefix>* - value prefix\n"
+        "%*s<keyword>=[<min>]..[<max>] - range,\n"
+        "%*snumbers are compared as numbers\n",
+        ARG_MATCH,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_MATCH) - 9),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<path>%*sdirectory where a metadata record of each\n"
+        "%*sreceived file is appended to time bucket\n"
+        "%*ssegments, they are compacted to day segments\n"
+        "%*s(not stored by default)\n",
+        ARG_METADATA_DIR,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_METADATA_DIR) - 7),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<s>%*stime span of a metadata bucket segment\n"
+        "%*s(1 - 86400; %u by default)\n",
+        ARG_METADATA_SEGMENT_AGE,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_METADATA_SEGMENT_AGE) - 4),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        (unsigned int)metadata_segment_age_s);
+    printf(
+        "%s=<command>%*scommand run for each received file,\n"
+        "%*sit is split into arguments at spaces,\n"
+        "%*svariables: PATH, RCV_NAME, SIZE\n",
+        ARG_ON_FILE_RECEIVED,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_ON_FILE_RECEIVED) - 10),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<0/1>%*sdisable/enable moving of the file content\n"
+        "%*sfrom the port to the storage by splice()\n"
+        "%*s(Linux only; 0 - disable, 1 - enable;\n"
+        "%*sdisabled by default)\n",
+        ARG_PAYLOAD_SPLICE,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_PAYLOAD_SPLICE) - 6),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<path>%*spath of the Unix domain socket where\n"
+        "%*sone consumer receives the content of\n"
+        "%*sthe received files during the reception,\n"
+        "%*swith several ports each port has\n"
+        "%*sits own socket <path>.<port name>\n",
+        ARG_PAYLOAD_TEE_SOCKET,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_PAYLOAD_TEE_SOCKET) - 7),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<path>%*spath to the serial port device (eg /dev/ttyS0)\n"
+        "%*sor address of a terminal server port\n"
+        "%*s%s<host>:<port> (raw TCP) or\n"
+        "%*s%s<host>:<port> (Telnet, RFC 2217);\n"
+        "%*srepeated for more ports received in parallel,\n"
+        "%*sa failed port is reopened with a growing delay\n",
+        ARG_PORT_DEV,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_PORT_DEV) - 7),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        PORT_TCP_PREFIX,
+        LEFT_COLUMN_WIDTH,
+        "",
+        PORT_RFC2217_PREFIX,
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<pattern>%*sserial port devices to be received (eg\n"
+        "%*s/dev/serial/by-id/*), a port is attached when\n"
+        "%*sa matching device appears and detached when it\n"
+        "%*sis removed; wildcards only in the file name\n",
+        ARG_PORT_GLOB,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_PORT_GLOB) - 10),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<bytes>%*ssize of the receive buffer, maximum number\n"
+        "%*sof bytes processed at once (%u - %u;\n"
+        "%*s%u by default)\n",
+        ARG_RECV_BUFFER_SIZE,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_RECV_BUFFER_SIZE) - 8),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        (unsigned int)MIN_RECV_BUFFER_SIZE,
+        (unsigned int)MAX_RECV_BUFFER_SIZE,
+        LEFT_COLUMN_WIDTH,
+        "",
+        (unsigned int)recv_buffer_size);
+    printf(
+        "%s <path>%*sdirectory tree indexed by the index command,\n"
+        "%*sthe index of its FCS files is rebuilt\n",
+        ARG_REBUILD,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_REBUILD) - 7),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<path>%*sfile where the queue of the files waiting\n"
+        "%*sfor the collector is stored, the relay is\n"
+        "%*sresumed on start (required by %s)\n",
+        ARG_RELAY_QUEUE_FILE,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_RELAY_QUEUE_FILE) - 7),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        ARG_RELAY_TO);
+    printf(
+        "%s=<host>:<port>%*sforward the received files to the collector\n"
+        "%*s(%s) over a persistent TCP connection\n",
+        ARG_RELAY_TO,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_RELAY_TO) - 14),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        ARG_LISTEN);
+    printf(
+        "%s=<0/1>%*sdisable/enable searching for the next file\n"
+        "%*sheader in the data discarded after an error\n"
+        "%*s(0 - disable, 1 - enable; enabled by default)\n",
+        ARG_RESYNC,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_RESYNC) - 6),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<path>%*spath to the spool directory (eg on tmpfs),\n"
+        "%*sreceived files are stored there and moved\n"
+        "%*sto the storage in batches\n",
+        ARG_SPOOL_DIR,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_SPOOL_DIR) - 7),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<s>%*sage of the oldest spooled file which starts\n"
+        "%*sthe move to the storage (%u by default)\n",
+        ARG_SPOOL_FLUSH_AGE,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_SPOOL_FLUSH_AGE) - 4),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        (unsigned int)(spool_flush_age_ms / 1000));
+    printf(
+        "%s=<bytes>%*ssize of the spooled files which starts\n"
+        "%*sthe move to the storage (%u by default)\n",
+        ARG_SPOOL_FLUSH_SIZE,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_SPOOL_FLUSH_SIZE) - 8),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        (unsigned int)spool_flush_size);
+    printf(
+        "%s=<bytes>%*smaximum size of the spool, files which\n"
+        "%*sdo not fit are stored directly\n"
+        "%*s(%u by default)\n",
+        ARG_SPOOL_SIZE,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_SPOOL_SIZE) - 8),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        (unsigned int)spool_size);
+    printf(
+        "%s=<path>%*sdirectory where the files evicted by\n"
+        "%*sthe quota are moved (on the file system\n"
+        "%*sof the storage; removed by default)\n",
+        ARG_STORAGE_ARCHIVE_DIR,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_STORAGE_ARCHIVE_DIR) - 7),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<0/1>%*sdisable/enable the creation of missing\n"
+        "%*sdirectories in the storage path\n"
+        "%*s(0 - disable, 1 - enable; disabled by default)\n",
+        ARG_STORAGE_CREATE_DIRS,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_STORAGE_CREATE_DIRS) - 6),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<path>%*spath to the storage directory\n",
+        ARG_STORAGE_DIR,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_STORAGE_DIR) - 7),
+        "");
+    printf(
+        "%s=<policy>%*swhat to do if a file with the given name\n"
+        "%*salready exists in the storage\n"
+        "%*s(drop - drop the received file, replace -\n"
+        "%*sreplace the file in storage with\n"
+        "%*sthe received one; replace by default)\n",
+        ARG_STORAGE_FILE_EXISTS,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_STORAGE_FILE_EXISTS) - 9),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<path>%*spath to the storage file\n"
+        "%*svariable substitution is performed\n"
+        "%*svariable format ${<var_name>}\n"
+        "%*svariables: DATE_YEAR, DATE_MONTH, DATE_DAY,\n"
+        "%*s  TIME_HOUR, TIME_MIN, TIME_SEC, RCV_NAME\n",
+        ARG_STORAGE_FILE_PATH,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_STORAGE_FILE_PATH) - 7),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<0/1>%*sdisable/enable adding of the saved FCS\n"
+        "%*sfiles to the journal of the index\n"
+        "%*s%s or <storage_dir>/%s\n"
+        "%*s(0 - disable, 1 - enable; disabled\n"
+        "%*sby default)\n",
+        ARG_STORAGE_INDEX,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_STORAGE_INDEX) - 6),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        ARG_INDEX_FILE,
+        INDEX_DEFAULT_NAME,
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<0/1>%*sdisable/enable storing of the file content\n"
+        "%*sinto the storage file mapped to memory,\n"
+        "%*sthe file is allocated to the announced size\n"
+        "%*s(Linux only; 0 - disable, 1 - enable;\n"
+        "%*sdisabled by default)\n",
+        ARG_STORAGE_MMAP,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_STORAGE_MMAP) - 6),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<bytes>%*smaximum size of the files in the storage,\n"
+        "%*sthe oldest files are evicted to make space\n"
+        "%*sfor a received file (0 - unlimited; 0 by default)\n",
+        ARG_STORAGE_QUOTA,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_STORAGE_QUOTA) - 8),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<low>,<high>\n"
+        "%*swhen the storage usage exceeds <high> percent\n"
+        "%*sof the quota, the oldest files are evicted\n"
+        "%*suntil it drops to <low> percent (80,90 by default)\n",
+        ARG_STORAGE_QUOTA_WATERMARKS,
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<n>%*snumber of shard directory levels\n"
+        "%*sin the storage directory, each level has\n"
+        "%*sup to 256 directories named by the hash\n"
+        "%*sof the file name (0 - 3; 0 by default)\n",
+        ARG_STORAGE_SHARD_LEVELS,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_STORAGE_SHARD_LEVELS) - 4),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<0/1>%*sdisable/enable syncing of the storage file\n"
+        "%*sto the storage device when it is closed\n"
+        "%*s(0 - disable, 1 - enable; disabled by default)\n",
+        ARG_STORAGE_SYNC,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_STORAGE_SYNC) - 6),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+    printf(
+        "%s=<time>%*send of the time range of the metadata\n"
+        "%*scommand (see %s)\n",
+        ARG_TO,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_TO) - 7),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "",
+        ARG_FROM);
+    printf(
+        "%s=<ms>%*smaximum time of receiving one file\n"
+        "%*s(0 - unlimited; 0 by default)\n",
+        ARG_TRANSFER_TIMEOUT,
+        (int)(LEFT_COLUMN_WIDTH - sizeof(ARG_TRANSFER_TIMEOUT) - 5),
+        "",
+        LEFT_COLUMN_WIDTH,
+        "");
+}
+
+
+// If the argument `arg_name` is found at position `idx` its value is stored into `value`
+// and the function returns true. If an error occurs, the function returns false.
+// If `idx` points after the arguments, or there is another argument at that position,
+// the function does nothing and returns true.
+static bool arg_parse_value(int argc, char * argv[], int * idx, const char * arg_name, const char ** value) {
+    if (*idx >= argc) {
+        return true;
+    }
+    const char * const arg = argv[*idx];
+    const size_t arg_len = strlen(arg_name);
+    if (strncmp(arg, arg_name, arg_len) == 0) {
+        switch (arg[arg_len]) {
+            case '\0':
+                if (++*idx == argc) {
+                    fprintf(stderr, "Missing value for argument %s\n", arg);
+                    return false;
+                }
+                *value = argv[*idx];
+                break;
+            case '=':
+                *value = arg + arg_len + 1;
+                break;
+            default:
+                return true;
+        }
+    } else {
+        return true;
+    }
+    ++*idx;
+    return true;
+}
+
+
+// Moves the files of the job from the flat storage directory to the shard directories.
+// Returns the number of files which could not be moved.
+static unsigned int reshard_job(const char * dir_path, unsigned int job, unsigned int jobs) {
+    DIR * const dir = opendir(dir_path);
+    if (!dir) {
+        log_fmtmsg(LOG_ERROR, "Cannot open storage directory \"%s\": %s", dir_path, strerror(errno));
+        return 1;
+    }
+    unsigned int moved = 0;
+    unsigned int errors = 0;
+    struct dirent * entry;
+    while ((entry = readdir(dir))) {
+        if (fnv1a_hash(entry->d_name) % jobs != job ||
+            strncmp(entry->d_name, INDEX_DEFAULT_NAME, sizeof(INDEX_DEFAULT_NAME) - 1) == 0) {
+            continue;
+        }
+        char * const path = sprintf_malloc("%s/%s", dir_path, entry->d_name);
+        struct stat st;
+        if (lstat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+            free(path);
+            continue;
+        }
+        char * const shard_path = shard_file_path(dir_path, entry->d_name, storage_shard_levels);
+        if (!mkdirs(shard_path)) {
+            ++errors;
+        } else if (access(shard_path, F_OK) == 0) {
+            log_fmtmsg(LOG_WARNING, "The file \"%s\" already exists, \"%s\" is not moved", shard_path, path);
+            ++errors;
+        } else if (rename(path, shard_path) == -1) {
+            log_fmtmsg(LOG_ERROR, "Cannot move file \"%s\" to \"%s\": %s", path, shard_path, strerror(errno));
+            ++errors;
+        } else {
+            ++moved;
+        }
+        free(shard_path);
+        free(path);
+    }
+    closedir(dir);
+    log_fmtmsg(LOG_INFO, "Job %u moved %u files", job, moved);
+    return errors;
+}
+
+
+// cyflowrec reshard --storage-dir=<path> --storage-shard-levels=<n> [--jobs=<n>]
+// Moves the files of a flat storage directory to the shard directories. The files are distributed
+// among the job processes by the hash of their names.
+static int reshard_main(int argc, char * argv[]) {
+    bool args_error = false;
+    const char * shard_levels = NULL;
+    const char * jobs_arg = NULL;
+    unsigned int jobs = 4;
+
+    for (int i = 1; i < argc;) {
+        const int parsed_idx = i;
+        if (!arg_parse_value(argc, argv, &i, ARG_STORAGE_DIR, &storage_dir)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_STORAGE_SHARD_LEVELS, &shard_levels)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_JOBS, &jobs_arg)) {
+            return 1;
+        }
+        if (i == parsed_idx) {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            args_error = true;
+            break;
+        }
+    }
+
+    if (!storage_dir) {
+        fprintf(stderr, "Missing %s=<path> argument\n", ARG_STORAGE_DIR);
+        args_error = true;
+    }
+    size_t value;
+    if (!shard_levels) {
+        fprintf(stderr, "Missing %s=<n> argument\n", ARG_STORAGE_SHARD_LEVELS);
+        args_error = true;
+    } else if (!parse_size(shard_levels, &value) || value == 0 || value > MAX_STORAGE_SHARD_LEVELS) {
+        fprintf(stderr, "Bad value for argument %s: %s\n", ARG_STORAGE_SHARD_LEVELS, shard_levels);
+        args_error = true;
+    } else {
+        storage_shard_levels = value;
+    }
+    if (jobs_arg) {
+        if (!parse_size(jobs_arg, &value) || value == 0 || value > 256) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_JOBS, jobs_arg);
+            args_error = true;
+        } else {
+            jobs = value;
+        }
+    }
+    if (args_error) {
+        fprintf(stderr, "Add \"--help\" for more information about the arguments.\n");
+        return 1;
+    }
+
+    bool failed = false;
+    fflush(stdout);
+    unsigned int started = 0;
+    for (unsigned int job = 0; job < jobs; ++job) {
+        const pid_t pid = fork();
+        if (pid == 0) {
+            const unsigned int errors = reshard_job(storage_dir, job, jobs);
+            fflush(stdout);
+            _exit(errors > 0 ? 1 : 0);
+        }
+        if (pid == -1) {
+            log_fmtmsg(LOG_WARNING, "Cannot create job process, the job is run directly: %s", strerror(errno));
+            if (reshard_job(storage_dir, job, jobs) > 0) {
+                failed = true;
+            }
+        } else {
+            ++started;
+        }
+    }
+    int status;
+    while (started > 0 && wait(&status) != -1) {
+        --started;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed = true;
+        }
+    }
+    return failed ? 1 : 0;
+}
+
+
+// Number of file indexes passed to a job at once. The batch is written to the queue pipe atomically.
+#define INDEX_QUEUE_BATCH 16
+
+static struct index_entry * index_entries = NULL;
+static size_t index_entries_len = 0;
+
+
+// Returns true if the file name is not a sidecar file and not hidden.
+static bool index_file_wanted(const char * name) {
+    return name[0] != '.' && sidecar_suffix_len(name) == 0;
+}
+
+
+static void index_scan_dir(const char * dir_path, const char * rel_path) {
+    DIR * const dir = opendir(dir_path);
+    if (!dir) {
+        log_fmtmsg(LOG_WARNING, "Cannot open directory \"%s\": %s", dir_path, strerror(errno));
+        return;
+    }
+    struct dirent * entry;
+    while ((entry = readdir(dir))) {
+        if (!index_file_wanted(entry->d_name)) {
+            continue;
+        }
+        char * const path = sprintf_malloc("%s/%s", dir_path, entry->d_name);
+        char * const entry_rel_path =
+            rel_path ? sprintf_malloc("%s/%s", rel_path, entry->d_name) : my_strdup(entry->d_name);
+        struct stat st;
+        const bool stat_ok = lstat(path, &st) == 0;
+        if (stat_ok && S_ISDIR(st.st_mode)) {
+            index_scan_dir(path, entry_rel_path);
+            free(entry_rel_path);
+        } else if (stat_ok && S_ISREG(st.st_mode)) {
+            index_entries = realloc_assert(index_entries, (index_entries_len + 1) * sizeof(*index_entries));
+            index_entries[index_entries_len].path = entry_rel_path;
+            index_entries[index_entries_len].size = st.st_size;
+            index_entries[index_entries_len].mtime = st.st_mtime;
+            ++index_entries_len;
+        } else {
+            free(entry_rel_path);
+        }
+        free(path);
+    }
+    closedir(dir);
+}
+
+
+// Indexes the files taken from the queue pipe, or all files if `queue_fd` is -1. The lines are written
+// to `part_path`. Returns the number of errors.
+static unsigned int index_job(const char * dir_path, unsigned int job, int queue_fd, const char * part_path) {
+    FILE * const out = fopen(part_path, "w");
+    if (!out) {
+        log_fmtmsg(LOG_ERROR, "Cannot create file \"%s\": %s", part_path, strerror(errno));
+        return 1;
+    }
+    unsigned int indexed = 0;
+    unsigned int skipped = 0;
+    size_t next = 0;
+    while (true) {
+        uint32_t batch[INDEX_QUEUE_BATCH];
+        size_t batch_len = 0;
+        if (queue_fd == -1) {
+            while (batch_len < INDEX_QUEUE_BATCH && next < index_entries_len) {
+                batch[batch_len++] = next++;
+            }
+        } else {
+            const ssize_t read_len = read(queue_fd, batch, sizeof(batch));
+            if (read_len == -1 && errno == EINTR) {
+                continue;
+            }
+            batch_len = read_len == sizeof(batch) ? INDEX_QUEUE_BATCH : 0;
+        }
+        if (batch_len == 0) {
+            break;
+        }
+        for (size_t i = 0; i < batch_len && batch[i] != UINT32_MAX; ++i) {
+            if (index_file(dir_path, &index_entries[batch[i]], out)) {
+                ++indexed;
+            } else {
+                ++skipped;
+            }
+        }
+    }
+    if (fclose(out) != 0) {
+        log_fmtmsg(LOG_ERROR, "Cannot write file \"%s\": %s", part_path, strerror(errno));
+        return 1;
+    }
+    log_fmtmsg(LOG_INFO, "Job %u indexed %u files, %u files are not FCS files", job, indexed, skipped);
+    return 0;
+}
+
+
+static int index_line_cmp(const void * a, const void * b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+// Converts the keyword to upper case, escape sequences are kept.
+static void index_upper_key(char * key) {
+    for (char * ch = key; *ch != '\0'; ++ch) {
+        if (*ch == '\\' && ch[1] != '\0') {
+            ++ch;
+        } else {
+            *ch = toupper((unsigned char)*ch);
+        }
+    }
+}
+
+
+// Writes the sorted lines to the file through a temporary file.
+static bool index_write_lines(const char * path, char ** lines, size_t lines_len) {
+    char * const tmp_path = sprintf_malloc("%s.tmp", path);
+    FILE * const out = fopen(tmp_path, "w");
+    if (out) {
+        fprintf(out, "%s\n", INDEX_MAGIC);
+        for (size_t i = 0; i < lines_len; ++i) {
+            fputs(lines[i], out);
+        }
+    }
+    const bool ok = out && fclose(out) == 0 && rename(tmp_path, path) == 0;
+    if (!ok) {
+        log_fmtmsg(LOG_ERROR, "Cannot write index file \"%s\": %s", path, strerror(errno));
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    return ok;
+}
+
+
+// Writes the inverted index of the sorted index lines.
+static bool index_write_keys(const char * index_path, char ** lines, size_t lines_len) {
+    char ** keys = NULL;
+    size_t keys_len = 0;
+    for (size_t i = 0; i < lines_len; ++i) {
+        char * const line = my_strdup(lines[i]);
+        char * fields = line;
+        fields[strcspn(fields, "\n")] = '\0';
+        const char * const path = strsep(&fields, "\t");
+        strsep(&fields, "\t");  // size
+        strsep(&fields, "\t");  // mtime
+        char * key;
+        const char * value;
+        while ((key = strsep(&fields, "\t")) && (value = strsep(&fields, "\t"))) {
+            index_upper_key(key);
+            keys = realloc_assert(keys, (keys_len + 1) * sizeof(*keys));
+            keys[keys_len++] = sprintf_malloc("%s\t%s\t%s\n", key, value, path);
+        }
+        free(line);
+    }
+    qsort(keys, keys_len, sizeof(*keys), index_line_cmp);
+    char * const keys_path = sprintf_malloc("%s%s", index_path, INDEX_KEYS_SUFFIX);
+    const bool ok = index_write_lines(keys_path, keys, keys_len);
+    free(keys_path);
+    for (size_t i = 0; i < keys_len; ++i) {
+        free(keys[i]);
+    }
+    free(keys);
+    return ok;
+}
+
+
+// Merges the job outputs to the sorted index file and writes the inverted index. The part files are removed.
+static bool index_merge(const char * index_path, char ** part_paths, unsigned int parts) {
+    char ** lines = NULL;
+    size_t lines_len = 0;
+    bool ok = true;
+    for (unsigned int i = 0; i < parts; ++i) {
+        FILE * const part = fopen(part_paths[i], "r");
+        if (!part) {
+            log_fmtmsg(LOG_ERROR, "Cannot open file \"%s\": %s", part_paths[i], strerror(errno));
+            ok = false;
+            continue;
+        }
+        char * line = NULL;
+        size_t line_size = 0;
+        while (getline(&line, &line_size, part) != -1) {
+            lines = realloc_assert(lines, (lines_len + 1) * sizeof(*lines));
+            lines[lines_len++] = my_strdup(line);
+        }
+        free(line);
+        fclose(part);
+        unlink(part_paths[i]);
+    }
+    if (ok) {
+        qsort(lines, lines_len, sizeof(*lines), index_line_cmp);
+        ok = index_write_keys(index_path, lines, lines_len) && index_write_lines(index_path, lines, lines_len);
+        if (ok) {
+            log_fmtmsg(LOG_INFO, "Index \"%s\" with %u files was written", index_path, (unsigned int)lines_len);
+        }
+    }
+    for (size_t i = 0; i < lines_len; ++i) {
+        free(lines[i]);
+    }
+    free(lines);
+    return ok;
+}
+
+
+// Passes the indexes of all files to the jobs in batches and closes the queue.
+static void index_feed_queue(int queue_fd) {
+    for (size_t first = 0; first < index_entries_len; first += INDEX_QUEUE_BATCH) {
+        uint32_t batch[INDEX_QUEUE_BATCH];
+        for (size_t i = 0; i < INDEX_QUEUE_BATCH; ++i) {
+            batch[i] = first + i < index_entries_len ? first + i : UINT32_MAX;
+        }
+        ssize_t written;
+        while ((written = write(queue_fd, batch, sizeof(batch))) == -1 && errno == EINTR) {
+        }
+        if (written != sizeof(batch)) {
+            log_fmtmsg(LOG_ERROR, "Cannot pass files to the jobs: %s", strerror(errno));
+            break;
+        }
+    }
+    close(queue_fd);
+}
+
+
+// cyflowrec index --rebuild <dir> [--index-file=<path>] [--jobs=<n>]
+// Creates the metadata index of the FCS files in the directory tree. The tree is scanned first, then
+// the files are parsed by the job processes. A job takes the next batch of files from a shared pipe when
+// it is done with the previous one, so the jobs stay busy until all files are indexed.
+static int index_main(int argc, char * argv[]) {
+    bool args_error = false;
+    const char * dir_path = NULL;
+    const char * jobs_arg = NULL;
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int jobs = cpus > 0 ? cpus : 1;
+
+    for (int i = 1; i < argc;) {
+        const int parsed_idx = i;
+        if (!arg_parse_value(argc, argv, &i, ARG_REBUILD, &dir_path)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_INDEX_FILE, &index_file_path)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_JOBS, &jobs_arg)) {
+            return 1;
+        }
+        if (i == parsed_idx) {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            args_error = true;
+            break;
+        }
+    }
+
+    if (!dir_path) {
+        fprintf(stderr, "Missing %s <path> argument\n", ARG_REBUILD);
+        args_error = true;
+    }
+    size_t value;
+    if (jobs_arg) {
+        if (!parse_size(jobs_arg, &value) || value == 0 || value > 256) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_JOBS, jobs_arg);
+            args_error = true;
+        } else {
+            jobs = value;
+        }
+    }
+    if (args_error) {
+        fprintf(stderr, "Add \"--help\" for more information about the arguments.\n");
+        return 1;
+    }
+
+    char * const index_path = index_path_get(dir_path);
+    // Files saved during the scan are appended to a new journal. The old one is kept until the index
+    // is written. If it remained from a failed rebuild, it is kept as is.
+    char * const log_path = sprintf_malloc("%s%s", index_path, INDEX_LOG_SUFFIX);
+    char * const old_log_path = sprintf_malloc("%s%s", index_path, INDEX_OLD_LOG_SUFFIX);
+    if (access(old_log_path, F_OK) == -1 && rename(log_path, old_log_path) == -1 && errno != ENOENT) {
+        log_fmtmsg(LOG_WARNING, "Cannot move index journal \"%s\": %s", log_path, strerror(errno));
+    }
+    index_scan_dir(dir_path, NULL);
+    log_fmtmsg(LOG_INFO, "Found %u files in \"%s\"", (unsigned int)index_entries_len, dir_path);
+    if (index_entries_len < (size_t)jobs * INDEX_QUEUE_BATCH) {
+        jobs = (index_entries_len + INDEX_QUEUE_BATCH - 1) / INDEX_QUEUE_BATCH;
+        jobs = jobs > 0 ? jobs : 1;
+    }
+
+    char ** const part_paths = realloc_assert(NULL, jobs * sizeof(*part_paths));
+    for (unsigned int job = 0; job < jobs; ++job) {
+        part_paths[job] = sprintf_malloc("%s.part%u", index_path, job);
+    }
+    bool failed = false;
+    int queue_fds[2] = {-1, -1};
+    if (jobs > 1 && pipe(queue_fds) == -1) {
+        log_fmtmsg(LOG_WARNING, "Cannot create job queue, files are indexed by one process: %s", strerror(errno));
+    }
+    unsigned int started = 0;
+    if (queue_fds[0] != -1) {
+        signal(SIGPIPE, SIG_IGN);
+        fflush(stdout);
+        for (unsigned int job = 0; job < jobs; ++job) {
+            const pid_t pid = fork();
+            if (pid == 0) {
+                close(queue_fds[1]);
+                const unsigned int errors = index_job(dir_path, job, queue_fds[0], part_paths[job]);
+                fflush(stdout);
+                _exit(errors > 0 ? 1 : 0);
+            }
+            if (pid == -1) {
+                log_fmtmsg(LOG_WARNING, "Cannot create job process: %s", strerror(errno));
+                break;
+            }
+            ++started;
+        }
+        close(queue_fds[0]);
+        if (started > 0) {
+            index_feed_queue(queue_fds[1]);
+        } else {
+            close(queue_fds[1]);
+        }
+    }
+    if (started == 0) {
+        failed = index_job(dir_path, 0, -1, part_paths[0]) > 0;
+        started = 1;
+    } else {
+        int status;
+        for (unsigned int running = started; running > 0 && wait(&status) != -1; --running) {
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                failed = true;
+            }
+        }
+    }
+    if (!failed && !index_merge(index_path, part_paths, started)) {
+        failed = true;
+    }
+    if (!failed) {
+        unlink(old_log_path);
+    }
+    free(log_path);
+    free(old_log_path);
+
+    // the part files are not merged when a job failed
+    for (unsigned int job = 0; job < jobs; ++job) {
+        if (failed && unlink(part_paths[job]) == -1 && errno != ENOENT) {
+            log_fmtmsg(LOG_WARNING, "Cannot remove file \"%s\": %s", part_paths[job], strerror(errno));
+        }
+        free(part_paths[job]);
+    }
+    free(part_paths);
+    free(index_path);
+    return failed ? 1 : 0;
+}
+
+
+enum query_type { QUERY_EXACT, QUERY_PREFIX, QUERY_RANGE };
+
+// Filter of the query command. The keyword and the values are escaped as in the index.
+struct query_filter {
+    enum query_type type;
+    char * key;    // upper case
+    char * value;  // exact value or prefix
+    char * min;    // lower bound of the range or NULL
+    char * max;    // upper bound of the range or NULL
+    bool numeric;  // the bounds are numbers, the values are compared as numbers
+    char ** paths;  // matching files of the index, sorted
+    size_t paths_len;
+};
+
+// Journal record of the query command
+struct query_record {
+    char * path;
+    char * fields;  // keyword and value pairs, NULL if the file was removed
+    size_t seq;     // order in the journal
+};
+
+
+static char * index_escape(const char * str) {
+    char * escaped = NULL;
+    size_t escaped_len = 0;
+    FILE * const out = open_memstream(&escaped, &escaped_len);
+    if (!out) {
+        perror("index_escape: open_memstream");
+        abort();
+    }
+    index_write_field(out, str);
+    fclose(out);
+    return escaped;
+}
+
+
+// Unescapes the field in place.
+static void index_unescape(char * str) {
+    char * dst = str;
+    for (const char * src = str; *src != '\0'; ++src) {
+        if (*src == '\\' && src[1] != '\0') {
+            ++src;
+            *dst++ = *src == 't' ? '\t' : *src == 'n' ? '\n' : *src;
+        } else {
+            *dst++ = *src;
+        }
+    }
+    *dst = '\0';
+}
+
+
+static bool query_parse_number(const char * str, double * value) {
+    char * end;
+    errno = 0;
+    *value = strtod(str, &end);
+    return end != str && *end == '\0' && errno == 0;
+}
+
+
+// Parses the filter <KEYWORD>=<value>, <KEYWORD>=<prefix>* or <KEYWORD>=[<min>]..[<max>].
+static bool query_parse_filter(const char * arg, struct query_filter * filter) {
+    memset(filter, 0, sizeof(*filter));
+    const char * const sep = strchr(arg, '=');
+    if (!sep || sep == arg) {
+        return false;
+    }
+    char * const key = strndup(arg, sep - arg);
+    filter->key = index_escape(key);
+    free(key);
+    index_upper_key(filter->key);
+    const char * const value = sep + 1;
+    const size_t value_len = strlen(value);
+    const char * const range = strstr(value, "..");
+    if (range) {
+        filter->type = QUERY_RANGE;
+        char * const min = strndup(value, range - value);
+        double number;
+        filter->numeric = true;
+        if (*min != '\0') {
+            filter->min = index_escape(min);
+            filter->numeric = query_parse_number(min, &number);
+        }
+        if (range[2] != '\0') {
+            filter->max = index_escape(range + 2);
+            filter->numeric = filter->numeric && query_parse_number(range + 2, &number);
+        }
+        free(min);
+    } else if (value_len > 0 && value[value_len - 1] == '*') {
+        filter->type = QUERY_PREFIX;
+        char * const prefix = strndup(value, value_len - 1);
+        filter->value = index_escape(prefix);
+        free(prefix);
+    } else {
+        filter->type = QUERY_EXACT;
+        filter->value = index_escape(value);
+    }
+    return true;
+}
+
+
+// Returns true if the escaped value matches the filter.
+static bool query_value_matches(const struct query_filter * filter, const char * value) {
+    switch (filter->type) {
+        case QUERY_EXACT:
+            return strcmp(value, filter->value) == 0;
+        case QUERY_PREFIX:
+            return strncmp(value, filter->value, strlen(filter->value)) == 0;
+        case QUERY_RANGE:
+            break;
+    }
+    double number, bound;
+    if (filter->numeric && query_parse_number(value, &number)) {
+        return (!filter->min || (query_parse_number(filter->min, &bound) && number >= bound)) &&
+               (!filter->max || (query_parse_number(filter->max, &bound) && number <= bound));
+    }
+    return (!filter->min || strcmp(value, filter->min) >= 0) && (!filter->max || strcmp(value, filter->max) <= 0);
+}
+
+
+// Compares the line at `line` (terminated by '\n') with the string.
+static int query_line_cmp(const char * line, const char * str) {
+    for (; *line != '\n' && *str != '\0'; ++line, ++str) {
+        if (*line != *str) {
+            return (unsigned char)*line - (unsigned char)*str;
+        }
+    }
+    return *line == '\n' ? (*str == '\0' ? 0 : -1) : 1;
+}
+
+
+// Returns the offset of the first line in data[lo, hi) which is not less than `key`. The lines are sorted,
+// `lo` is the start of a line and the data end with '\n'.
+static size_t query_lower_bound(const char * data, size_t lo, size_t hi, const char * key) {
+    while (lo < hi) {
+        size_t line = lo + (hi - lo) / 2;
+        while (line > lo && data[line - 1] != '\n') {
+            --line;
+        }
+        if (query_line_cmp(data + line, key) < 0) {
+            lo = (const char *)memchr(data + line, '\n', hi - line) - data + 1;
+        } else {
+            hi = line;
+        }
+    }
+    return lo;
+}
+
+
+// Finds the files matching the filter in the mapped inverted index.
+static void query_keys(struct query_filter * filter, const char * data, size_t begin, size_t len) {
+    char * const key_prefix = sprintf_malloc("%s\t", filter->key);
+    const size_t key_prefix_len = strlen(key_prefix);
+    char * const start = sprintf_malloc(
+        "%s%s",
+        key_prefix,
+        filter->type != QUERY_RANGE ? filter->value : filter->min && !filter->numeric ? filter->min : "");
+    size_t pos = query_lower_bound(data, begin, len, start);
+    while (pos < len && strncmp(data + pos, key_prefix, key_prefix_len) == 0) {
+        const char * const line_end = memchr(data + pos, '\n', len - pos);
+        const char * const value = data + pos + key_prefix_len;
+        const char * const value_end = memchr(value, '\t', line_end - value);
+        if (!value_end) {
+            break;
+        }
+        char * const value_str = strndup(value, value_end - value);
+        const bool matches = query_value_matches(filter, value_str);
+        // The values are sorted, so there are no more matches after the first mismatch except for
+        // a numeric range and the values under the lower bound of a lexical range.
+        const bool done = !matches && (filter->type != QUERY_RANGE ||
+                                       (!filter->numeric && filter->max && strcmp(value_str, filter->max) > 0));
+        free(value_str);
+        if (done) {
+            break;
+        }
+        if (matches) {
+            filter->paths = realloc_assert(filter->paths, (filter->paths_len + 1) * sizeof(*filter->paths));
+            filter->paths[filter->paths_len++] = strndup(value_end + 1, line_end - value_end - 1);
+        }
+        pos = line_end - data + 1;
+    }
+    qsort(filter->paths, filter->paths_len, sizeof(*filter->paths), index_line_cmp);
+    free(start);
+    free(key_prefix);
+}
+
+
+// Searches the inverted index for the files matching each filter. A missing index is treated as empty.
+// The query command prints the errors to stderr, the standard output is the list of the files.
+static bool query_index(const char * index_path, struct query_filter * filters, size_t filters_len) {
+    char * const keys_path = sprintf_malloc("%s%s", index_path, INDEX_KEYS_SUFFIX);
+    const int fd = open(keys_path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        const bool missing = errno == ENOENT;
+        fprintf(stderr, "Cannot open index file \"%s\": %s\n", keys_path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        free(keys_path);
+        return missing;
+    }
+    const size_t len = st.st_size;
+    const char * const data = len > 0 ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    const size_t magic_len = sizeof(INDEX_MAGIC) - 1;
+    if (data == MAP_FAILED || len <= magic_len || memcmp(data, INDEX_MAGIC, magic_len) != 0 ||
+        data[magic_len] != '\n' || data[len - 1] != '\n') {
+        fprintf(stderr, "Invalid index file \"%s\"\n", keys_path);
+        if (data && data != MAP_FAILED) {
+            munmap((void *)data, len);
+        }
+        free(keys_path);
+        return false;
+    }
+    for (size_t i = 0; i < filters_len; ++i) {
+        query_keys(&filters[i], data, magic_len + 1, len);
+    }
+    munmap((void *)data, len);
+    free(keys_path);
+    return true;
+}
+
+
+// Reads the records of the journal. A missing journal is not an error.
+static void query_read_journal(const char * log_path, struct query_record ** records, size_t * records_len) {
+    FILE * const file = fopen(log_path, "r");
+    if (!file) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Cannot open index journal \"%s\": %s\n", log_path, strerror(errno));
+        }
+        return;
+    }
+    char * line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, file) != -1) {
+        line[strcspn(line, "\n")] = '\0';
+        char * fields = line;
+        const char * const path = strsep(&fields, "\t");
+        if (*path == '\0') {
+            continue;
+        }
+        if (fields) {
+            strsep(&fields, "\t");  // size
+            strsep(&fields, "\t");  // mtime
+        }
+        *records = realloc_assert(*records, (*records_len + 1) * sizeof(**records));
+        struct query_record * const record = &(*records)[*records_len];
+        record->path = my_strdup(path);
+        record->fields = fields ? my_strdup(fields) : NULL;
+        record->seq = (*records_len)++;
+    }
+    free(line);
+    fclose(file);
+}
+
+
+static int query_record_cmp(const void * a, const void * b) {
+    const struct query_record * const a_rec = a;
+    const struct query_record * const b_rec = b;
+    const int cmp = strcmp(a_rec->path, b_rec->path);
+    return cmp != 0 ? cmp : a_rec->seq < b_rec->seq ? -1 : a_rec->seq > b_rec->seq;
+}
+
+
+// Returns true if the keywords of the journal record match all filters.
+static bool query_record_matches(
+    const struct query_record * record, const struct query_filter * filters, size_t filters_len) {
+    for (size_t i = 0; i < filters_len; ++i) {
+        char * const line = my_strdup(record->fields);
+        char * fields = line;
+        bool matches = false;
+        const char * key;
+        const char * value;
+        while (!matches && (key = strsep(&fields, "\t")) && (value = strsep(&fields, "\t"))) {
+            matches = strcasecmp(key, filters[i].key) == 0 && query_value_matches(&filters[i], value);
+        }
+        free(line);
+        if (!matches) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static bool query_path_in(char * const * paths, size_t paths_len, const char * path) {
+    return bsearch(&path, paths, paths_len, sizeof(*paths), index_line_cmp) != NULL;
+}
+
+
+// cyflowrec query --storage-dir=<path> [--index-file=<path>] --match=<filter> [--match=<filter> ...]
+// Prints the paths of the files matching all filters. The inverted index is searched by a binary
+// search, the journal of the files saved since the index was built is read whole.
+static int query_main(int argc, char * argv[]) {
+    bool args_error = false;
+    struct query_filter * filters = NULL;
+    size_t filters_len = 0;
+
+    for (int i = 1; i < argc;) {
+        const int parsed_idx = i;
+        if (!arg_parse_value(argc, argv, &i, ARG_STORAGE_DIR, &storage_dir)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_INDEX_FILE, &index_file_path)) {
+            return 1;
+        }
+        const char * match = NULL;
+        if (!arg_parse_value(argc, argv, &i, ARG_MATCH, &match)) {
+            return 1;
+        }
+        if (match) {
+            filters = realloc_assert(filters, (filters_len + 1) * sizeof(*filters));
+            if (!query_parse_filter(match, &filters[filters_len])) {
+                fprintf(stderr, "Bad value for argument %s: %s\n", ARG_MATCH, match);
+                args_error = true;
+            }
+            ++filters_len;
+        }
+        if (i == parsed_idx) {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            args_error = true;
+            break;
+        }
+    }
+
+    if (!storage_dir) {
+        fprintf(stderr, "Missing %s=<path> argument\n", ARG_STORAGE_DIR);
+        args_error = true;
+    }
+    if (filters_len == 0) {
+        fprintf(stderr, "Missing %s=<filter> argument\n", ARG_MATCH);
+        args_error = true;
+    }
+    if (args_error) {
+        fprintf(stderr, "Add \"--help\" for more information about the arguments.\n");
+        return 1;
+    }
+
+    char * const index_path = index_path_get(storage_dir);
+    if (!query_index(index_path, filters, filters_len)) {
+        free(index_path);
+        return 1;
+    }
+
+    // The last journal record of a file replaces its index entry.
+    struct query_record * records = NULL;
+    size_t records_len = 0;
+    char * const old_log_path = sprintf_malloc("%s%s", index_path, INDEX_OLD_LOG_SUFFIX);
+    char * const log_path = sprintf_malloc("%s%s", index_path, INDEX_LOG_SUFFIX);
+    query_read_journal(old_log_path, &records, &records_len);
+    query_read_journal(log_path, &records, &records_len);
+    qsort(records, records_len, sizeof(*records), query_record_cmp);
+    char ** journal_paths = realloc_assert(NULL, (records_len + 1) * sizeof(*journal_paths));
+    size_t journal_paths_len = 0;
+    char ** results = NULL;
+    size_t results_len = 0;
+    for (size_t i = 0; i < records_len; ++i) {
+        if (i + 1 < records_len && strcmp(records[i].path, records[i + 1].path) == 0) {
+            continue;
+        }
+        journal_paths[journal_paths_len++] = records[i].path;
+        if (records[i].fields && query_record_matches(&records[i], filters, filters_len)) {
+            results = realloc_assert(results, (results_len + 1) * sizeof(*results));
+            results[results_len++] = records[i].path;
+        }
+    }
+
+    for (size_t i = 0; i < filters[0].paths_len; ++i) {
+        char * const path = filters[0].paths[i];
+        if (query_path_in(journal_paths, journal_paths_len, path)) {
+            continue;
+        }
+        bool matches = true;
+        for (size_t j = 1; j < filters_len && matches; ++j) {
+            matches = query_path_in(filters[j].paths, filters[j].paths_len, path);
+        }
+        if (matches) {
+            results = realloc_assert(results, (results_len + 1) * sizeof(*results));
+            results[results_len++] = path;
+        }
+    }
+    qsort(results, results_len, sizeof(*results), index_line_cmp);
+    for (size_t i = 0; i < results_len; ++i) {
+        if (i > 0 && strcmp(results[i], results[i - 1]) == 0) {
+            continue;
+        }
+        char * const path = my_strdup(results[i]);
+        index_unescape(path);
+        printf("%s/%s\n", storage_dir, path);
+        free(path);
+    }
+
+    for (size_t i = 0; i < records_len; ++i) {
+        free(records[i].path);
+        free(records[i].fields);
+    }
+    free(records);
+    free(journal_paths);
+    free(results);
+    for (size_t i = 0; i < filters_len; ++i) {
+        for (size_t j = 0; j < filters[i].paths_len; ++j) {
+            free(filters[i].paths[j]);
+        }
+        free(filters[i].paths);
+        free(filters[i].key);
+        free(filters[i].value);
+        free(filters[i].min);
+        free(filters[i].max);
+    }
+    free(filters);
+    free(log_path);
+    free(old_log_path);
+    free(index_path);
+    return 0;
+}
+
+
+// Parses the time as Unix time or as ISO 8601 UTC time "YYYY-MM-DDTHH:MM:SSZ" or date "YYYY-MM-DD".
+static bool metadata_parse_time(const char * str, int64_t * time) {
+    size_t value;
+    if (parse_size(str, &value)) {
+        *time = value;
+        return true;
+    }
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char * end = strptime(str, "%Y-%m-%dT%H:%M:%SZ", &tm);
+    if (!end || *end != '\0') {
+        memset(&tm, 0, sizeof(tm));
+        end = strptime(str, "%Y-%m-%d", &tm);
+    }
+    if (!end || *end != '\0') {
+        return false;
+    }
+    *time = timegm(&tm);
+    return true;
+}
+
+
+// Returns true if the first line of the day segment allows records in the time range from the port.
+static bool metadata_segment_relevant(const char * path, int64_t from, int64_t to, const char * port) {
+    FILE * const file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    char * line = NULL;
+    size_t line_size = 0;
+    bool relevant = false;
+    if (getline(&line, &line_size, file) != -1) {
+        line[strcspn(line, "\n")] = '\0';
+        char * fields = line;
+        const char * const magic = strsep(&fields, "\t");
+        const char * const min = fields ? strsep(&fields, "\t") : NULL;
+        const char * const max = fields ? strsep(&fields, "\t") : NULL;
+        strsep(&fields, "\t");  // number of records
+        if (strcmp(magic, METADATA_SEGMENT_MAGIC) == 0 && min && max && strtoll(max, NULL, 10) >= from &&
+            strtoll(min, NULL, 10) <= to) {
+            relevant = !port;
+            const char * segment_port;
+            while (!relevant && (segment_port = strsep(&fields, "\t"))) {
+                relevant = strcmp(segment_port, port) == 0;
+            }
+        }
+    }
+    free(line);
+    fclose(file);
+    return relevant;
+}
+
+
+// cyflowrec metadata --metadata-dir=<path> [--from=<time>] [--to=<time>] [--port-dev=<port>]
+// Prints the records of the received files in the time range sorted by time. Day segments out of the range
+// or without records of the port are skipped by their first line.
+static int metadata_main(int argc, char * argv[]) {
+    bool args_error = false;
+    const char * from_arg = NULL;
+    const char * to_arg = NULL;
+    const char * port = NULL;
+    int64_t from = INT64_MIN;
+    int64_t to = INT64_MAX;
+
+    for (int i = 1; i < argc;) {
+        const int parsed_idx = i;
+        if (!arg_parse_value(argc, argv, &i, ARG_METADATA_DIR, &metadata_dir)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_FROM, &from_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_TO, &to_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_PORT_DEV, &port)) {
+            return 1;
+        }
+        if (i == parsed_idx) {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            args_error = true;
+            break;
+        }
+    }
+
+    if (!metadata_dir) {
+        fprintf(stderr, "Missing %s=<path> argument\n", ARG_METADATA_DIR);
+        args_error = true;
+    }
+    if (from_arg && !metadata_parse_time(from_arg, &from)) {
+        fprintf(stderr, "Bad value for argument %s: %s\n", ARG_FROM, from_arg);
+        args_error = true;
+    }
+    if (to_arg && !metadata_parse_time(to_arg, &to)) {
+        fprintf(stderr, "Bad value for argument %s: %s\n", ARG_TO, to_arg);
+        args_error = true;
+    }
+    if (args_error) {
+        fprintf(stderr, "Add \"--help\" for more information about the arguments.\n");
+        return 1;
+    }
+
+    DIR * const dir = opendir(metadata_dir);
+    if (!dir) {
+        fprintf(stderr, "Cannot open metadata directory \"%s\": %s\n", metadata_dir, strerror(errno));
+        return 1;
+    }
+    char * const escaped_port = port ? index_escape(port) : NULL;
+    struct metadata_record * records = NULL;
+    size_t records_len = 0;
+    bool failed = false;
+    struct dirent * entry;
+    while ((entry = readdir(dir))) {
+        int64_t start;
+        const bool is_segment = metadata_segment_name(entry->d_name, ".seg", &start);
+        if (!is_segment && !(metadata_segment_name(entry->d_name, ".log", &start) && start <= to)) {
+            continue;
+        }
+        char * const path = sprintf_malloc("%s/%s", metadata_dir, entry->d_name);
+        if ((!is_segment || metadata_segment_relevant(path, from, to, escaped_port)) &&
+            !metadata_read_records(path, is_segment, &records, &records_len)) {
+            fprintf(stderr, "Cannot read metadata segment \"%s\": %s\n", path, strerror(errno));
+            failed = true;
+        }
+        free(path);
+    }
+    closedir(dir);
+
+    // A segment being compacted may be read twice, the duplicates are removed.
+    metadata_sort_records(records, &records_len);
+    for (size_t i = 0; i < records_len; ++i) {
+        const char * record_port;
+        const size_t port_len = metadata_port_field(records[i].line, &record_port);
+        if (records[i].time >= from && records[i].time <= to &&
+            (!escaped_port || (strlen(escaped_port) == port_len && memcmp(record_port, escaped_port, port_len) == 0))) {
+            fputs(records[i].line, stdout);
+        }
+        free(records[i].line);
+    }
+    free(records);
+    free(escaped_port);
+    return failed ? 1 : 0;
+}
+
+
+#ifndef CYFLOWREC_NO_MAIN
+int main(int argc, char * argv[]) {
+    bool args_error = false;
+    const char * create_dirs = NULL;
+    const char * file_exists = NULL;
+    const char * intercharacter_timeout = NULL;
+    const char * transfer_timeout = NULL;
+    const char * recv_buffer = NULL;
+    const char * resync_arg = NULL;
+    const char * payload_splice_arg = NULL;
+    const char * io_backend_arg = NULL;
+    const char * storage_mmap_arg = NULL;
+    const char * storage_sync_arg = NULL;
+    const char * storage_index_arg = NULL;
+    const char * fcs_stats_arg = NULL;
+    const char * fcs_preview_arg = NULL;
+    const char * fcs_columnar_arg = NULL;
+    const char * fcs_preview_density_arg = NULL;
+    const char * spool_size_arg = NULL;
+    const char * spool_flush_size_arg = NULL;
+    const char * spool_flush_age_arg = NULL;
+    const char * storage_quota_arg = NULL;
+    const char * quota_watermarks_arg = NULL;
+    const char * shard_levels = NULL;
+    const char * hook_workers_arg = NULL;
+    const char * hook_timeout_arg = NULL;
+    const char * hook_retries_arg = NULL;
+    const char * metadata_segment_age_arg = NULL;
+
+    if (argc > 1 && strcmp(argv[1], "reshard") == 0) {
+        return reshard_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "index") == 0) {
+        return index_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "query") == 0) {
+        return query_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "metadata") == 0) {
+        return metadata_main(argc - 1, argv + 1);
+    }
+
+    for (int i = 1; i < argc;) {
+        const int parsed_idx = i;
+        const char * port_dev = NULL;
+        if (!arg_parse_value(argc, argv, &i, ARG_PORT_DEV, &port_dev)) {
+            return 1;
+        }
+        if (port_dev) {
+            port_devs = realloc_assert(port_devs, (port_devs_len + 1) * sizeof(*port_devs));
+            port_devs[port_devs_len++] = port_dev;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_PORT_GLOB, &port_glob)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_STORAGE_DIR, &storage_dir)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_STORAGE_CREATE_DIRS, &create_dirs)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_STORAGE_FILE_EXISTS, &file_exists)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_STORAGE_FILE_PATH, &storage_file_path)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_INTERCHARACTER_TIMEOUT, &intercharacter_timeout)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_TRANSFER_TIMEOUT, &transfer_timeout)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_RECV_BUFFER_SIZE, &recv_buffer)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_RESYNC, &resync_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_PAYLOAD_SPLICE, &payload_splice_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_IO_BACKEND, &io_backend_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_STORAGE_MMAP, &storage_mmap_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_STORAGE_SYNC, &storage_sync_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_STORAGE_INDEX, &storage_index_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_INDEX_FILE, &index_file_path)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_SPOOL_DIR, &spool_dir)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_SPOOL_SIZE, &spool_size_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_SPOOL_FLUSH_SIZE, &spool_flush_size_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_SPOOL_FLUSH_AGE, &spool_flush_age_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_STORAGE_QUOTA, &storage_quota_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_STORAGE_QUOTA_WATERMARKS, &quota_watermarks_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_STORAGE_ARCHIVE_DIR, &storage_archive_dir)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_STORAGE_SHARD_LEVELS, &shard_levels)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_ON_FILE_RECEIVED, &on_file_received)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_HOOK_WORKERS, &hook_workers_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_HOOK_TIMEOUT, &hook_timeout_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_HOOK_RETRIES, &hook_retries_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_HOOK_QUEUE_FILE, &hook_queue_file)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_EVENT_SOCKET, &event_socket)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_PAYLOAD_TEE_SOCKET, &payload_tee_socket)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_LISTEN, &listen_address)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_RELAY_TO, &relay_to)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_RELAY_QUEUE_FILE, &relay_queue_file)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_METADATA_DIR, &metadata_dir)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_METADATA_SEGMENT_AGE, &metadata_segment_age_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_FCS_STATS, &fcs_stats_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_FCS_PREVIEW, &fcs_preview_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_FCS_COLUMNAR, &fcs_columnar_arg)) {
+            return 1;
+        }
+        if (!arg_parse_value(argc, argv, &i, ARG_FCS_PREVIEW_DENSITY, &fcs_preview_density_arg)) {
+            return 1;
+        }
+        if (i < argc && strcmp(argv[i], ARG_HELP) == 0) {
+            print_help();
+            return 0;
+        }
+        if (i == parsed_idx) {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            args_error = true;
+            break;
+        }
+    }
+
+    if (!storage_dir && !storage_file_path) {
+        fprintf(stderr, "One of the arguments %s and %s is needed\n", ARG_STORAGE_DIR, ARG_STORAGE_FILE_PATH);
+        args_error = true;
+    }
+    if (storage_dir && storage_file_path) {
+        fprintf(stderr, "Only one of the arguments %s and %s can be used\n", ARG_STORAGE_DIR, ARG_STORAGE_FILE_PATH);
+        args_error = true;
+    }
+    if (port_devs_len == 0 && !port_glob && !listen_address) {
+        fprintf(stderr, "Missing %s=<port> or %s=<pattern> argument\n", ARG_PORT_DEV, ARG_PORT_GLOB);
+        args_error = true;
+    }
+    if ((port_devs_len > 0 || port_glob) && listen_address) {
+        fprintf(
+            stderr, "The arguments %s and %s cannot be used with %s\n", ARG_PORT_DEV, ARG_PORT_GLOB, ARG_LISTEN);
+        args_error = true;
+    }
+    if (port_glob) {
+        const char * const name = strrchr(port_glob, '/');
+        const char * const wildcard = strpbrk(port_glob, "*?[");
+        if (name && wildcard && wildcard < name) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_PORT_GLOB, port_glob);
+            args_error = true;
+        }
+    }
+
+    if (create_dirs) {
+        if (strcmp(create_dirs, "1") == 0) {
+            storage_create_dirs = true;
+        } else if (strcmp(create_dirs, "0") != 0) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_STORAGE_CREATE_DIRS, create_dirs);
+            args_error = true;
+        }
+    }
+
+    if (storage_mmap_arg) {
+        if (strcmp(storage_mmap_arg, "1") == 0) {
+            storage_mmap = true;
+        } else if (strcmp(storage_mmap_arg, "0") != 0) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_STORAGE_MMAP, storage_mmap_arg);
+            args_error = true;
+        }
+    }
+
+    if (storage_sync_arg) {
+        if (strcmp(storage_sync_arg, "1") == 0) {
+            storage_sync = true;
+        } else if (strcmp(storage_sync_arg, "0") != 0) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_STORAGE_SYNC, storage_sync_arg);
+            args_error = true;
+        }
+    }
+
+    if (storage_index_arg) {
+        if (strcmp(storage_index_arg, "1") == 0) {
+            storage_index = true;
+        } else if (strcmp(storage_index_arg, "0") != 0) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_STORAGE_INDEX, storage_index_arg);
+            args_error = true;
+        }
+    }
+
+    if (fcs_stats_arg) {
+        if (strcmp(fcs_stats_arg, "1") == 0) {
+            fcs_stats = true;
+        } else if (strcmp(fcs_stats_arg, "0") != 0) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_FCS_STATS, fcs_stats_arg);
+            args_error = true;
+        }
+    }
+
+    if (fcs_columnar_arg) {
+        if (strcmp(fcs_columnar_arg, "float32") == 0) {
+            fcs_columnar = FCS_COLUMNAR_FLOAT32;
+        } else if (strcmp(fcs_columnar_arg, "uint16") == 0) {
+            fcs_columnar = FCS_COLUMNAR_UINT16;
+        } else if (strcmp(fcs_columnar_arg, "none") != 0) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_FCS_COLUMNAR, fcs_columnar_arg);
+            args_error = true;
+        }
+    }
+
+    if (fcs_preview_arg) {
+        if (strcmp(fcs_preview_arg, "pgm") == 0) {
+            fcs_preview = FCS_PREVIEW_PGM;
+        } else if (strcmp(fcs_preview_arg, "png") == 0) {
+            fcs_preview = FCS_PREVIEW_PNG;
+        } else if (strcmp(fcs_preview_arg, "none") != 0) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_FCS_PREVIEW, fcs_preview_arg);
+            args_error = true;
+        }
+    }
+
+    if (fcs_preview_density_arg) {
+        const char * const sep = strchr(fcs_preview_density_arg, ',');
+        if (!sep || sep == fcs_preview_density_arg || sep[1] == '\0') {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_FCS_PREVIEW_DENSITY, fcs_preview_density_arg);
+            args_error = true;
+        } else {
+            fcs_preview_density_x = my_strdup(fcs_preview_density_arg);
+            fcs_preview_density_x[sep - fcs_preview_density_arg] = '\0';
+            fcs_preview_density_y = fcs_preview_density_x + (sep - fcs_preview_density_arg) + 1;
+        }
+    }
+
+    if (io_backend_arg) {
+        if (strcmp(io_backend_arg, "io_uring") == 0) {
+            io_backend = IO_BACKEND_IO_URING;
+        } else if (strcmp(io_backend_arg, "poll") != 0) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_IO_BACKEND, io_backend_arg);
+            args_error = true;
+        }
+    }
+
+    if (payload_splice_arg) {
+        if (strcmp(payload_splice_arg, "1") == 0) {
+            payload_splice = true;
+        } else if (strcmp(payload_splice_arg, "0") != 0) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_PAYLOAD_SPLICE, payload_splice_arg);
+            args_error = true;
+        }
+    }
+
+    if (resync_arg) {
+        if (strcmp(resync_arg, "0") == 0) {
+            resync = false;
+        } else if (strcmp(resync_arg, "1") != 0) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_RESYNC, resync_arg);
+            args_error = true;
+        }
+    }
+
+    if (file_exists) {
+        if (strcmp(file_exists, "drop") == 0) {
+            file_exists_policy = FILE_DROP;
+        } else if (strcmp(file_exists, "replace") != 0) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_STORAGE_FILE_EXISTS, file_exists);
+            args_error = true;
+        }
+    }
+
+    if (intercharacter_timeout) {
+        size_t value;
+        if (!parse_size(intercharacter_timeout, &value) || value == 0 || value > INT32_MAX) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_INTERCHARACTER_TIMEOUT, intercharacter_timeout);
+            args_error = true;
+        } else {
+            intercharacter_timeout_ms = value;
+        }
+    }
+
+    if (transfer_timeout) {
+        size_t value;
+        if (!parse_size(transfer_timeout, &value) || value > INT32_MAX) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_TRANSFER_TIMEOUT, transfer_timeout);
+            args_error = true;
+        } else {
+            transfer_timeout_ms = value;
+        }
+    }
+
+    if (recv_buffer) {
+        size_t value;
+        if (!parse_size(recv_buffer, &value) || value < MIN_RECV_BUFFER_SIZE || value > MAX_RECV_BUFFER_SIZE) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_RECV_BUFFER_SIZE, recv_buffer);
+            args_error = true;
+        } else {
+            recv_buffer_size = value;
+        }
+    }
+
+    if (spool_size_arg) {
+        if (!parse_size(spool_size_arg, &spool_size) || spool_size == 0) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_SPOOL_SIZE, spool_size_arg);
+            args_error = true;
+        }
+    }
+
+    if (spool_flush_size_arg) {
+        if (!parse_size(spool_flush_size_arg, &spool_flush_size)) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_SPOOL_FLUSH_SIZE, spool_flush_size_arg);
+            args_error = true;
+        }
+    }
+
+    if (spool_flush_age_arg) {
+        size_t value;
+        if (!parse_size(spool_flush_age_arg, &value) || value > INT32_MAX) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_SPOOL_FLUSH_AGE, spool_flush_age_arg);
+            args_error = true;
+        } else {
+            spool_flush_age_ms = (int64_t)value * 1000;
+        }
+    }
+
+    if (storage_quota_arg) {
+        if (!parse_size(storage_quota_arg, &storage_quota)) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_STORAGE_QUOTA, storage_quota_arg);
+            args_error = true;
+        }
+    }
+
+    if (quota_watermarks_arg) {
+        char * const low = my_strdup(quota_watermarks_arg);
+        char * const high = strchr(low, ',');
+        size_t low_value = 0;
+        size_t high_value = 0;
+        if (high) {
+            *high = '\0';
+        }
+        if (!high || !parse_size(low, &low_value) || !parse_size(high + 1, &high_value) || low_value > high_value ||
+            high_value > 100) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_STORAGE_QUOTA_WATERMARKS, quota_watermarks_arg);
+            args_error = true;
+        } else {
+            storage_quota_low = low_value;
+            storage_quota_high = high_value;
+        }
+        free(low);
+    }
+
+    if (shard_levels) {
+        size_t value;
+        if (!parse_size(shard_levels, &value) || value > MAX_STORAGE_SHARD_LEVELS) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_STORAGE_SHARD_LEVELS, shard_levels);
+            args_error = true;
+        } else {
+            storage_shard_levels = value;
+        }
+    }
+
+    if (hook_workers_arg) {
+        size_t value;
+        if (!parse_size(hook_workers_arg, &value) || value == 0 || value > 64) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_HOOK_WORKERS, hook_workers_arg);
+            args_error = true;
+        } else {
+            hook_workers = value;
+        }
+    }
+
+    if (metadata_segment_age_arg) {
+        size_t value;
+        if (!parse_size(metadata_segment_age_arg, &value) || value == 0 || value > (size_t)METADATA_DAY_S) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_METADATA_SEGMENT_AGE, metadata_segment_age_arg);
+            args_error = true;
+        } else {
+            metadata_segment_age_s = value;
+        }
+    }
+
+    if (hook_timeout_arg) {
+        size_t value;
+        if (!parse_size(hook_timeout_arg, &value) || value > INT32_MAX) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_HOOK_TIMEOUT, hook_timeout_arg);
+            args_error = true;
+        } else {
+            hook_timeout_ms = (int64_t)value * 1000;
+        }
+    }
+
+    if (hook_retries_arg) {
+        size_t value;
+        if (!parse_size(hook_retries_arg, &value) || value > 10) {
+            fprintf(stderr, "Bad value for argument %s: %s\n", ARG_HOOK_RETRIES, hook_retries_arg);
+            args_error = true;
+        } else {
+            hook_retries = value;
+        }
+    }
+
+    if (on_file_received && !hook_init_command()) {
+        args_error = true;
+    }
+
+    if (storage_archive_dir && storage_quota == 0) {
+        fprintf(stderr, "Argument %s requires %s\n", ARG_STORAGE_ARCHIVE_DIR, ARG_STORAGE_QUOTA);
+        args_error = true;
+    }
+
+    if (storage_index && !storage_dir) {
+        fprintf(stderr, "Argument %s requires %s\n", ARG_STORAGE_INDEX, ARG_STORAGE_DIR);
+        args_error = true;
+    }
+
+    if (index_file_path && !storage_index) {
+        fprintf(stderr, "Argument %s requires %s\n", ARG_INDEX_FILE, ARG_STORAGE_INDEX);
+        args_error = true;
+    }
+
+    if (spool_dir && io_backend == IO_BACKEND_IO_URING) {
+        fprintf(stderr, "Argument %s cannot be used with the io_uring backend\n", ARG_SPOOL_DIR);
+        args_error = true;
+    }
+
+    if (listen_address && io_backend == IO_BACKEND_IO_URING) {
+        fprintf(stderr, "Argument %s cannot be used with the io_uring backend\n", ARG_LISTEN);
+        args_error = true;
+    }
+
+    if (port_glob && io_backend == IO_BACKEND_IO_URING) {
+        fprintf(stderr, "Argument %s cannot be used with the io_uring backend\n", ARG_PORT_GLOB);
+        args_error = true;
+    }
+
+    if (port_devs_len > 1 && io_backend == IO_BACKEND_IO_URING) {
+        fprintf(stderr, "Only one %s can be used with the io_uring backend\n", ARG_PORT_DEV);
+        args_error = true;
+    }
+
+    if (port_devs_len == 1 && port_dev_is_network(port_devs[0]) && io_backend == IO_BACKEND_IO_URING) {
+        fprintf(stderr, "Network port \"%s\" cannot be used with the io_uring backend\n", port_devs[0]);
+        args_error = true;
+    }
+
+    if (relay_to && !relay_queue_file) {
+        fprintf(stderr, "Argument %s requires %s\n", ARG_RELAY_TO, ARG_RELAY_QUEUE_FILE);
+        args_error = true;
     }
 
     if (args_error) {
@@ -887,7 +8485,34 @@ int main(int argc, char * argv[]) {
         }
     }
 
-    recv_loop(tokens);
+    if (spool_dir && !spool_init()) {
+        return 1;
+    }
+    if (storage_quota > 0 && !quota_init()) {
+        return 1;
+    }
+    if (on_file_received && !hook_init()) {
+        return 1;
+    }
+    if (event_socket && !events_init()) {
+        return 1;
+    }
+    if (payload_tee_socket && listen_address && !(collector_tee = tee_open(my_strdup(payload_tee_socket)))) {
+        return 1;
+    }
+    if (metadata_dir && !metadata_init()) {
+        return 1;
+    }
+    if (relay_to && !relay_init()) {
+        return 1;
+    }
+
+    if (listen_address) {
+        collector_loop(tokens);
+    } else {
+        recv_loop(tokens);
+    }
 
     return 1;
 }
+#endif
@@ -0,0 +1,632 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright 2024 Jaroslav Rohel, jaroslav.rohel@gmail.com
+
+#define _GNU_SOURCE
+
+#include "fcsreader.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+static const size_t HEADER_LEN = 58;
+static const unsigned int MAX_PARAMETERS = 4096;
+
+struct fcs_param {
+    char * name;
+    unsigned int bits;    // $PnB, 0 for delimited ASCII
+    size_t offset;        // offset in the event record, in bits for bit packed integers
+    uint64_t mask;        // integer range mask
+    enum fcs_byte_order order;
+};
+
+struct fcs_file {
+    const unsigned char * base;
+    size_t size;
+    bool mapped;
+    char ** keys;
+    char ** values;
+    size_t keywords_len;
+    char datatype;
+    struct fcs_byteord byteord;
+    struct fcs_param * params;
+    unsigned int params_len;
+    const unsigned char * data;
+    size_t data_len;
+    size_t event_size;  // bytes, 0 if the events are not byte aligned
+    size_t event_bits;  // bits of a bit packed event
+    bool delimited;     // delimited ASCII
+    uint64_t events;
+};
+
+
+static void * alloc_zeroed(size_t size) {
+    void * const ret = calloc(1, size > 0 ? size : 1);
+    if (!ret) {
+        abort();
+    }
+    return ret;
+}
+
+
+static char * copy_string(const char * src, size_t len) {
+    char * const ret = alloc_zeroed(len + 1);
+    memcpy(ret, src, len);
+    return ret;
+}
+
+
+bool fcs_parse_size(const char * str, size_t len, size_t * value) {
+    while (len > 0 && *str == ' ') {
+        ++str;
+        --len;
+    }
+    while (len > 0 && str[len - 1] == ' ') {
+        --len;
+    }
+    size_t result = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (!isdigit((unsigned char)str[i])) {
+            return false;
+        }
+        const size_t digit = str[i] - '0';
+        if (result > ((size_t)-1 - digit) / 10) {
+            return false;
+        }
+        result = result * 10 + digit;
+    }
+    *value = result;
+    return true;
+}
+
+
+char * fcs_text_token(const char * text, size_t len, char delim, size_t * pos) {
+    // the token is not longer than the text up to the first single delimiter
+    size_t end = *pos;
+    while (end < len && (text[end] != delim || (end + 1 < len && text[end + 1] == delim))) {
+        end += text[end] == delim ? 2 : 1;
+    }
+    char * const token = alloc_zeroed(end - *pos + 1);
+    size_t token_len = 0;
+    while (*pos < len) {
+        if (text[*pos] == delim) {
+            if (*pos + 1 < len && text[*pos + 1] == delim) {
+                token[token_len++] = delim;
+                *pos += 2;
+                continue;
+            }
+            ++*pos;
+            break;
+        }
+        token[token_len++] = text[(*pos)++];
+    }
+    return token;
+}
+
+
+static enum fcs_status parse_text(struct fcs_file * file, size_t begin, size_t end) {
+    const char * const text = (const char *)file->base + begin + 1;
+    const size_t len = end - begin;
+    const char delim = file->base[begin];
+    size_t capacity = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        // padding after the last value
+        size_t rest = pos;
+        while (rest < len && (text[rest] == ' ' || text[rest] == '\0')) {
+            ++rest;
+        }
+        if (rest == len) {
+            break;
+        }
+        if (file->keywords_len == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            file->keys = realloc(file->keys, capacity * sizeof(*file->keys));
+            file->values = realloc(file->values, capacity * sizeof(*file->values));
+            if (!file->keys || !file->values) {
+                abort();
+            }
+        }
+        file->keys[file->keywords_len] = fcs_text_token(text, len, delim, &pos);
+        file->values[file->keywords_len] = fcs_text_token(text, len, delim, &pos);
+        ++file->keywords_len;
+    }
+    return file->keywords_len > 0 ? FCS_OK : FCS_ERROR_FORMAT;
+}
+
+
+enum fcs_status fcs_parse_byteord(const char * value, struct fcs_byteord * byteord) {
+    unsigned int used = 0;
+    byteord->len = 0;
+    const char * str = value;
+    while (*str != '\0') {
+        char * end;
+        const unsigned long byte = strtoul(str, &end, 10);
+        if (end == str || byte == 0 || byte > FCS_MAX_BYTEORD_LEN || byteord->len == FCS_MAX_BYTEORD_LEN ||
+            (used & (1u << (byte - 1)))) {
+            return FCS_ERROR_UNSUPPORTED;
+        }
+        used |= 1u << (byte - 1);
+        byteord->bytes[byteord->len++] = byte - 1;
+        str = end;
+        while (*str == ',' || *str == ' ') {
+            ++str;
+        }
+    }
+    return byteord->len > 0 && used == (1u << byteord->len) - 1 ? FCS_OK : FCS_ERROR_UNSUPPORTED;
+}
+
+
+enum fcs_byte_order fcs_value_byte_order(const struct fcs_byteord * byteord, unsigned int width) {
+    bool little = true;
+    bool big = true;
+    for (unsigned int i = 0; i < byteord->len; ++i) {
+        little = little && byteord->bytes[i] == i;
+        big = big && byteord->bytes[i] == byteord->len - 1 - i;
+    }
+    if (width == 1 || little) {
+        return FCS_ORDER_LITTLE;
+    }
+    if (big) {
+        return FCS_ORDER_BIG;
+    }
+    return width == byteord->len ? FCS_ORDER_PERMUTED : FCS_ORDER_LITTLE;
+}
+
+
+uint64_t fcs_range_mask(const char * range) {
+    const double value = range ? strtod(range, NULL) : 0;
+    if (!(value >= 2) || value > 9.2e18) {
+        return UINT64_MAX;
+    }
+    uint64_t mask = 1;
+    while ((double)mask < value - 1) {
+        mask = (mask << 1) | 1;
+    }
+    return mask;
+}
+
+
+static const char * param_keyword(const struct fcs_file * file, unsigned int param, char suffix) {
+    char key[24];
+    snprintf(key, sizeof(key), "$P%u%c", param + 1, suffix);
+    return fcs_keyword(file, key);
+}
+
+
+// Counts the delimited ASCII values. The values are separated by spaces, tabs, line ends or commas.
+static uint64_t count_delimited_values(const unsigned char * data, size_t len) {
+    uint64_t count = 0;
+    bool in_value = false;
+    for (size_t i = 0; i < len; ++i) {
+        const bool separator = data[i] == ' ' || data[i] == '\t' || data[i] == '\r' || data[i] == '\n' ||
+                               data[i] == ',' || data[i] == '\0';
+        if (!separator && !in_value) {
+            ++count;
+        }
+        in_value = !separator;
+    }
+    return count;
+}
+
+
+static enum fcs_status parse_parameters(struct fcs_file * file) {
+    size_t par;
+    const char * const par_value = fcs_keyword(file, "$PAR");
+    if (!par_value || !fcs_parse_size(par_value, strlen(par_value), &par) || par == 0 || par > MAX_PARAMETERS) {
+        return FCS_ERROR_FORMAT;
+    }
+    file->params_len = par;
+    file->params = alloc_zeroed(par * sizeof(*file->params));
+
+    const char * const mode = fcs_keyword(file, "$MODE");
+    if (mode && strcasecmp(mode, "L") != 0) {
+        return FCS_ERROR_UNSUPPORTED;
+    }
+    const char * const datatype = fcs_keyword(file, "$DATATYPE");
+    if (!datatype || strlen(datatype) != 1) {
+        return FCS_ERROR_FORMAT;
+    }
+    file->datatype = toupper((unsigned char)datatype[0]);
+    if (file->datatype != 'I' && file->datatype != 'F' && file->datatype != 'D' && file->datatype != 'A') {
+        return FCS_ERROR_UNSUPPORTED;
+    }
+    const char * const byteord = fcs_keyword(file, "$BYTEORD");
+    if (file->datatype != 'A') {
+        if (!byteord) {
+            return FCS_ERROR_FORMAT;
+        }
+        const enum fcs_status status = fcs_parse_byteord(byteord, &file->byteord);
+        if (status != FCS_OK) {
+            return status;
+        }
+    }
+
+    bool packed = false;
+    size_t bits_total = 0;
+    unsigned int delimited = 0;
+    for (unsigned int i = 0; i < file->params_len; ++i) {
+        struct fcs_param * const param = &file->params[i];
+        const char * const name = param_keyword(file, i, 'N');
+        param->name = name ? copy_string(name, strlen(name)) : NULL;
+        if (!param->name) {
+            char buf[16];
+            snprintf(buf, sizeof(buf), "P%u", i + 1);
+            param->name = copy_string(buf, strlen(buf));
+        }
+        const char * const bits = param_keyword(file, i, 'B');
+        if (!bits) {
+            return FCS_ERROR_FORMAT;
+        }
+        size_t bits_value;
+        if (file->datatype == 'A' && strcmp(bits, "*") == 0) {
+            ++delimited;
+            continue;
+        }
+        if (!fcs_parse_size(bits, strlen(bits), &bits_value) || bits_value == 0 || bits_value > 64) {
+            return FCS_ERROR_UNSUPPORTED;
+        }
+        if ((file->datatype == 'F' && bits_value != 32) || (file->datatype == 'D' && bits_value != 64)) {
+            return FCS_ERROR_UNSUPPORTED;
+        }
+        if (file->datatype == 'A') {
+            bits_value *= 8;  // $PnB is the number of characters
+        }
+        param->bits = bits_value;
+        param->offset = bits_total;
+        param->mask = file->datatype == 'I' ? fcs_range_mask(param_keyword(file, i, 'R')) : UINT64_MAX;
+        param->order = fcs_value_byte_order(&file->byteord, bits_value / 8);
+        bits_total += bits_value;
+        packed = packed || bits_value % 8 != 0;
+    }
+
+    if (delimited > 0) {
+        if (delimited != file->params_len) {
+            return FCS_ERROR_UNSUPPORTED;
+        }
+        file->delimited = true;
+        file->events = count_delimited_values(file->data, file->data_len) / file->params_len;
+    } else if (packed) {
+        file->event_bits = bits_total;
+        file->events = (uint64_t)file->data_len * 8 / bits_total;
+    } else {
+        file->event_size = bits_total / 8;
+        for (unsigned int i = 0; i < file->params_len; ++i) {
+            file->params[i].offset /= 8;
+        }
+        file->events = file->data_len / file->event_size;
+    }
+    return FCS_OK;
+}
+
+
+static enum fcs_status parse_file(struct fcs_file * file) {
+    if (file->size < HEADER_LEN || memcmp(file->base, "FCS", 3) != 0) {
+        return FCS_ERROR_FORMAT;
+    }
+    const char * const header = (const char *)file->base;
+    size_t text_begin;
+    size_t text_end;
+    size_t data_begin;
+    size_t data_end;
+    if (!fcs_parse_size(header + 10, 8, &text_begin) || !fcs_parse_size(header + 18, 8, &text_end) ||
+        !fcs_parse_size(header + 26, 8, &data_begin) || !fcs_parse_size(header + 34, 8, &data_end)) {
+        return FCS_ERROR_FORMAT;
+    }
+    if (text_begin < HEADER_LEN || text_end <= text_begin || text_end >= file->size) {
+        return FCS_ERROR_FORMAT;
+    }
+    enum fcs_status status = parse_text(file, text_begin, text_end);
+    if (status != FCS_OK) {
+        return status;
+    }
+
+    // Offsets above 99999999 do not fit in the HEADER and are only in the TEXT segment.
+    if (data_begin == 0 && data_end == 0) {
+        const char * const begin_value = fcs_keyword(file, "$BEGINDATA");
+        const char * const end_value = fcs_keyword(file, "$ENDDATA");
+        if (!begin_value || !end_value || !fcs_parse_size(begin_value, strlen(begin_value), &data_begin) ||
+            !fcs_parse_size(end_value, strlen(end_value), &data_end)) {
+            return FCS_ERROR_FORMAT;
+        }
+    }
+    if (data_begin > data_end || data_begin >= file->size) {
+        return FCS_ERROR_FORMAT;
+    }
+    // A truncated DATA segment is accepted, the events are counted from the available data.
+    file->data = file->base + data_begin;
+    file->data_len = (data_end < file->size ? data_end + 1 : file->size) - data_begin;
+
+    return parse_parameters(file);
+}
+
+
+enum fcs_status fcs_open_memory(const void * data, size_t size, struct fcs_file ** file) {
+    struct fcs_file * const new_file = alloc_zeroed(sizeof(*new_file));
+    new_file->base = data;
+    new_file->size = size;
+    const enum fcs_status status = parse_file(new_file);
+    if (status != FCS_OK) {
+        fcs_close(new_file);
+        return status;
+    }
+    *file = new_file;
+    return FCS_OK;
+}
+
+
+enum fcs_status fcs_open(const char * path, struct fcs_file ** file) {
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return FCS_ERROR_IO;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        const int origin_errno = errno;
+        close(fd);
+        errno = origin_errno;
+        return FCS_ERROR_IO;
+    }
+    if ((size_t)st.st_size < HEADER_LEN) {
+        close(fd);
+        return FCS_ERROR_FORMAT;
+    }
+    void * const map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    const int origin_errno = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = origin_errno;
+        return FCS_ERROR_IO;
+    }
+    const enum fcs_status status = fcs_open_memory(map, st.st_size, file);
+    if (status != FCS_OK) {
+        munmap(map, st.st_size);
+        return status;
+    }
+    (*file)->mapped = true;
+    return FCS_OK;
+}
+
+
+void fcs_close(struct fcs_file * file) {
+    if (!file) {
+        return;
+    }
+    for (size_t i = 0; i < file->keywords_len; ++i) {
+        free(file->keys[i]);
+        free(file->values[i]);
+    }
+    free(file->keys);
+    free(file->values);
+    for (unsigned int i = 0; i < file->params_len && file->params; ++i) {
+        free(file->params[i].name);
+    }
+    free(file->params);
+    if (file->mapped) {
+        munmap((void *)file->base, file->size);
+    }
+    free(file);
+}
+
+
+const char * fcs_status_str(enum fcs_status status) {
+    switch (status) {
+        case FCS_OK:
+            return "success";
+        case FCS_ERROR_IO:
+            return "cannot read file";
+        case FCS_ERROR_FORMAT:
+            return "invalid FCS file";
+        case FCS_ERROR_UNSUPPORTED:
+            return "unsupported FCS file";
+        case FCS_ERROR_RANGE:
+            return "index out of range";
+    }
+    return "unknown error";
+}
+
+
+size_t fcs_keyword_count(const struct fcs_file * file) {
+    return file->keywords_len;
+}
+
+
+void fcs_keyword_at(const struct fcs_file * file, size_t idx, const char ** key, const char ** value) {
+    *key = file->keys[idx];
+    *value = file->values[idx];
+}
+
+
+const char * fcs_keyword(const struct fcs_file * file, const char * key) {
+    for (size_t i = 0; i < file->keywords_len; ++i) {
+        if (strcasecmp(file->keys[i], key) == 0) {
+            return file->values[i];
+        }
+    }
+    return NULL;
+}
+
+
+unsigned int fcs_parameter_count(const struct fcs_file * file) {
+    return file->params_len;
+}
+
+
+const char * fcs_parameter_name(const struct fcs_file * file, unsigned int param) {
+    return param < file->params_len ? file->params[param].name : NULL;
+}
+
+
+int fcs_parameter_index(const struct fcs_file * file, const char * name) {
+    for (unsigned int i = 0; i < file->params_len; ++i) {
+        if (strcmp(file->params[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+uint64_t fcs_event_count(const struct fcs_file * file) {
+    return file->events;
+}
+
+
+const void * fcs_data(const struct fcs_file * file, size_t * len) {
+    *len = file->data_len;
+    return file->data;
+}
+
+
+size_t fcs_event_size(const struct fcs_file * file) {
+    return file->event_size;
+}
+
+
+const void * fcs_event(const struct fcs_file * file, uint64_t event) {
+    if (file->event_size == 0 || event >= file->events) {
+        return NULL;
+    }
+    return file->data + event * file->event_size;
+}
+
+
+static float bits_to_float(uint32_t bits) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+
+static double bits_to_double(uint64_t bits) {
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+
+// Extracts a parameter of byte aligned records. The loops for the common widths have constant widths
+// and strides independent of the data, so the compiler can vectorize them.
+static void extract_records(
+    const struct fcs_file * file, const struct fcs_param * param, const unsigned char * src, uint64_t count,
+    float * dest) {
+    const size_t stride = file->event_size;
+    const unsigned int width = param->bits / 8;
+    const uint64_t mask = param->mask;
+    const enum fcs_byte_order order = param->order;
+    if (order == FCS_ORDER_PERMUTED) {
+        for (uint64_t i = 0; i < count; ++i) {
+            const uint64_t bits = fcs_load_uint_permuted(&file->byteord, src + i * stride, width);
+            dest[i] = file->datatype == 'F' ? bits_to_float(bits)
+                    : file->datatype == 'D' ? (float)bits_to_double(bits)
+                                            : (float)(bits & mask);
+        }
+    } else if (file->datatype == 'F') {
+        for (uint64_t i = 0; i < count; ++i) {
+            dest[i] = bits_to_float(fcs_load_uint(src + i * stride, 4, order));
+        }
+    } else if (file->datatype == 'D') {
+        for (uint64_t i = 0; i < count; ++i) {
+            dest[i] = bits_to_double(fcs_load_uint(src + i * stride, 8, order));
+        }
+    } else if (width == 1) {
+        for (uint64_t i = 0; i < count; ++i) {
+            dest[i] = src[i * stride] & mask;
+        }
+    } else if (width == 2) {
+        for (uint64_t i = 0; i < count; ++i) {
+            dest[i] = (uint32_t)(fcs_load_uint(src + i * stride, 2, order) & mask);
+        }
+    } else if (width == 4) {
+        for (uint64_t i = 0; i < count; ++i) {
+            dest[i] = (uint32_t)(fcs_load_uint(src + i * stride, 4, order) & mask);
+        }
+    } else {
+        for (uint64_t i = 0; i < count; ++i) {
+            dest[i] = fcs_load_uint(src + i * stride, width, order) & mask;
+        }
+    }
+}
+
+
+// Extracts a parameter of bit packed integers. The bits are read from the most significant bit of each byte.
+static void extract_packed(
+    const struct fcs_file * file, const struct fcs_param * param, uint64_t first, uint64_t count, float * dest) {
+    for (uint64_t i = 0; i < count; ++i) {
+        const uint64_t bit_pos = (first + i) * file->event_bits + param->offset;
+        uint64_t value = 0;
+        for (unsigned int bit = 0; bit < param->bits; ++bit) {
+            const uint64_t pos = bit_pos + bit;
+            value = (value << 1) | ((file->data[pos / 8] >> (7 - pos % 8)) & 1);
+        }
+        dest[i] = value & param->mask;
+    }
+}
+
+
+static float parse_ascii_value(const unsigned char * src, size_t len) {
+    char buf[64];
+    if (len >= sizeof(buf)) {
+        len = sizeof(buf) - 1;
+    }
+    memcpy(buf, src, len);
+    buf[len] = '\0';
+    return strtod(buf, NULL);
+}
+
+
+static void extract_delimited(
+    const struct fcs_file * file, unsigned int param, uint64_t first, uint64_t count, float * dest) {
+    const uint64_t first_value = first * file->params_len + param;
+    uint64_t value_idx = 0;
+    uint64_t extracted = 0;
+    size_t pos = 0;
+    while (pos < file->data_len && extracted < count) {
+        const unsigned char ch = file->data[pos];
+        if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n' || ch == ',' || ch == '\0') {
+            ++pos;
+            continue;
+        }
+        size_t end = pos;
+        while (end < file->data_len && file->data[end] != ' ' && file->data[end] != '\t' && file->data[end] != '\r' &&
+               file->data[end] != '\n' && file->data[end] != ',' && file->data[end] != '\0') {
+            ++end;
+        }
+        if (value_idx >= first_value && (value_idx - first_value) % file->params_len == 0) {
+            dest[extracted++] = parse_ascii_value(file->data + pos, end - pos);
+        }
+        ++value_idx;
+        pos = end;
+    }
+}
+
+
+enum fcs_status fcs_extract(
+    const struct fcs_file * file, unsigned int param, uint64_t first, uint64_t count, float * dest) {
+    if (param >= file->params_len || first > file->events || count > file->events - first) {
+        return FCS_ERROR_RANGE;
+    }
+    const struct fcs_param * const info = &file->params[param];
+    if (file->delimited) {
+        extract_delimited(file, param, first, count, dest);
+    } else if (file->event_bits > 0) {
+        extract_packed(file, info, first, count, dest);
+    } else if (file->datatype == 'A') {
+        const unsigned char * src = file->data + first * file->event_size + info->offset;
+        for (uint64_t i = 0; i < count; ++i, src += file->event_size) {
+            dest[i] = parse_ascii_value(src, info->bits / 8);
+        }
+    } else {
+        extract_records(file, info, file->data + first * file->event_size + info->offset, count, dest);
+    }
+    return FCS_OK;
+}
@@ -0,0 +1,143 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright 2024 Jaroslav Rohel, jaroslav.rohel@gmail.com
+
+// Memory-mapped FCS file reader.
+//
+// The file is mapped to memory and its HEADER and TEXT segments are parsed once by fcs_open().
+// The DATA segment is then accessed without copying (fcs_data(), fcs_event()) or a parameter is
+// converted to an array of floats (fcs_extract()).
+//
+// Supported are list mode files ($MODE L) of FCS 2.0, 3.0 and 3.1 with:
+// - $DATATYPE I - unsigned integers, $PnB of any multiple of 8 up to 64 bits, masked by $PnR;
+//   other $PnB (up to 64) are read as a bit stream packed from the most significant bit
+// - $DATATYPE F and D - 32 and 64 bits floating point numbers
+// - $DATATYPE A - ASCII numbers, fixed width ($PnB digits) or delimited ($PnB *)
+// - any $BYTEORD permutation, eg 1,2,3,4 (little-endian), 4,3,2,1 (big-endian) or 3,4,1,2
+//
+// Parameters are indexed from 0 (the parameter 0 is $P1).
+// Built by "make libfcsreader.a".
+
+#ifndef FCSREADER_H
+#define FCSREADER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum fcs_status {
+    FCS_OK = 0,
+    FCS_ERROR_IO,           // the file cannot be opened or mapped, errno is set
+    FCS_ERROR_FORMAT,       // the file is not a valid FCS file
+    FCS_ERROR_UNSUPPORTED,  // unsupported mode, data type or byte order
+    FCS_ERROR_RANGE         // parameter or event index out of range
+};
+
+struct fcs_file;
+
+// Maps the file `path` and parses its HEADER and TEXT segments.
+enum fcs_status fcs_open(const char * path, struct fcs_file ** file);
+
+// Same as fcs_open() with the file content in memory. The memory must remain valid until fcs_close().
+enum fcs_status fcs_open_memory(const void * data, size_t size, struct fcs_file ** file);
+
+void fcs_close(struct fcs_file * file);
+
+const char * fcs_status_str(enum fcs_status status);
+
+// Keywords of the TEXT segment in the file order.
+size_t fcs_keyword_count(const struct fcs_file * file);
+void fcs_keyword_at(const struct fcs_file * file, size_t idx, const char ** key, const char ** value);
+
+// Returns the value of the keyword (case insensitive) or NULL.
+const char * fcs_keyword(const struct fcs_file * file, const char * key);
+
+unsigned int fcs_parameter_count(const struct fcs_file * file);
+
+// Returns $PnN of the parameter, "Pn" if it is missing.
+const char * fcs_parameter_name(const struct fcs_file * file, unsigned int param);
+
+// Returns the index of the parameter with the name $PnN or -1.
+int fcs_parameter_index(const struct fcs_file * file, const char * name);
+
+uint64_t fcs_event_count(const struct fcs_file * file);
+
+// Returns the DATA segment.
+const void * fcs_data(const struct fcs_file * file, size_t * len);
+
+// Returns the size of an event record in bytes, 0 if the records are not byte aligned
+// (bit packed integers, delimited ASCII).
+size_t fcs_event_size(const struct fcs_file * file);
+
+// Returns the event record `event` or NULL if the records are not byte aligned or the index is out of range.
+const void * fcs_event(const struct fcs_file * file, uint64_t event);
+
+// Converts the values of the parameter of events `first` to `first + count - 1` to floats.
+enum fcs_status fcs_extract(
+    const struct fcs_file * file, unsigned int param, uint64_t first, uint64_t count, float * dest);
+
+// Value decoding primitives. The receiver uses them to decode the DATA segment of a file while it is
+// being received, without mapping the file.
+
+#define FCS_MAX_BYTEORD_LEN 8
+
+// How the bytes of a value are ordered in the file.
+enum fcs_byte_order { FCS_ORDER_LITTLE, FCS_ORDER_BIG, FCS_ORDER_PERMUTED };
+
+// Parsed $BYTEORD, the significance of the bytes in the file order, 0 = least significant.
+struct fcs_byteord {
+    unsigned char bytes[FCS_MAX_BYTEORD_LEN];
+    unsigned int len;
+};
+
+// Parses a non-negative number of `len` characters padded by spaces. A blank string is 0.
+bool fcs_parse_size(const char * str, size_t len, size_t * value);
+
+// Returns the next keyword or value of the TEXT segment starting at `*pos` and moves `*pos` behind it.
+// A doubled delimiter is a delimiter in the keyword or value. The returned string is released by free().
+char * fcs_text_token(const char * text, size_t len, char delim, size_t * pos);
+
+// Parses $BYTEORD, a permutation of the numbers 1 to n.
+enum fcs_status fcs_parse_byteord(const char * value, struct fcs_byteord * byteord);
+
+// Returns the byte order of values of `width` bytes. A permutation which is neither ascending
+// nor descending applies only to the values of its width. An empty $BYTEORD is little-endian.
+enum fcs_byte_order fcs_value_byte_order(const struct fcs_byteord * byteord, unsigned int width);
+
+// Returns the mask of the bits used by integer values with the range $PnR, all bits if `range` is NULL.
+uint64_t fcs_range_mask(const char * range);
+
+// Loads an unsigned integer of `width` bytes in the order FCS_ORDER_LITTLE or FCS_ORDER_BIG.
+// The shift sequences are compiled to a load and a byte swap.
+static inline uint64_t fcs_load_uint(const unsigned char * src, unsigned int width, enum fcs_byte_order order) {
+    uint64_t value = 0;
+    if (order == FCS_ORDER_BIG) {
+        for (unsigned int i = 0; i < width; ++i) {
+            value = (value << 8) | src[i];
+        }
+    } else {
+        for (unsigned int i = width; i > 0; --i) {
+            value = (value << 8) | src[i - 1];
+        }
+    }
+    return value;
+}
+
+// Loads an unsigned integer of `width` bytes in the order FCS_ORDER_PERMUTED.
+static inline uint64_t fcs_load_uint_permuted(
+    const struct fcs_byteord * byteord, const unsigned char * src, unsigned int width) {
+    uint64_t value = 0;
+    for (unsigned int i = 0; i < width; ++i) {
+        value |= (uint64_t)src[i] << (8 * byteord->bytes[i]);
+    }
+    return value;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// Copyright 2024 Jaroslav Rohel, jaroslav.rohel@gmail.com
+
+// Fuzzing harness for the transfer protocol parser.
+//
+// The input is a sequence of records. Each record starts with a length byte followed by that many bytes
+// of received data. The length 0 simulates the expiration of the intercharacter timeout.
+// Received files are written to /dev/null.
+//
+// Built with libFuzzer when CYFLOWREC_LIBFUZZER is defined. Otherwise a standalone driver is built. It runs
+// the inputs given as file arguments (or stdin) once, which is usable for AFL and for corpus replay.
+
+#define CYFLOWREC_NO_MAIN
+#include "../cyflowrec.c"
+
+#include <stdint.h>
+
+
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size) {
+    static struct tokens tokens = {0};
+    if (tokens.len == 0) {
+        if (!freopen("/dev/null", "w", stdout)) {
+            abort();
+        }
+        tokens = parse_storage_file_path("/dev/null", received_file_name);
+    }
+
+    struct receiver rcv;
+    receiver_init(&rcv, tokens);
+    size_t pos = 0;
+    while (pos < size) {
+        size_t chunk_len = data[pos++];
+        if (chunk_len == 0) {
+            receiver_timeout(&rcv);
+            continue;
+        }
+        if (chunk_len > size - pos) {
+            chunk_len = size - pos;
+        }
+        receiver_process(&rcv, (const char *)data + pos, chunk_len);
+        pos += chunk_len;
+    }
+    receiver_reset(&rcv);
+    return 0;
+}
+
+
+#ifndef CYFLOWREC_LIBFUZZER
+static bool run_file(FILE * file) {
+    uint8_t * data = NULL;
+    size_t size = 0;
+    size_t capacity = 0;
+    while (true) {
+        if (size == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            data = realloc_assert(data, capacity);
+        }
+        const size_t read_len = fread(data + size, 1, capacity - size, file);
+        if (read_len == 0) {
+            break;
+        }
+        size += read_len;
+    }
+    const bool ok = !ferror(file);
+    if (ok) {
+        LLVMFuzzerTestOneInput(data, size);
+    }
+    free(data);
+    return ok;
+}
+
+
+int main(int argc, char * argv[]) {
+    if (argc < 2) {
+        return run_file(stdin) ? 0 : 1;
+    }
+    for (int i = 1; i < argc; ++i) {
+        FILE * const file = fopen(argv[i], "rb");
+        if (!file) {
+            fprintf(stderr, "Cannot open \"%s\": %s\n", argv[i], strerror(errno));
+            return 1;
+        }
+        const bool ok = run_file(file);
+        fclose(file);
+        if (!ok) {
+            fprintf(stderr, "Cannot read \"%s\"\n", argv[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+#endif